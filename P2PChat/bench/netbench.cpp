@@ -0,0 +1,470 @@
+#include "UiNetlibInterfaces.h"
+#include "NetCoroutines.h"
+#include "logging.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <new>
+#include <random>
+#include <thread>
+
+/*
+ Loopback benchmark for the networking engines: one instance sends a burst of TEXT messages
+ to another instance running the same engine and we measure how long it takes until the
+ receiver has seen all of them.
+ Then the same over the epoll engine with compression off and on, for a pasted log, an
+ uncompressed bitmap and random bytes standing in for a JPEG, to weigh CPU against bytes saved.
+ Then a pasted log announced to many peers with sendMessage() per peer against broadcast().
+ Then round trips between two coroutines (CoNetwork) on every engine, one awaiting the echo of the other.
+ Last, many connections to an epoll receiver with a loop per core, accepted by the first loop or by
+ every loop on its own SO_REUSEPORT socket.
+ Usage: NetBench [messages] [message_size] [base_port]
+ */
+
+#define COMPRESSION_BENCH_MESSAGES 200
+#define BROADCAST_BENCH_PEERS      64
+#define BROADCAST_BENCH_MESSAGES   100
+#define ROUND_TRIP_BENCH_MESSAGES  2000
+#define ACCEPT_BENCH_PEERS         4000
+#define SHARED_RING_BENCH_SIZE     (4 * 1024 * 1024)
+#define UNIX_IMAGE_BENCH_MESSAGES  50
+#define UNIX_IMAGE_BENCH_SIZE      (4 * 1024 * 1024)
+
+//Every heap allocation of the process, netlib included, so we can tell what a message costs
+static std::atomic<uint64_t> allocations{0};
+
+void *operator new(std::size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if(void *memory = std::malloc(size == 0 ? 1 : size))
+        return memory;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *memory) noexcept {
+    std::free(memory);
+}
+
+void operator delete(void *memory, std::size_t) noexcept {
+    std::free(memory);
+}
+
+class BenchCallbacks : public UiCallbacks {
+private:
+    std::mutex mutex;
+    std::condition_variable changed;
+    bool bound = false;
+    bool authenticated = false;
+    size_t authentications = 0;
+    size_t received = 0;
+
+public:
+    void bindSucceeded() override {
+        std::lock_guard<std::mutex> lock(mutex);
+        bound = true;
+        changed.notify_all();
+    }
+
+    void newAuthMessage(std::string peerName, std::unique_ptr<AuthMessage> authMsg) override {
+        std::lock_guard<std::mutex> lock(mutex);
+        authenticated = true;
+        authentications++;
+        changed.notify_all();
+    }
+
+    void newTextMessage(std::string peerName, std::unique_ptr<TextMessage> txtMsg) override {
+        std::lock_guard<std::mutex> lock(mutex);
+        received++;
+        changed.notify_all();
+    }
+
+    void newImageMessage(std::string peerName, std::unique_ptr<ImageMessage> imgMsg) override {
+        std::lock_guard<std::mutex> lock(mutex);
+        received++;
+        changed.notify_all();
+    }
+
+    void peerDisconnected(const std::string peerName) override {}
+
+    template<typename Pred> bool waitFor(Pred pred) {
+        std::unique_lock<std::mutex> lock(mutex);
+        return changed.wait_for(lock, std::chrono::seconds(60), pred);
+    }
+
+    void waitBound() { waitFor([this](){ return bound; }); }
+    bool waitAuthenticated() { return waitFor([this](){ return authenticated; }); }
+    bool waitAuthentications(size_t count) { return waitFor([this, count](){ return authentications >= count; }); }
+    bool waitReceived(size_t count) { return waitFor([this, count](){ return received >= count; }); }
+};
+
+const char *engineName(NetEngine engine) {
+    switch (engine) {
+        case NetEngine::THREADED: return "threaded";
+        case NetEngine::EPOLL:    return "epoll";
+        case NetEngine::IO_URING: return "io_uring";
+    }
+    return "?";
+}
+
+//With sharedRing both sides offer (and take) a shared memory ring of that size instead of TCP
+void runEngine(NetEngine engine, int port, size_t messages, size_t messageSize, size_t sharedRing = 0) {
+    BenchCallbacks receiverCallbacks, senderCallbacks;
+    NetConfig config;
+    config.engine = engine;
+    config.sharedMemoryRing = sharedRing;
+    auto receiver = createNetworking(port, &receiverCallbacks, config);
+    auto sender = createNetworking(port + 1, &senderCallbacks, config);
+    receiverCallbacks.waitBound();
+    senderCallbacks.waitBound();
+
+    Peer peer("bench-receiver", "127.0.0.1", static_cast<short>(port));
+    if(!sender->connectPeer(peer)) {
+        std::cerr << engineName(engine) << ": cannot connect" << std::endl;
+        return;
+    }
+    sender->sendMessage(peer.name, AuthMessage("bench-sender"));
+    receiverCallbacks.waitAuthenticated();
+    //The ring is offered right after AUTH, measure once both sides moved to it
+    if(sharedRing > 0)
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    TextMessage text(std::string(messageSize, 'x'));
+    uint64_t allocationsBefore = allocations.load();
+    auto start = std::chrono::steady_clock::now();
+    for(size_t i=0; i<messages; i++)
+        sender->sendMessage(peer.name, text);
+    bool completed = receiverCallbacks.waitReceived(messages);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    //Both sides, sending and receiving
+    double allocationsPerMessage = double(allocations.load() - allocationsBefore) / messages;
+
+    double seconds = elapsed.count();
+    std::cout << engineName(engine) << (sharedRing > 0 ? " ring" : "") << "\t" << messages << " msgs x " << messageSize << " B\t"
+              << seconds * 1000 << " ms\t" << messages / seconds << " msg/s\t"
+              << (messages * messageSize) / seconds / (1024 * 1024) << " MiB/s\t"
+              << allocationsPerMessage << " allocs/msg"
+              << (completed ? "" : "\t(timed out)") << std::endl;
+}
+
+//What the payloads of the compression benchmark look like
+std::string logPayload(size_t size) {
+    std::string log;
+    for(size_t line = 0; log.size() < size; line++)
+        log += "2024-05-01 12:00:" + std::to_string(line % 60) + " [info] worker " + std::to_string(line % 8) +
+               " handled request " + std::to_string(line * 7919) + " in " + std::to_string(line % 97) + " ms\n";
+    log.resize(size);
+    return log;
+}
+
+std::shared_ptr<std::vector<uint8_t>> bitmapPayload(size_t size) {
+    auto bitmap = std::make_shared<std::vector<uint8_t>>(size);
+    for(size_t i=0; i<size; i++)
+        (*bitmap)[i] = static_cast<uint8_t>((i / 3) % 512 / 2 + (i % 3) * 16);
+    return bitmap;
+}
+
+std::shared_ptr<std::vector<uint8_t>> randomPayload(size_t size) {
+    auto data = std::make_shared<std::vector<uint8_t>>(size);
+    std::mt19937 random(42);
+    for(auto &byte : *data)
+        byte = static_cast<uint8_t>(random());
+    return data;
+}
+
+void runCompression(int port, const char *name, const Message &message, size_t messageSize, bool compression) {
+    BenchCallbacks receiverCallbacks, senderCallbacks;
+    NetConfig config;
+    config.engine = NetEngine::EPOLL;
+    config.compression = compression;
+    auto receiver = createNetworking(port, &receiverCallbacks, config);
+    auto sender = createNetworking(port + 1, &senderCallbacks, config);
+    receiverCallbacks.waitBound();
+    senderCallbacks.waitBound();
+
+    Peer peer("bench-receiver", "127.0.0.1", static_cast<short>(port));
+    if(!sender->connectPeer(peer)) {
+        std::cerr << name << ": cannot connect" << std::endl;
+        return;
+    }
+    sender->sendMessage(peer.name, AuthMessage("bench-sender"));
+    receiverCallbacks.waitAuthenticated();
+    //The AUTH_ACK that tells the sender about the receiver's codecs
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    CompressionStats before = getCompressionStats();
+    auto start = std::chrono::steady_clock::now();
+    for(size_t i=0; i<COMPRESSION_BENCH_MESSAGES; i++)
+        sender->sendMessage(peer.name, message);
+    bool completed = receiverCallbacks.waitReceived(COMPRESSION_BENCH_MESSAGES);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    CompressionStats after = getCompressionStats();
+
+    uint64_t plainBytes = uint64_t(COMPRESSION_BENCH_MESSAGES) * messageSize;
+    uint64_t savedBytes = (after.plainBytes - before.plainBytes) - (after.compressedBytes - before.compressedBytes);
+    double seconds = elapsed.count();
+    std::cout << name << (compression ? "\ton" : "\toff") << "\t" << seconds * 1000 << " ms\t"
+              << plainBytes / seconds / (1024 * 1024) << " MiB/s\t"
+              << double(plainBytes - savedBytes) / (1024 * 1024) << " MiB sent\t"
+              << (after.compressNanos - before.compressNanos) / 1e6 << " ms compressing\t"
+              << (after.decompressNanos - before.decompressNanos) / 1e6 << " ms decompressing"
+              << (after.skipped > before.skipped ? "\t(skipped by entropy)" : "")
+              << (completed ? "" : "\t(timed out)") << std::endl;
+}
+
+//How the announcement goes out: a sendMessage() per peer, a SerializedMessage sent to each, or broadcast()
+enum class Announce {
+    SEND_MESSAGE,
+    SERIALIZED,
+    BROADCAST
+};
+
+//The sender connects BROADCAST_BENCH_PEERS times to one receiver, each connection a peer of its own
+void runBroadcast(int port, const Message &message, Announce announce) {
+    BenchCallbacks receiverCallbacks, senderCallbacks;
+    NetConfig config;
+    config.engine = NetEngine::EPOLL;
+    auto receiver = createNetworking(port, &receiverCallbacks, config);
+    auto sender = createNetworking(port + 1, &senderCallbacks, config);
+    receiverCallbacks.waitBound();
+    senderCallbacks.waitBound();
+
+    std::vector<Peer> peers;
+    std::vector<std::string> names;
+    for(int i=0; i<BROADCAST_BENCH_PEERS; i++) {
+        peers.emplace_back("bench-receiver-" + std::to_string(i), "127.0.0.1", static_cast<short>(port));
+        names.push_back(peers.back().name);
+    }
+    std::mutex mutex;
+    std::condition_variable connected;
+    size_t finished = 0;
+    sender->connectPeers(peers, AuthMessage("bench-sender"), [&](const Peer&, bool){
+        std::lock_guard<std::mutex> lock(mutex);
+        finished++;
+        connected.notify_all();
+    });
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        connected.wait(lock, [&](){ return finished == peers.size(); });
+    }
+    //The AUTH_ACKs that tell the sender about the receiver's codecs
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    CompressionStats before = getCompressionStats();
+    uint64_t allocationsBefore = allocations.load();
+    auto start = std::chrono::steady_clock::now();
+    for(size_t i=0; i<BROADCAST_BENCH_MESSAGES; i++) {
+        if(announce == Announce::BROADCAST) {
+            sender->broadcast(names, message);
+        } else if(announce == Announce::SERIALIZED) {
+            auto serialized = sender->serialize(message);
+            for(auto &name : names)
+                sender->sendMessage(name, serialized, nullptr);
+        } else {
+            for(auto &name : names)
+                sender->sendMessage(name, message);
+        }
+    }
+    std::chrono::duration<double> queued = std::chrono::steady_clock::now() - start;
+    size_t deliveries = BROADCAST_BENCH_MESSAGES * names.size();
+    bool completed = receiverCallbacks.waitReceived(deliveries);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    CompressionStats after = getCompressionStats();
+
+    const char *name = announce == Announce::BROADCAST ? "broadcast" :
+                       announce == Announce::SERIALIZED ? "serialized" : "sendMessage";
+    std::cout << name << "\t" << queued.count() * 1000 << " ms queueing	"
+              << elapsed.count() * 1000 << " ms delivered	"
+              << (after.compressNanos - before.compressNanos) / 1e6 << " ms compressing	"
+              << double(allocations.load() - allocationsBefore) / deliveries << " allocs/delivery"
+              << (completed ? "" : "\t(timed out)") << std::endl;
+}
+
+CoTask<> echoPeer(CoNetwork &network) {
+    CoConnection connection = co_await network.accept();
+    while(auto message = co_await connection.receive()) {
+        if(!co_await connection.send(*message))
+            break;
+    }
+}
+
+CoTask<size_t> pingPeer(CoConnection connection, size_t messages) {
+    TextMessage ping("ping");
+    size_t answered = 0;
+    for(; answered < messages; answered++) {
+        co_await connection.send(ping);
+        if(co_await connection.receive() == nullptr)
+            break;
+    }
+    co_return answered;
+}
+
+CoTask<> pingEcho(CoNetwork &network, Peer peer, size_t &answered) {
+    CoConnection connection = co_await network.connect(peer);
+    if(connection)
+        answered = co_await pingPeer(connection, ROUND_TRIP_BENCH_MESSAGES);
+}
+
+void runRoundTrips(NetEngine engine, int port, size_t sharedRing = 0) {
+    NetConfig config;
+    config.engine = engine;
+    config.sharedMemoryRing = sharedRing;
+    auto echo = createCoNetworking(port, "bench-echo", config);
+    auto ping = createCoNetworking(port + 1, "bench-ping", config);
+    echo->spawn(echoPeer(*echo));
+
+    size_t answered = 0;
+    auto start = std::chrono::steady_clock::now();
+    ping->spawn(pingEcho(*ping, Peer("bench-echo", "127.0.0.1", static_cast<short>(port)), answered)).get();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    std::cout << engineName(engine) << (sharedRing > 0 ? " ring" : "") << "\t" << answered << " round trips\t"
+              << elapsed.count() * 1e6 / std::max<size_t>(answered, 1) << " us each" << std::endl;
+}
+
+//Both receivers are bound before the first connection, whose ephemeral ports could take theirs
+//Images from a peer on this host over AF_UNIX, through the socket or, with passDescriptors, in memfds
+void runUnixImages(int port, bool passDescriptors) {
+    BenchCallbacks receiverCallbacks, senderCallbacks;
+    NetConfig config;
+    config.engine = NetEngine::EPOLL;
+    config.unixSocketPath = "/tmp/netbench-" + std::to_string(port) + ".sock";
+    config.passDescriptorMinSize = passDescriptors ? 64 * 1024 : 0;
+    auto receiver = createNetworking(port, &receiverCallbacks, config);
+    NetConfig senderConfig = config;
+    senderConfig.unixSocketPath.clear();
+    auto sender = createNetworking(port + 1, &senderCallbacks, senderConfig);
+    receiverCallbacks.waitBound();
+    senderCallbacks.waitBound();
+
+    Peer peer("bench-receiver", "127.0.0.1", static_cast<short>(port));
+    peer.unixPath = config.unixSocketPath;
+    if(!sender->connectPeer(peer)) {
+        std::cerr << "unix: cannot connect" << std::endl;
+        return;
+    }
+    sender->sendMessage(peer.name, AuthMessage("bench-sender"));
+    receiverCallbacks.waitAuthenticated();
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));  //the AUTH_ACK tells the sender what we take
+
+    ImageMessage image(randomPayload(UNIX_IMAGE_BENCH_SIZE));
+    auto start = std::chrono::steady_clock::now();
+    for(size_t i=0; i<UNIX_IMAGE_BENCH_MESSAGES; i++)
+        sender->sendMessage(peer.name, image);
+    bool completed = receiverCallbacks.waitReceived(UNIX_IMAGE_BENCH_MESSAGES);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    double seconds = elapsed.count();
+    std::cout << (passDescriptors ? "memfd" : "socket") << "	" << seconds * 1000 << " ms	"
+              << UNIX_IMAGE_BENCH_MESSAGES / seconds << " img/s	"
+              << (double(UNIX_IMAGE_BENCH_MESSAGES) * UNIX_IMAGE_BENCH_SIZE) / seconds / (1024 * 1024) << " MiB/s"
+              << (completed ? "" : "\t(timed out)") << std::endl;
+}
+
+void runAccepts(int port) {
+    BenchCallbacks receiverCallbacks[2], senderCallbacks;
+    std::unique_ptr<NetOps> receivers[2];
+    NetConfig config;
+    config.engine = NetEngine::EPOLL;
+    config.ioThreads = 0;
+    for(int reusePort : {0, 1}) {
+        config.reusePort = reusePort;
+        receivers[reusePort] = createNetworking(port + 2 * reusePort, &receiverCallbacks[reusePort], config);
+        receiverCallbacks[reusePort].waitBound();
+    }
+    config.reusePort = false;
+    config.connectConcurrency = 256;
+    auto sender = createNetworking(port + 1, &senderCallbacks, config);
+    senderCallbacks.waitBound();
+
+    for(int reusePort : {0, 1}) {
+        std::vector<Peer> peers;
+        for(int i=0; i<ACCEPT_BENCH_PEERS; i++)
+            peers.emplace_back("bench-receiver-" + std::to_string(i), "127.0.0.1", static_cast<short>(port + 2 * reusePort));
+        std::atomic<size_t> failed{0};
+        auto start = std::chrono::steady_clock::now();
+        sender->connectPeers(peers, AuthMessage("bench-sender"), [&failed](const Peer&, bool connected){
+            if(!connected)
+                failed++;
+        });
+        bool completed = receiverCallbacks[reusePort].waitAuthentications(ACCEPT_BENCH_PEERS);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        std::cout << (reusePort ? "reuseport" : "one listener") << "\t" << ACCEPT_BENCH_PEERS << " connections\t"
+                  << elapsed.count() * 1000 << " ms\t" << ACCEPT_BENCH_PEERS / elapsed.count() << " conn/s"
+                  << (failed > 0 ? "\t(" + std::to_string(failed) + " failed)" : "")
+                  << (completed ? "" : "\t(timed out)") << std::endl;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    init_logging();
+    getLogger()->set_level(spdlog::level::err);
+
+    size_t messages = argc > 1 ? std::stoul(argv[1]) : 20000;
+    size_t messageSize = argc > 2 ? std::stoul(argv[2]) : 256;
+
+    int port = argc > 3 ? std::stoi(argv[3]) : 27200;  //below the ephemeral ports, which the connections of the benchmarks keep busy
+    for(NetEngine engine : {NetEngine::THREADED, NetEngine::EPOLL, NetEngine::IO_URING}) {
+        runEngine(engine, port, messages, messageSize);
+        port += 2;
+    }
+
+    //Only classes that were used, the pool is shared by every engine above
+    ReceiveBufferStats pool = getReceiveBufferStats();
+    std::cout << "receive buffers\tsize\tthread hits\tshared hits\tmisses" << std::endl;
+    for(auto &sizeClass : pool.classes) {
+        if(sizeClass.threadHits + sizeClass.sharedHits + sizeClass.misses == 0)
+            continue;
+        std::cout << "\t\t" << sizeClass.bufferSize << "\t" << sizeClass.threadHits << "\t\t"
+                  << sizeClass.sharedHits << "\t\t" << sizeClass.misses << std::endl;
+    }
+    std::cout << "\t\toversized: " << pool.oversized << std::endl;
+
+    size_t payloadSize = 256 * 1024;
+    TextMessage log(logPayload(payloadSize));
+    ImageMessage bitmap(bitmapPayload(payloadSize));
+    ImageMessage random(randomPayload(payloadSize));
+    std::cout << "compression, " << COMPRESSION_BENCH_MESSAGES << " msgs x " << payloadSize << " B over epoll" << std::endl;
+    for(bool compression : {false, true}) {
+        runCompression(port, "log", log, payloadSize, compression);
+        runCompression(port + 2, "bitmap", bitmap, payloadSize, compression);
+        runCompression(port + 4, "random", random, payloadSize, compression);
+        port += 6;
+    }
+
+    size_t announcementSize = 4096;
+    TextMessage announcement(logPayload(announcementSize));
+    std::cout << "announcement, " << BROADCAST_BENCH_MESSAGES << " msgs x " << announcementSize << " B to "
+              << BROADCAST_BENCH_PEERS << " peers over epoll" << std::endl;
+    for(Announce announce : {Announce::SEND_MESSAGE, Announce::SERIALIZED, Announce::BROADCAST}) {
+        runBroadcast(port, announcement, announce);
+        port += 2;
+    }
+
+    std::cout << "round trips between coroutines" << std::endl;
+    for(NetEngine engine : {NetEngine::THREADED, NetEngine::EPOLL, NetEngine::IO_URING}) {
+        runRoundTrips(engine, port);
+        port += 2;
+    }
+
+    std::cout << "same host, TCP and a shared memory ring of " << SHARED_RING_BENCH_SIZE << " B" << std::endl;
+    for(size_t sharedRing : {size_t(0), size_t(SHARED_RING_BENCH_SIZE)}) {
+        runEngine(NetEngine::EPOLL, port, messages, messageSize, sharedRing);
+        runRoundTrips(NetEngine::EPOLL, port + 2, sharedRing);
+        port += 4;
+    }
+
+    std::cout << "same host, " << UNIX_IMAGE_BENCH_MESSAGES << " images x " << UNIX_IMAGE_BENCH_SIZE
+              << " B over AF_UNIX and epoll" << std::endl;
+    for(bool passDescriptors : {false, true}) {
+        runUnixImages(port, passDescriptors);
+        port += 2;
+    }
+
+    std::cout << "accepting, epoll with " << std::thread::hardware_concurrency() << " loops" << std::endl;
+    runAccepts(port);
+    return 0;
+}
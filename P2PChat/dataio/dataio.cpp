@@ -19,6 +19,8 @@ public:
         for(auto &peerInfo : peersArray){
             try {
                 Peer p(peerInfo["name"], peerInfo["ip"], peerInfo["port"]);
+                if(peerInfo.contains("unix"))
+                    p.unixPath = peerInfo["unix"];
                 getLogger()->info("Peer data fetched: {}, {}, {}", p.name, p.IPv4, p.port);
                 result->push_back(std::move(p));
             } catch (json::exception &e){
@@ -52,6 +54,8 @@ public:
             if(row.size()<3)
                 continue;
             Peer p(row[0], row[1], std::stoi(row[2]));
+            if(row.size() > 3)
+                p.unixPath = row[3];
             getLogger()->info("Peer data fetched: {}, {}, {}", p.name, p.IPv4, p.port);
             result->push_back(std::move(p));
         }
@@ -1,6 +1,8 @@
 #ifndef P2PCHAT_MESSAGETYPES_H
 #define P2PCHAT_MESSAGETYPES_H
 
+#include <cstdint>
+#include <memory>
 #include <string>
 #include <vector>
 #include <google/protobuf/repeated_field.h>
@@ -9,6 +11,15 @@ enum class MessageType{
     AUTH = 0,
     TEXT = 1,
     IMAGE = 2,
+    AUTH_ACK = 3,  //answered by netlib itself, never reaches UiCallbacks
+    FILE = 4,
+    FILE_CHUNK = 5,  //part of a FILE, written to disk by netlib
+    CREDIT = 6,  //flow control, never reaches UiCallbacks
+    IMAGE_CHUNK = 7,  //part of a big IMAGE, reassembled by netlib
+    IMAGE_RESUME = 8,  //chunks of an IMAGE a peer still needs, never reaches UiCallbacks
+    PING = 9,  //keepalive without a body, never reaches UiCallbacks
+    RING_OFFER = 10,  //shared memory for a peer on the same host, never reaches UiCallbacks
+    RING_SWITCH = 11,  //the answer, and the last frame over TCP; never reaches UiCallbacks
     INVALID = 100
 };
 
@@ -50,4 +61,13 @@ struct ImageMessage : Message {
     explicit ImageMessage(std::shared_ptr<std::vector<uint8_t>> _image) : Message(MessageType::IMAGE), image(_image) {}
 };
 
+//Sending one streams the file at path, a received one tells where the file was stored
+struct FileMessage : Message {
+    std::string path;
+    std::string name;  //file name the sender announced
+    uint64_t size = 0;
+    FileMessage() = default;
+    explicit FileMessage(const std::string &_path) : Message(MessageType::FILE), path(_path) {}
+};
+
 #endif
@@ -0,0 +1,201 @@
+#ifndef P2PCHAT_NETCOROUTINES_H
+#define P2PCHAT_NETCOROUTINES_H
+
+#include "UiNetlibInterfaces.h"
+
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+/*
+ Awaitable front end of NetOps, for bots and test harnesses that read better as straight-line code
+ than as a set of callbacks. Every coroutine of a CoNetwork runs on its event loop thread and every
+ co_await resumes there, so they run one at a time and need no locking among themselves, however many
+ peers they talk to. They must not block that thread (blocking NetOps calls, waiting for spawn()).
+ Coroutines still suspended when the CoNetwork is destroyed are never resumed.
+ */
+
+template<typename T>
+struct CoTaskResult {
+    std::optional<T> value;
+    void return_value(T result) { value = std::move(result); }
+    T take() { return std::move(*value); }
+};
+
+template<>
+struct CoTaskResult<void> {
+    void return_void() {}
+    void take() {}
+};
+
+//Starts when it is co_awaited (or spawned) and resumes its awaiter with the result once it is done
+template<typename T = void>
+class CoTask {
+public:
+    struct promise_type : CoTaskResult<T> {
+        std::coroutine_handle<> continuation;
+        std::exception_ptr exception;
+
+        CoTask get_return_object() { return CoTask(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        auto final_suspend() noexcept {
+            struct Finished {
+                bool await_ready() noexcept { return false; }
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept {
+                    auto continuation = handle.promise().continuation;
+                    return continuation ? continuation : std::noop_coroutine();
+                }
+                void await_resume() noexcept {}
+            };
+            return Finished{};
+        }
+        void unhandled_exception() { exception = std::current_exception(); }
+    };
+
+    CoTask(CoTask &&other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+    CoTask(const CoTask&) = delete;
+    CoTask& operator=(const CoTask&) = delete;
+    ~CoTask() {
+        if(handle)
+            handle.destroy();
+    }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) {
+        handle.promise().continuation = awaiting;
+        return handle;
+    }
+    T await_resume() {
+        if(handle.promise().exception)
+            std::rethrow_exception(handle.promise().exception);
+        return handle.promise().take();
+    }
+
+private:
+    std::coroutine_handle<promise_type> handle;
+
+    explicit CoTask(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+};
+
+class CoConnection;
+class EventLoop;
+struct CoInbox;
+
+class CoNetwork {
+public:
+    //co_await: true when the whole message was handed to the kernel, like a SendCompletion
+    class Send {
+        CoNetwork *network;
+        std::string peerName;
+        const Message &message;
+        bool sent = false;
+    public:
+        Send(CoNetwork *network, std::string peerName, const Message &message) :
+                network(network), peerName(std::move(peerName)), message(message) {}
+        bool await_ready() const { return false; }
+        void await_suspend(std::coroutine_handle<> handle);
+        bool await_resume() const { return sent; }
+    };
+
+    //co_await: the connection, which converts to false when the peer could not be reached
+    class Connect {
+        CoNetwork *network;
+        Peer peer;
+        std::shared_ptr<CoInbox> inbox;
+    public:
+        Connect(CoNetwork *network, Peer peer) : network(network), peer(std::move(peer)) {}
+        bool await_ready() const { return false; }
+        void await_suspend(std::coroutine_handle<> handle);
+        CoConnection await_resume();
+    };
+
+    //co_await: the connection of the next peer that connected to us and sent its AUTH
+    class Accept {
+        CoNetwork *network;
+        std::shared_ptr<CoInbox> inbox;
+        std::coroutine_handle<> waiting;
+        friend class CoNetwork;
+    public:
+        explicit Accept(CoNetwork *network) : network(network) {}
+        bool await_ready() const { return false; }
+        bool await_suspend(std::coroutine_handle<> handle);
+        CoConnection await_resume();
+    };
+
+private:
+    struct Callbacks;
+
+    std::string name;
+    std::unique_ptr<EventLoop> loop;
+    std::unique_ptr<Callbacks> callbacks;
+    std::unique_ptr<NetOps> ops;
+
+    std::mutex mutex;  //of everything below, touched by the networking threads too
+    std::unordered_map<std::string, std::shared_ptr<CoInbox>> inboxes;
+    std::deque<std::shared_ptr<CoInbox>> accepted;
+    std::deque<Accept*> acceptors;
+
+    void resume(std::coroutine_handle<> handle);
+    std::shared_ptr<CoInbox> openInbox(const std::string &peerName);
+    void closeInbox(const std::string &peerName, const std::shared_ptr<CoInbox> &inbox);
+
+    friend struct CoInbox;
+
+public:
+    //name is sent in the AUTH of every connection we establish
+    CoNetwork(int port, const std::string &name, const NetConfig &config);
+    ~CoNetwork();
+    CoNetwork(const CoNetwork&) = delete;
+    CoNetwork& operator=(const CoNetwork&) = delete;
+
+    //Runs the task on the event loop, the future tells when it is done or what it threw
+    std::future<void> spawn(CoTask<void> task);
+
+    Connect connect(const Peer &peer) { return Connect(this, peer); }
+    Accept accept() { return Accept(this); }
+    Send send(const std::string &peerName, const Message &message) { return Send(this, peerName, message); }
+    NetOps &netOps() { return *ops; }
+};
+
+//A peer we can talk to, as long as its connection lasts
+class CoConnection {
+public:
+    //co_await: the next TEXT, IMAGE or FILE of the peer, null once it disconnected and all before were received
+    class Receive {
+        std::shared_ptr<CoInbox> inbox;
+        std::unique_ptr<Message> message;
+        std::coroutine_handle<> waiting;
+        friend struct CoInbox;
+    public:
+        explicit Receive(std::shared_ptr<CoInbox> inbox) : inbox(std::move(inbox)) {}
+        bool await_ready() const { return false; }
+        bool await_suspend(std::coroutine_handle<> handle);
+        std::unique_ptr<Message> await_resume() { return std::move(message); }
+    };
+
+private:
+    CoNetwork *network = nullptr;
+    std::string peerName;
+    std::shared_ptr<CoInbox> inbox;
+
+public:
+    CoConnection() = default;
+    CoConnection(CoNetwork *network, std::string peerName, std::shared_ptr<CoInbox> inbox) :
+            network(network), peerName(std::move(peerName)), inbox(std::move(inbox)) {}
+
+    explicit operator bool() const { return inbox != nullptr; }
+    const std::string &name() const { return peerName; }
+    Receive receive() const { return Receive(inbox); }
+    CoNetwork::Send send(const Message &message) const { return network->send(peerName, message); }
+};
+
+std::unique_ptr<CoNetwork> createCoNetworking(int port, const std::string &name, const NetConfig &config);
+
+#endif
@@ -7,11 +7,14 @@ struct Peer{
     std::string IPv4;
     short port{};
     std::string name;
+    std::string unixPath;  //AF_UNIX socket of a peer on this host, connected to instead of IPv4 and port when set
 
     Peer() = default;
     Peer(const std::string &name, const std::string &iPv4, short port) : name(name), IPv4(iPv4), port(port) {}
 
     bool operator<(const Peer &p) const{
+        if(unixPath != p.unixPath)
+            return unixPath < p.unixPath;
         return (IPv4 == p.IPv4) ?
                (port < p.port) :
                (IPv4 < p.IPv4);
@@ -4,10 +4,10 @@
 #include "MessageTypes.h"
 #include "PeersInfo.h"
 
+#include <functional>
 #include <memory>
-#include <thread>
-#include <shared_mutex>
-#include <map>
+#include <string>
+#include <vector>
 
 class UiCallbacks {
 public:
@@ -16,50 +16,176 @@ public:
     virtual void newTextMessage(std::string peerName, std::unique_ptr<TextMessage> txtMsg)=0;
     virtual void newImageMessage(std::string peerName, std::unique_ptr<ImageMessage> imgMsg)=0;
     virtual void peerDisconnected(const std::string peerName)=0;
+    //A file of the peer was completely written to fileMsg->path
+    virtual void newFileMessage(std::string peerName, std::unique_ptr<FileMessage> fileMsg) {}
+    //Bytes of a file sent to (incoming=false) or received from the peer so far
+    virtual void fileProgress(std::string peerName, std::string fileName, uint64_t transferred,
+                              uint64_t total, bool incoming) {}
+    //More than NetConfig::sendHighWatermark bytes for the peer are waiting, further messages only pile up.
+    //Runs inside the sendMessage() that crossed the watermark.
+    virtual void peerBackpressured(std::string peerName) {}
+    //The waiting bytes dropped to NetConfig::sendLowWatermark again
+    virtual void peerWritable(std::string peerName) {}
     virtual ~UiCallbacks()=default;
 };
 
+//Called once per message: true when all of it was handed to the kernel, false when it was dropped.
+//An IMAGE sent in chunks completes when the peer confirmed it has all of them.
+using SendCompletion = std::function<void(bool sent)>;
+//The SendCompletion of a broadcast(), once per peer of the list
+using BroadcastCompletion = std::function<void(const std::string &peerName, bool sent)>;
+//Called once per connectPeer(): true when the connection is established and the peer can be sent to
+using ConnectCompletion = std::function<void(bool connected)>;
+//Called once per peer of connectPeers(), in the order the attempts finish
+using PeerConnectCompletion = std::function<void(const Peer &peer, bool connected)>;
+
+/*
+ A TEXT or IMAGE encoded by NetOps::serialize(), for messages that are sent again and again. It never
+ changes and can be sent to any peer, from any thread, any number of times without encoding it again.
+ The frames that carry it keep it alive until they are written.
+ */
+class SerializedMessage {
+public:
+    virtual MessageType type() const = 0;
+    virtual size_t size() const = 0;  //of the text or image
+    virtual ~SerializedMessage() = default;
+};
+
+/*
+ sendMessage() only serializes and queues the message, the engine writes it later.
+ The completion runs on a networking thread (or right away when the peer is unknown), so it must not block.
+ The same goes for connectPeer() with a completion, which returns before the connection is established.
+ */
 class NetOps {
 public:
     virtual void sendMessage(const std::string &, const Message &)=0;
-    virtual bool connectPeer(const Peer&)=0;
+    virtual void sendMessage(const std::string &, const Message &, SendCompletion)=0;
+    //Null for messages other than TEXT and IMAGE
+    virtual std::shared_ptr<const SerializedMessage> serialize(const Message &)=0;
+    virtual void sendMessage(const std::string &, const std::shared_ptr<const SerializedMessage> &, SendCompletion)=0;
+    //Like sendMessage() to each of them, but TEXT and IMAGE bodies are serialized (and compressed) only once
+    virtual void broadcast(const std::vector<std::string> &, const Message &)=0;
+    virtual void broadcast(const std::vector<std::string> &, const Message &, BroadcastCompletion)=0;
+    virtual bool connectPeer(const Peer&)=0;  //blocks until connected, or failed after NetConfig::connectTimeout
+    virtual void connectPeer(const Peer&, ConnectCompletion)=0;
+    //Connects to all of them, NetConfig::connectConcurrency at a time, and sends auth to each right after
+    //its connection is established. Returns right away.
+    virtual void connectPeers(const std::vector<Peer>&, const AuthMessage &auth, PeerConnectCompletion)=0;
     virtual void stopListening()=0;
     virtual ~NetOps() = default;
 };
 
-class NetworkCom : NetOps{
-private:
-    bool isListeningLocally;
-    int localPort;
-    int localSocket;
-    UiCallbacks *uiCallbacks;
-    std::unique_ptr<std::thread> listenerThread;
-    std::map<std::string, int> openSockets; //unique_name -> socket_fd
-    std::map<int, std::string> openSocketsToName;
-    std::shared_mutex openSocketsMutex;
-
-    void addNewSocket(const std::string& peerName, int clientSocket);
-    void removeSocket(const std::string& peerName);
-    int getClientSocket(const std::string& peerName);
-    std::string getSocketName(int clientSocket);
-
-    //template<typename T> std::unique_ptr<T> deserializeMessage(const std::unique_ptr<uint8_t>& buffer, size_t size);
-    MessageHeader getMessageHeader(std::unique_ptr<uint8_t> headerBuff);
-    void deserializeHandleMessage(int clientSocket, std::unique_ptr<uint8_t> messageBuff, const MessageHeader &);
-    std::tuple<std::unique_ptr<std::vector<uint8_t>>, int> serializeMessage(const Message& message);
-
-    void startListening();
-    void handleConnections(int clientSocket);
-public:
-    NetworkCom(int _localPort, UiCallbacks *_uiCallbacks);
-    ~NetworkCom() override;
+/*
+ THREADED is the original engine: one blocking thread per connection.
+ EPOLL multiplexes all connections over a few edge-triggered event loops.
+ IO_URING does accept/recv/send through io_uring on a single thread (falls back to EPOLL
+ when the kernel does not allow it).
+ */
+enum class NetEngine {
+    THREADED,
+    EPOLL,
+    IO_URING
+};
+
+struct NetConfig {
+    NetEngine engine = NetEngine::THREADED;
+    int ioThreads = 1;  //number of event loops, only used by EPOLL. 0 is one per core
+    //EPOLL only: every event loop accepts on a SO_REUSEPORT listening socket of its own and keeps the
+    //connections it accepted, instead of the first loop accepting them all and handing them around
+    bool reusePort = false;
+
+    //Messages are decoded and handed to UiCallbacks on a pool, 0 threads does it on the socket reader
+    int dispatchThreads = 2;
+    size_t dispatchQueueDepth = 4096;  //messages waiting in the pool before readers block
+    size_t peerQueueDepth = 256;       //messages of a single peer waiting before its reader blocks
+
+    //Send the old protobuf MessageHeader instead of the binary frame header, for peers built before it.
+    //Both are always accepted, and a peer that sends the old one gets it back even when this is off.
+    bool legacyFraming = false;
+
+    //Flow control, with peers of wire version 5 or later: a peer may send us at most receiveWindow bytes
+    //that we did not handle yet (0 turns it off), and every peer tells us its own window the same way.
+    size_t receiveWindow = 4 * 1024 * 1024;
+    size_t sendHighWatermark = 8 * 1024 * 1024;  //bytes not yet handled by a peer before peerBackpressured
+    size_t sendLowWatermark = 1024 * 1024;       //before peerWritable after that
+
+    //zlib compression of TEXT and IMAGE bodies, used with peers that enable it too. Bodies that are
+    //smaller than compressionMinSize or look compressed already (JPEG, PNG) are sent as they are.
+    bool compression = true;
+    int compressionLevel = 1;  //1 (fastest) to 9 (smallest)
+    size_t compressionMinSize = 1024;
+
+    //Images bigger than this go to peers of wire version 6 or later in checksummed chunks of this size,
+    //and a transfer cut off by a lost connection goes on where it stopped once the peer is back. 0 never.
+    size_t imageChunkSize = 256 * 1024;
+
+    //Timeouts in milliseconds, 0 turns one off. A connection that runs into one is closed and reported
+    //with peerDisconnected like any other. Idle connections only time out with peers of wire version 7
+    //or later, which send a PING every keepaliveInterval.
+    uint32_t authTimeout = 10000;        //from accepting a connection to the peer's AUTH
+    uint32_t readTimeout = 30000;        //a frame that started to arrive has to be complete by then
+    uint32_t writeTimeout = 30000;       //data sent to the peer that it does not acknowledge (TCP_USER_TIMEOUT)
+    uint32_t keepaliveInterval = 15000;
+    uint32_t idleTimeout = 45000;        //nothing received from the peer, PINGs included
+    uint32_t connectTimeout = 10000;     //connectPeer(), resolving the host included
+    uint32_t connectAttemptDelay = 250;  //before the next address of the host is tried next to a pending one
+    size_t connectConcurrency = 64;      //connections connectPeers() establishes at the same time
+
+    std::string downloadDirectory = "/opt/P2pChat/downloads";  //where received files are written
+    size_t fileChunkSize = 256 * 1024;                         //bytes of a file per FILE_CHUNK frame
+
+    //Peers on the same host that turn it on too (wire version 8) exchange frames through shared memory,
+    //a ring of this many bytes per direction (rounded up to a power of two, at least 1 MiB), instead of
+    //the TCP connection, which stays open to tell when the peer is gone. 0 keeps them on TCP.
+    size_t sharedMemoryRing = 0;
+
+    //AF_UNIX socket listened on next to the port, for peers on this host that connect to it with Peer::unixPath.
+    //A file left at the path is replaced. Empty for none.
+    std::string unixSocketPath;
+    //Over AF_UNIX, images and files of at least this many bytes go to peers that take them as a file descriptor
+    //(the image in a memfd, the file itself) instead of through the socket. 0 never. The io_uring engine
+    //passes descriptors but does not take them.
+    size_t passDescriptorMinSize = 64 * 1024;
+
+    //CPUs (core numbers) the threads of netlib are kept on, an empty list leaves them to the scheduler.
+    //Threads are named p2p-<role> in /proc either way.
+    std::vector<int> ioCpus;        //event loops (one CPU each, in turn), io_uring, listener and connection threads
+    std::vector<int> dispatchCpus;  //dispatch workers, one CPU each, in turn
+    std::vector<int> serviceCpus;   //timer wheel, connector, resolvers and file sender
+    std::vector<int> loggingCpus;   //spdlog's flush thread, for the whole process
+};
+
+/*
+ Received bodies are read into pooled buffers in power of two size classes, shared by all
+ NetOps of the process. A hit reused a buffer released on the same thread (threadHits) or
+ on another one (sharedHits), a miss allocated a new one.
+ */
+struct ReceiveBufferStats {
+    struct SizeClass {
+        size_t bufferSize;
+        uint64_t threadHits;
+        uint64_t sharedHits;
+        uint64_t misses;
+    };
+    std::vector<SizeClass> classes;
+    uint64_t oversized = 0;  //bodies bigger than the largest class, allocated every time
+};
+ReceiveBufferStats getReceiveBufferStats();
 
-    void sendMessage(const std::string &peer, const Message& message) override;
-    bool connectPeer(const Peer& peer) override;
-    void stopListening() override;
+//Bodies we compressed since the process started, shared by all NetOps like the buffer pool
+struct CompressionStats {
+    uint64_t compressed = 0;
+    uint64_t skipped = 0;         //the entropy sample said it is compressed already
+    uint64_t incompressible = 0;  //compressed, but not smaller, so sent as it was
+    uint64_t plainBytes = 0;      //of the compressed bodies, before and after
+    uint64_t compressedBytes = 0;
+    uint64_t compressNanos = 0;   //CPU spent, including the bodies that did not get smaller
+    uint64_t decompressNanos = 0;
 };
+CompressionStats getCompressionStats();
 
 //I wanted to use factory class, but this is somehow factory method (function!) :-)
 std::unique_ptr<NetOps> createNetworking(int port, UiCallbacks *callbacks);
+std::unique_ptr<NetOps> createNetworking(int port, UiCallbacks *callbacks, const NetConfig &config);
 
 #endif
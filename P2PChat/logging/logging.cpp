@@ -2,8 +2,13 @@
 #include <yaml-cpp/yaml.h>
 #include <spdlog/sinks/stdout_color_sinks.h>
 #include <spdlog/sinks/rotating_file_sink.h>
+#include <pthread.h>
+#include <sched.h>
 #include <iostream>
 #include <memory>
+#include <thread>
+
+#define LOG_FLUSH_INTERVAL 10  //seconds
 
 std::shared_ptr<spdlog::logger> logger;
 
@@ -45,10 +50,29 @@ void init_logging(){
         sinks.push_back(std::make_shared<spdlog::sinks::rotating_file_sink_mt>(path.c_str(), 1024 * 1024, 5));//filename, maxsize, maxfiles
     logger = std::make_shared<spdlog::logger>( "P2pChat", sinks.begin(), sinks.end());
     spdlog::set_default_logger(logger);
-    spdlog::flush_every(std::chrono::seconds(10));
+    pinLoggingThread({});
     spdlog::info("Successfully initialized logger.");
 }
 
+//spdlog's flush thread gets the name and the CPUs of the thread that starts it, so a short lived one does
+void pinLoggingThread(const std::vector<int> &cpus) {
+    std::thread([&cpus](){
+        pthread_setname_np(pthread_self(), "p2p-log-flush");
+        if(!cpus.empty()) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            for(int cpu : cpus) {
+                if(cpu >= 0 && cpu < CPU_SETSIZE)
+                    CPU_SET(cpu, &set);
+            }
+            int status = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+            if(status != 0)
+                std::cerr << "Cannot pin the log flush thread. errno: " << status << std::endl;
+        }
+        spdlog::flush_every(std::chrono::seconds(LOG_FLUSH_INTERVAL));
+    }).join();
+}
+
 std::shared_ptr<spdlog::logger> getLogger(){
     return logger;
 }
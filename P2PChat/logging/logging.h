@@ -3,6 +3,7 @@
 
 #include <spdlog/spdlog.h>
 #include "spdlog/fmt/bin_to_hex.h"
+#include <vector>
 
 /*
  I wanted this function to be called automatically when .so file is loaded.
@@ -11,5 +12,7 @@
  */
 void init_logging(); //__attribute__((constructor));
 std::shared_ptr<spdlog::logger> getLogger();
+//Keeps the thread that flushes the log on cpus, the log itself is written by the threads that log
+void pinLoggingThread(const std::vector<int> &cpus);
 
 #endif
@@ -0,0 +1,139 @@
+#include "bufferpool.h"
+
+#include <bit>
+#include <new>
+
+static int sizeClassOf(size_t size) {
+    if(size <= (size_t(1) << POOL_MIN_SHIFT))
+        return 0;
+    int shift = std::bit_width(size - 1);
+    return shift > POOL_MAX_SHIFT ? -1 : shift - POOL_MIN_SHIFT;
+}
+
+static BufferBlock *allocateBlock(int sizeClass, size_t capacity) {
+    void *memory = ::operator new(sizeof(BufferBlock) + capacity);
+    auto block = new(memory) BufferBlock;
+    block->sizeClass = sizeClass;
+    block->capacity = capacity;
+    return block;
+}
+
+static void freeBlock(BufferBlock *block) {
+    block->~BufferBlock();
+    ::operator delete(block);
+}
+
+struct BufferPool::ThreadCache {
+    std::array<std::vector<BufferBlock*>, POOL_CLASS_COUNT> freeBlocks;
+
+    //A thread that exits hands its buffers to the shared lists
+    ~ThreadCache() {
+        auto &pool = BufferPool::instance();
+        for(int i=0; i<POOL_CLASS_COUNT; i++) {
+            for(auto block : freeBlocks[i])
+                pool.giveBack(block);
+            freeBlocks[i].clear();
+        }
+    }
+};
+
+BufferPool &BufferPool::instance() {
+    //Never destroyed: thread caches may give buffers back while the process exits
+    static auto pool = new BufferPool();
+    return *pool;
+}
+
+BufferPool::ThreadCache &BufferPool::threadCache() {
+    static thread_local ThreadCache cache;
+    return cache;
+}
+
+PooledBuffer BufferPool::acquire(size_t size) {
+    int sizeClass = sizeClassOf(size);
+    BufferBlock *block = nullptr;
+    if(sizeClass < 0) {
+        oversized.fetch_add(1, std::memory_order_relaxed);
+        block = allocateBlock(-1, size);
+    } else {
+        auto &local = threadCache().freeBlocks[sizeClass];
+        auto &shared = classes[sizeClass];
+        if(!local.empty()) {
+            block = local.back();
+            local.pop_back();
+            shared.threadHits.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            std::unique_lock<std::mutex> lock(shared.mutex);
+            if(!shared.freeBlocks.empty()) {
+                block = shared.freeBlocks.back();
+                shared.freeBlocks.pop_back();
+                lock.unlock();
+                shared.sharedHits.fetch_add(1, std::memory_order_relaxed);
+            } else {
+                lock.unlock();
+                shared.misses.fetch_add(1, std::memory_order_relaxed);
+                block = allocateBlock(sizeClass, classSize(sizeClass));
+            }
+        }
+    }
+    block->refs.store(1, std::memory_order_relaxed);
+    block->size = size;
+    return PooledBuffer(block);
+}
+
+void BufferPool::giveBack(BufferBlock *block) {
+    if(block->sizeClass < 0) {
+        freeBlock(block);
+        return;
+    }
+    auto &shared = classes[block->sizeClass];
+    std::unique_lock<std::mutex> lock(shared.mutex);
+    if(shared.freeBlocks.size() * block->capacity < POOL_SHARED_CACHE_BYTES) {
+        shared.freeBlocks.push_back(block);
+        return;
+    }
+    lock.unlock();
+    freeBlock(block);
+}
+
+ReceiveBufferStats BufferPool::stats() {
+    ReceiveBufferStats result;
+    for(int i=0; i<POOL_CLASS_COUNT; i++) {
+        auto &sizeClass = classes[i];
+        result.classes.push_back({classSize(i), sizeClass.threadHits.load(), sizeClass.sharedHits.load(),
+                                  sizeClass.misses.load()});
+    }
+    result.oversized = oversized.load();
+    return result;
+}
+
+PooledBuffer::PooledBuffer(const PooledBuffer &other) : block(other.block) {
+    if(block != nullptr)
+        block->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+PooledBuffer::PooledBuffer(PooledBuffer &&other) noexcept : block(other.block) {
+    other.block = nullptr;
+}
+
+PooledBuffer &PooledBuffer::operator=(PooledBuffer other) noexcept {
+    std::swap(block, other.block);
+    return *this;
+}
+
+PooledBuffer::~PooledBuffer() {
+    if(block == nullptr || block->refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+        return;
+    if(block->sizeClass >= 0) {
+        //Keep it on this thread while the cache has room, a reader on this thread will want it back
+        auto &local = BufferPool::threadCache().freeBlocks[block->sizeClass];
+        if(local.size() < POOL_THREAD_CACHE_BLOCKS && local.size() * block->capacity < POOL_THREAD_CACHE_BYTES) {
+            local.push_back(block);
+            return;
+        }
+    }
+    BufferPool::instance().giveBack(block);
+}
+
+ReceiveBufferStats getReceiveBufferStats() {
+    return BufferPool::instance().stats();
+}
@@ -0,0 +1,88 @@
+#ifndef P2PCHAT_BUFFERPOOL_H
+#define P2PCHAT_BUFFERPOOL_H
+
+#include "UiNetlibInterfaces.h"
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#define POOL_MIN_SHIFT          8     //smallest class holds 256 bytes
+#define POOL_MAX_SHIFT          22    //largest class holds 4 MiB, bigger bodies are not pooled
+#define POOL_CLASS_COUNT        (POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1)
+#define POOL_THREAD_CACHE_BLOCKS 64                 //per class and thread, the rest is shared
+#define POOL_THREAD_CACHE_BYTES (1024 * 1024)       //per class and thread
+#define POOL_SHARED_CACHE_BYTES (16 * 1024 * 1024)  //per class, shared by all threads
+
+//Header of a pooled allocation, the bytes follow it
+struct BufferBlock {
+    std::atomic<uint32_t> refs;
+    int sizeClass;  //-1 when the block is too big for any class
+    size_t capacity;
+    size_t size;
+
+    uint8_t *data() { return reinterpret_cast<uint8_t*>(this + 1); }
+};
+
+/*
+ Reference counted handle to a receive buffer. Copies share the buffer and the last one
+ gives it back to the pool, which is how a body outlives the reader until the strand that
+ runs UiCallbacks is done with it.
+ */
+class PooledBuffer {
+private:
+    BufferBlock *block = nullptr;
+
+public:
+    PooledBuffer() = default;
+    explicit PooledBuffer(BufferBlock *block) : block(block) {}
+    PooledBuffer(const PooledBuffer &other);
+    PooledBuffer(PooledBuffer &&other) noexcept;
+    PooledBuffer& operator=(PooledBuffer other) noexcept;
+    ~PooledBuffer();
+
+    uint8_t *data() const { return block->data(); }
+    size_t size() const { return block->size; }
+    size_t capacity() const { return block->capacity; }
+    //Within capacity()
+    void resize(size_t size) { block->size = size; }
+    explicit operator bool() const { return block != nullptr; }
+};
+
+/*
+ Receive buffers in power of two size classes. Every thread keeps a few free buffers of each
+ class for itself, so a reader that gets back the buffers its consumers released does not
+ touch a lock; what does not fit there goes to a shared list per class.
+ There is one pool per process, NetworkCom instances share it.
+ */
+class BufferPool {
+private:
+    struct SizeClass {
+        std::mutex mutex;
+        std::vector<BufferBlock*> freeBlocks;
+        std::atomic<uint64_t> threadHits{0};
+        std::atomic<uint64_t> sharedHits{0};
+        std::atomic<uint64_t> misses{0};
+    };
+    struct ThreadCache;
+
+    std::array<SizeClass, POOL_CLASS_COUNT> classes;
+    std::atomic<uint64_t> oversized{0};
+
+    BufferPool() = default;
+    static ThreadCache &threadCache();
+    void giveBack(BufferBlock *block);
+    friend class PooledBuffer;
+
+public:
+    static BufferPool &instance();
+    static size_t classSize(int sizeClass) { return size_t(1) << (sizeClass + POOL_MIN_SHIFT); }
+
+    PooledBuffer acquire(size_t size);
+    ReceiveBufferStats stats();
+};
+
+#endif
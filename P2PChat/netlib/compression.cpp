@@ -0,0 +1,142 @@
+#include "compression.h"
+#include "framing.h"
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+
+static std::atomic<uint64_t> compressedBodies{0};
+static std::atomic<uint64_t> skippedBodies{0};
+static std::atomic<uint64_t> incompressibleBodies{0};
+static std::atomic<uint64_t> plainBytes{0};
+static std::atomic<uint64_t> compressedBytes{0};
+static std::atomic<uint64_t> compressNanos{0};
+static std::atomic<uint64_t> decompressNanos{0};
+
+static uint64_t nanosSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+static double entropyOf(const uint32_t *counts, size_t total) {
+    double entropy = 0;
+    for(int i = 0; i < 256; i++) {
+        if(counts[i] == 0)
+            continue;
+        double p = double(counts[i]) / total;
+        entropy -= p * std::log2(p);
+    }
+    return entropy;
+}
+
+bool looksCompressible(const uint8_t *data, size_t len) {
+    //Blocks spread over the whole body, a header or a trailer alone says little. Besides the bytes we
+    //count the differences between neighbours: a gradient in a bitmap uses every byte value, but few steps.
+    uint32_t counts[256] = {};
+    uint32_t deltaCounts[256] = {};
+    size_t sampled = 0;
+    size_t blockCount = std::min<size_t>(COMPRESSION_SAMPLE_BLOCKS, std::max<size_t>(len / COMPRESSION_SAMPLE_BLOCK, 1));
+    size_t stride = len / blockCount;
+    for(size_t block = 0; block < blockCount; block++) {
+        const uint8_t *start = data + block * stride;
+        size_t blockLength = std::min<size_t>(COMPRESSION_SAMPLE_BLOCK, len - block * stride);
+        uint8_t previous = 0;
+        for(size_t i = 0; i < blockLength; i++) {
+            counts[start[i]]++;
+            deltaCounts[static_cast<uint8_t>(start[i] - previous)]++;
+            previous = start[i];
+        }
+        sampled += blockLength;
+    }
+    if(sampled == 0)
+        return false;
+
+    double entropy = std::min(entropyOf(counts, sampled), entropyOf(deltaCounts, sampled));
+    bool compressible = entropy < COMPRESSION_MAX_ENTROPY;
+    if(!compressible)
+        skippedBodies++;
+    return compressible;
+}
+
+PooledBuffer compressBody(const uint8_t *prefix, size_t prefixLength, const uint8_t *payload, size_t payloadLength,
+                          int level) {
+    auto start = std::chrono::steady_clock::now();
+    size_t plainLength = prefixLength + payloadLength;
+    if(plainLength <= 4 || plainLength > MAX_FRAME_BODY_LEN)
+        return PooledBuffer();
+
+    //Room for one byte less than the plain body: deflate running out of it means it does not pay off
+    PooledBuffer body = BufferPool::instance().acquire(plainLength - 1);
+    uint8_t *out = body.data();
+    for(int i = 0; i < 4; i++)
+        out[i] = static_cast<uint8_t>(plainLength >> (8 * i));
+
+    z_stream stream{};
+    if(deflateInit(&stream, level) != Z_OK)
+        return PooledBuffer();
+    stream.next_out = out + 4;
+    stream.avail_out = static_cast<uInt>(plainLength - 1 - 4);
+    stream.next_in = const_cast<uint8_t*>(prefix);
+    stream.avail_in = static_cast<uInt>(prefixLength);
+    int result = deflate(&stream, Z_NO_FLUSH);
+    if(result == Z_OK) {
+        stream.next_in = const_cast<uint8_t*>(payload);
+        stream.avail_in = static_cast<uInt>(payloadLength);
+        result = deflate(&stream, Z_FINISH);
+    }
+    size_t length = 4 + stream.total_out;
+    deflateEnd(&stream);
+    compressNanos += nanosSince(start);
+    if(result != Z_STREAM_END) {
+        incompressibleBodies++;
+        return PooledBuffer();
+    }
+
+    body.resize(length);
+    compressedBodies++;
+    plainBytes += plainLength;
+    compressedBytes += length;
+    return body;
+}
+
+PooledBuffer decompressBody(const uint8_t *data, size_t len) {
+    auto start = std::chrono::steady_clock::now();
+    if(len < 4)
+        return PooledBuffer();
+    size_t plainLength = 0;
+    for(int i = 0; i < 4; i++)
+        plainLength |= size_t(data[i]) << (8 * i);
+    if(plainLength == 0 || plainLength > MAX_FRAME_BODY_LEN)
+        return PooledBuffer();
+
+    PooledBuffer body = BufferPool::instance().acquire(plainLength);
+    z_stream stream{};
+    if(inflateInit(&stream) != Z_OK)
+        return PooledBuffer();
+    stream.next_in = const_cast<uint8_t*>(data + 4);
+    stream.avail_in = static_cast<uInt>(len - 4);
+    stream.next_out = body.data();
+    stream.avail_out = static_cast<uInt>(plainLength);
+    int result = inflate(&stream, Z_FINISH);
+    bool complete = result == Z_STREAM_END && stream.total_out == plainLength && stream.avail_in == 0;
+    inflateEnd(&stream);
+    decompressNanos += nanosSince(start);
+    if(!complete)
+        return PooledBuffer();
+    body.resize(plainLength);
+    return body;
+}
+
+CompressionStats getCompressionStats() {
+    CompressionStats stats;
+    stats.compressed = compressedBodies.load();
+    stats.skipped = skippedBodies.load();
+    stats.incompressible = incompressibleBodies.load();
+    stats.plainBytes = plainBytes.load();
+    stats.compressedBytes = compressedBytes.load();
+    stats.compressNanos = compressNanos.load();
+    stats.decompressNanos = decompressNanos.load();
+    return stats;
+}
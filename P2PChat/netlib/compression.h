@@ -0,0 +1,31 @@
+#ifndef P2PCHAT_COMPRESSION_H
+#define P2PCHAT_COMPRESSION_H
+
+#include "bufferpool.h"
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+ Optional zlib compression of TEXT and IMAGE bodies. Peers announce the codecs they can
+ decode in AUTH, and a body is only compressed for a peer that announced zlib. A compressed
+ body is the length of the plain body (u32, little-endian) followed by the zlib stream, and
+ its frames carry FRAME_FLAG_COMPRESSED. The plain body is the protobuf encoding as usual.
+ */
+
+#define COMPRESSION_ZLIB            0x1   //codec bit in AuthMessage.compression
+#define COMPRESSION_SAMPLE_BLOCKS   16    //blocks looked at to estimate the entropy
+#define COMPRESSION_SAMPLE_BLOCK    256   //bytes per block
+#define COMPRESSION_MAX_ENTROPY     7.5   //bits per byte, JPEG, PNG or zip data is close to 8
+
+//Cheap guess from a sample of the data: false for data that is most likely compressed already
+bool looksCompressible(const uint8_t *data, size_t len);
+
+//Compresses prefix followed by payload, an empty buffer when the result would not be smaller
+PooledBuffer compressBody(const uint8_t *prefix, size_t prefixLength, const uint8_t *payload, size_t payloadLength,
+                          int level);
+
+//The plain body, an empty buffer when data is not a valid compressed body
+PooledBuffer decompressBody(const uint8_t *data, size_t len);
+
+#endif
@@ -0,0 +1,262 @@
+#include <sys/eventfd.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+
+#include <algorithm>
+#include <cstddef>
+
+#include "connector.h"
+#include "threading.h"
+#include "logging.h"
+
+Connector::Inbox::~Inbox() {
+    if(wakeupFd >= 0)
+        close(wakeupFd);
+}
+
+bool Connector::Inbox::post(std::shared_ptr<Request> request) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if(closed)
+        return false;
+    resolved.push_back(std::move(request));
+    uint64_t one = 1;
+    if(write(wakeupFd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        getLogger()->error("Cannot wake up the connector. errno: {}", errno);
+    return true;
+}
+
+Connector::Connector(uint32_t timeoutMs, uint32_t attemptDelayMs, const std::vector<int> &cpus) :
+        timeout(timeoutMs), attemptDelay(attemptDelayMs), cpus(cpus), inbox(std::make_shared<Inbox>()), running(true) {
+    inbox->wakeupFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(inbox->wakeupFd < 0) {
+        getLogger()->error("Cannot create the connector. errno: {}", errno);
+        exit(EXIT_FAILURE);
+    }
+    thread = std::thread([this](){
+        setupThread("p2p-connector", this->cpus);
+        this->run();
+    });
+}
+
+Connector::~Connector() {
+    stop();
+}
+
+void Connector::stop() {
+    if(!running.exchange(false))
+        return;
+    uint64_t one = 1;
+    if(write(inbox->wakeupFd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        getLogger()->error("Cannot wake up the connector. errno: {}", errno);
+    if(thread.joinable() && thread.get_id() != std::this_thread::get_id())
+        thread.join();
+}
+
+void Connector::connect(const std::string &host, short port, ConnectDone done) {
+    auto request = std::make_shared<Request>();
+    request->host = host;
+    request->port = port;
+    request->done = std::move(done);
+    request->deadline = timeout > 0 ? Clock::now() + std::chrono::milliseconds(timeout) : Clock::time_point::max();
+
+    if(running && resolve(*request, AI_NUMERICHOST)) {
+        if(!inbox->post(request))
+            request->done(-1);
+        return;
+    }
+    if(!running) {
+        request->done(-1);
+        return;
+    }
+    //A host name, the resolver may take a while and cannot be interrupted
+    std::thread([inbox = inbox, request, cpus = cpus](){
+        setupThread("p2p-resolver", cpus);
+        resolve(*request, 0);
+        if(!inbox->post(request))
+            request->done(-1);
+    }).detach();
+}
+
+void Connector::connectLocal(const std::string &path, ConnectDone done) {
+    auto request = std::make_shared<Request>();
+    request->host = path;
+    request->port = 0;
+    request->done = std::move(done);
+    request->deadline = timeout > 0 ? Clock::now() + std::chrono::milliseconds(timeout) : Clock::time_point::max();
+
+    Address address{};
+    auto local = reinterpret_cast<sockaddr_un*>(&address.storage);
+    if(path.empty() || path.size() >= sizeof(local->sun_path)) {
+        getLogger()->warn("Cannot connect to unix socket {}: bad path", path);
+        request->done(-1);
+        return;
+    }
+    local->sun_family = AF_UNIX;
+    std::memcpy(local->sun_path, path.c_str(), path.size());
+    address.length = static_cast<socklen_t>(offsetof(sockaddr_un, sun_path) + path.size() + 1);
+    request->addresses.push_back(address);
+    if(!running || !inbox->post(request))
+        request->done(-1);
+}
+
+//Addresses of the host with the families interleaved, starting with the one the resolver prefers
+bool Connector::resolve(Request &request, int flags) {
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = flags;
+    addrinfo *result = nullptr;
+    std::string service = std::to_string(static_cast<uint16_t>(request.port));
+    int status = getaddrinfo(request.host.c_str(), service.c_str(), &hints, &result);
+    if(status != 0) {
+        if(!(flags & AI_NUMERICHOST))
+            getLogger()->warn("Cannot resolve {}: {}", request.host, gai_strerror(status));
+        return false;
+    }
+
+    std::vector<Address> preferred, other;
+    for(addrinfo *info = result; info != nullptr; info = info->ai_next) {
+        Address address{};
+        std::memcpy(&address.storage, info->ai_addr, info->ai_addrlen);
+        address.length = info->ai_addrlen;
+        (info->ai_family == result->ai_family ? preferred : other).push_back(address);
+    }
+    freeaddrinfo(result);
+    for(size_t i = 0; i < std::max(preferred.size(), other.size()); i++) {
+        if(i < preferred.size())
+            request.addresses.push_back(preferred[i]);
+        if(i < other.size())
+            request.addresses.push_back(other[i]);
+    }
+    if(request.addresses.size() > CONNECT_MAX_ADDRESSES)
+        request.addresses.resize(CONNECT_MAX_ADDRESSES);
+    return !request.addresses.empty();
+}
+
+void Connector::startAttempt(Request &request) {
+    const Address &address = request.addresses[request.nextAddress++];
+    request.nextAttempt = Clock::now() + std::chrono::milliseconds(attemptDelay);
+    int clientSocket = socket(address.storage.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if(clientSocket < 0) {
+        request.lastError = errno;
+        return;
+    }
+    if(::connect(clientSocket, reinterpret_cast<const sockaddr*>(&address.storage), address.length) == 0 ||
+       errno == EINPROGRESS) {
+        request.attempts.push_back(clientSocket);
+        return;
+    }
+    request.lastError = errno;
+    close(clientSocket);
+}
+
+void Connector::checkAttempt(Request &request, int clientSocket) {
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if(getsockopt(clientSocket, SOL_SOCKET, SO_ERROR, &error, &length) < 0)
+        error = errno;
+    if(error == 0) {
+        finish(request, clientSocket);
+        return;
+    }
+    //Failed: the next address does not have to wait for the attempt delay
+    request.lastError = error;
+    close(clientSocket);
+    request.attempts.erase(std::find(request.attempts.begin(), request.attempts.end(), clientSocket));
+    request.nextAttempt = Clock::now();
+}
+
+//The winner goes back to blocking mode, the engines set up their sockets themselves
+void Connector::finish(Request &request, int clientSocket) {
+    for(int attempt : request.attempts) {
+        if(attempt != clientSocket)
+            close(attempt);
+    }
+    request.attempts.clear();
+    if(clientSocket >= 0)
+        fcntl(clientSocket, F_SETFL, fcntl(clientSocket, F_GETFL, 0) & ~O_NONBLOCK);
+    else if(request.lastError != 0)
+        getLogger()->info("Cannot connect to {} on port {}. errno: {}", request.host, request.port, request.lastError);
+    ConnectDone done = std::move(request.done);
+    request.done = nullptr;
+    done(clientSocket);
+}
+
+void Connector::run() {
+    std::vector<pollfd> fds;
+    std::vector<Request*> owners;
+    while(running) {
+        {
+            std::lock_guard<std::mutex> lock(inbox->mutex);
+            for(auto &request : inbox->resolved)
+                requests.push_back(std::move(request));
+            inbox->resolved.clear();
+        }
+
+        auto now = Clock::now();
+        for(auto &request : requests) {
+            if(request->addresses.empty()) {
+                finish(*request, -1);  //not resolved
+            } else if(now >= request->deadline) {
+                getLogger()->warn("Connecting to {} on port {} timed out.", request->host, request->port);
+                finish(*request, -1);
+            } else {
+                while(request->nextAddress < request->addresses.size() &&
+                      (request->attempts.empty() || now >= request->nextAttempt))
+                    startAttempt(*request);
+                if(request->attempts.empty())
+                    finish(*request, -1);
+            }
+        }
+        std::erase_if(requests, [](const std::shared_ptr<Request> &request){ return request->done == nullptr; });
+
+        fds.assign(1, pollfd{inbox->wakeupFd, POLLIN, 0});
+        owners.assign(1, nullptr);
+        auto wakeup = Clock::time_point::max();
+        for(auto &request : requests) {
+            for(int attempt : request->attempts) {
+                fds.push_back(pollfd{attempt, POLLOUT, 0});
+                owners.push_back(request.get());
+            }
+            wakeup = std::min(wakeup, request->deadline);
+            if(request->nextAddress < request->addresses.size())
+                wakeup = std::min(wakeup, request->nextAttempt);
+        }
+        int wait = -1;
+        if(wakeup != Clock::time_point::max())
+            wait = static_cast<int>(std::max<int64_t>(std::chrono::ceil<std::chrono::milliseconds>(wakeup - now).count(), 0));
+
+        if(poll(fds.data(), fds.size(), wait) < 0) {
+            if(errno == EINTR)
+                continue;
+            getLogger()->error("Connector poll() failed. errno: {}", errno);
+            break;
+        }
+        if(fds[0].revents & POLLIN) {
+            uint64_t count;
+            while(read(inbox->wakeupFd, &count, sizeof(count)) > 0);
+        }
+        for(size_t i = 1; i < fds.size(); i++) {
+            if(fds[i].revents != 0 && owners[i]->done != nullptr)
+                checkAttempt(*owners[i], fds[i].fd);
+        }
+        std::erase_if(requests, [](const std::shared_ptr<Request> &request){ return request->done == nullptr; });
+    }
+
+    //Requests resolved from now on are failed by their resolver threads
+    {
+        std::lock_guard<std::mutex> lock(inbox->mutex);
+        inbox->closed = true;
+        for(auto &request : inbox->resolved)
+            requests.push_back(std::move(request));
+        inbox->resolved.clear();
+    }
+    for(auto &request : requests)
+        finish(*request, -1);
+    requests.clear();
+}
@@ -0,0 +1,83 @@
+#ifndef P2PCHAT_CONNECTOR_H
+#define P2PCHAT_CONNECTOR_H
+
+#include <sys/socket.h>
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define CONNECT_MAX_ADDRESSES  8  //of one host that are tried, the rest are ignored
+
+//The connected (blocking) socket, or -1 when no address of the host could be reached
+using ConnectDone = std::function<void(int socket)>;
+
+/*
+ Establishes TCP (or AF_UNIX) connections without blocking the caller, on its own thread. A host name is
+ resolved on a short lived thread (numeric addresses right away), then its addresses are tried
+ happy eyeballs style (RFC 8305): families interleaved, the next attempt starting attemptDelay
+ after the previous one while that is still pending, and the first to connect wins. done runs
+ on the connector thread, once per connect(), and must not block.
+ */
+class Connector {
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Address {
+        sockaddr_storage storage;
+        socklen_t length;
+    };
+    struct Request {
+        std::string host;
+        short port;
+        ConnectDone done;
+        std::vector<Address> addresses;
+        size_t nextAddress = 0;
+        std::vector<int> attempts;  //sockets with a connect() in progress
+        Clock::time_point deadline;
+        Clock::time_point nextAttempt;
+        int lastError = 0;
+    };
+    //Shared with resolver threads, which may outlive the Connector
+    struct Inbox {
+        std::mutex mutex;
+        std::vector<std::shared_ptr<Request>> resolved;
+        int wakeupFd = -1;
+        bool closed = false;
+        ~Inbox();
+        bool post(std::shared_ptr<Request> request);
+    };
+
+    uint32_t timeout;
+    uint32_t attemptDelay;
+    std::vector<int> cpus;  //of the connector and the resolver threads
+    std::shared_ptr<Inbox> inbox;
+    std::vector<std::shared_ptr<Request>> requests;  //only touched on the connector thread
+    std::atomic<bool> running;
+    std::thread thread;
+
+    static bool resolve(Request &request, int flags);
+    void startAttempt(Request &request);
+    void checkAttempt(Request &request, int socket);
+    void finish(Request &request, int socket);
+    void run();
+
+public:
+    Connector(uint32_t timeoutMs, uint32_t attemptDelayMs, const std::vector<int> &cpus = {});
+    ~Connector();
+    Connector(const Connector&) = delete;
+    Connector& operator=(const Connector&) = delete;
+
+    void connect(const std::string &host, short port, ConnectDone done);
+    //The AF_UNIX socket at path, which needs no resolver
+    void connectLocal(const std::string &path, ConnectDone done);
+    //Fails what is still pending, later connect()s fail right away
+    void stop();
+};
+
+#endif
@@ -0,0 +1,231 @@
+#include "NetCoroutines.h"
+#include "eventloop.h"
+#include "logging.h"
+
+/*
+ The networking threads only fill inboxes and post the coroutines that wait on them to the loop.
+ A message (or an accepted connection) is handed straight to the awaiter that waits for it, so no
+ other coroutine can take it between the post and the resume.
+ */
+struct CoInbox {
+    CoNetwork *network;
+    std::string peerName;
+    std::mutex mutex;
+    std::deque<std::unique_ptr<Message>> messages;
+    std::deque<CoConnection::Receive*> receivers;
+    bool closed = false;
+
+    CoInbox(CoNetwork *network, const std::string &peerName) : network(network), peerName(peerName) {}
+    void deliver(std::unique_ptr<Message> message);
+    void close();
+};
+
+void CoInbox::deliver(std::unique_ptr<Message> message) {
+    CoConnection::Receive *receiver;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if(closed)
+            return;
+        if(receivers.empty()) {
+            messages.push_back(std::move(message));
+            return;
+        }
+        receiver = receivers.front();
+        receivers.pop_front();
+        receiver->message = std::move(message);
+    }
+    network->resume(receiver->waiting);
+}
+
+void CoInbox::close() {
+    std::deque<CoConnection::Receive*> waiting;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        waiting.swap(receivers);
+    }
+    for(auto receiver : waiting)
+        network->resume(receiver->waiting);
+}
+
+struct CoNetwork::Callbacks : public UiCallbacks {
+    CoNetwork &network;
+    std::promise<void> bound;
+
+    explicit Callbacks(CoNetwork &network) : network(network) {}
+
+    void bindSucceeded() override {
+        bound.set_value();
+    }
+
+    void newAuthMessage(std::string peerName, std::unique_ptr<AuthMessage> authMsg) override {
+        auto inbox = network.openInbox(peerName);
+        Accept *acceptor;
+        {
+            std::lock_guard<std::mutex> lock(network.mutex);
+            if(network.acceptors.empty()) {
+                network.accepted.push_back(inbox);
+                return;
+            }
+            acceptor = network.acceptors.front();
+            network.acceptors.pop_front();
+            acceptor->inbox = inbox;
+        }
+        network.resume(acceptor->waiting);
+    }
+
+    void newTextMessage(std::string peerName, std::unique_ptr<TextMessage> txtMsg) override {
+        network.openInbox(peerName)->deliver(std::move(txtMsg));
+    }
+
+    void newImageMessage(std::string peerName, std::unique_ptr<ImageMessage> imgMsg) override {
+        network.openInbox(peerName)->deliver(std::move(imgMsg));
+    }
+
+    void newFileMessage(std::string peerName, std::unique_ptr<FileMessage> fileMsg) override {
+        network.openInbox(peerName)->deliver(std::move(fileMsg));
+    }
+
+    void peerDisconnected(const std::string peerName) override {
+        network.closeInbox(peerName, nullptr);
+    }
+};
+
+CoNetwork::CoNetwork(int port, const std::string &name, const NetConfig &config) :
+        name(name), loop(std::make_unique<EventLoop>()), callbacks(std::make_unique<Callbacks>(*this)) {
+    loop->start("p2p-coroutines");
+    auto bound = callbacks->bound.get_future();
+    ops = createNetworking(port, callbacks.get(), config);
+    bound.wait();
+}
+
+//The loop goes first, so no coroutine runs while the engine shuts down and reports its last completions
+CoNetwork::~CoNetwork() {
+    loop->stop();
+    ops.reset();
+}
+
+void CoNetwork::resume(std::coroutine_handle<> handle) {
+    loop->post([handle](){ handle.resume(); });
+}
+
+//Messages can arrive before the coroutine that connected learns about it, so the first one opens it
+std::shared_ptr<CoInbox> CoNetwork::openInbox(const std::string &peerName) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto &inbox = inboxes[peerName];
+    if(inbox == nullptr)
+        inbox = std::make_shared<CoInbox>(this, peerName);
+    return inbox;
+}
+
+//Only inbox itself when it is given, a newer connection of the peer may have opened another one
+void CoNetwork::closeInbox(const std::string &peerName, const std::shared_ptr<CoInbox> &inbox) {
+    std::shared_ptr<CoInbox> closed;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = inboxes.find(peerName);
+        if(it == inboxes.end() || (inbox != nullptr && it->second != inbox))
+            return;
+        closed = std::move(it->second);
+        inboxes.erase(it);
+    }
+    closed->close();
+}
+
+namespace {
+    //Owns itself, the frame is gone as soon as the coroutine returns
+    struct Detached {
+        struct promise_type {
+            Detached get_return_object() { return {}; }
+            std::suspend_never initial_suspend() noexcept { return {}; }
+            std::suspend_never final_suspend() noexcept { return {}; }
+            void return_void() {}
+            void unhandled_exception() { std::terminate(); }
+        };
+    };
+
+    struct ToLoop {
+        EventLoop &loop;
+        bool await_ready() const { return false; }
+        void await_suspend(std::coroutine_handle<> handle) { loop.post([handle](){ handle.resume(); }); }
+        void await_resume() const {}
+    };
+
+    Detached runSpawned(EventLoop &loop, CoTask<void> task, std::promise<void> done) {
+        co_await ToLoop{loop};
+        try {
+            co_await task;
+            done.set_value();
+        } catch(...) {
+            done.set_exception(std::current_exception());
+        }
+    }
+}
+
+std::future<void> CoNetwork::spawn(CoTask<void> task) {
+    std::promise<void> done;
+    auto result = done.get_future();
+    runSpawned(*loop, std::move(task), std::move(done));
+    return result;
+}
+
+void CoNetwork::Send::await_suspend(std::coroutine_handle<> handle) {
+    network->ops->sendMessage(peerName, message, [this, handle](bool success){
+        sent = success;
+        network->resume(handle);
+    });
+}
+
+//The inbox is open before AUTH goes out, the peer may answer before the completion runs
+void CoNetwork::Connect::await_suspend(std::coroutine_handle<> handle) {
+    inbox = network->openInbox(peer.name);
+    network->ops->connectPeers({peer}, AuthMessage(network->name), [this, handle](const Peer&, bool connected){
+        if(!connected) {
+            network->closeInbox(peer.name, inbox);
+            inbox = nullptr;
+        }
+        network->resume(handle);
+    });
+}
+
+CoConnection CoNetwork::Connect::await_resume() {
+    if(inbox == nullptr)
+        return {};
+    return {network, peer.name, inbox};
+}
+
+bool CoNetwork::Accept::await_suspend(std::coroutine_handle<> handle) {
+    std::lock_guard<std::mutex> lock(network->mutex);
+    if(!network->accepted.empty()) {
+        inbox = std::move(network->accepted.front());
+        network->accepted.pop_front();
+        return false;
+    }
+    waiting = handle;
+    network->acceptors.push_back(this);
+    return true;
+}
+
+CoConnection CoNetwork::Accept::await_resume() {
+    return {network, inbox->peerName, inbox};
+}
+
+bool CoConnection::Receive::await_suspend(std::coroutine_handle<> handle) {
+    if(inbox == nullptr)
+        return false;
+    std::lock_guard<std::mutex> lock(inbox->mutex);
+    if(!inbox->messages.empty()) {
+        message = std::move(inbox->messages.front());
+        inbox->messages.pop_front();
+        return false;
+    }
+    if(inbox->closed)
+        return false;
+    waiting = handle;
+    inbox->receivers.push_back(this);
+    return true;
+}
+
+std::unique_ptr<CoNetwork> createCoNetworking(int port, const std::string &name, const NetConfig &config) {
+    return std::make_unique<CoNetwork>(port, name, config);
+}
@@ -0,0 +1,142 @@
+#include "dispatch.h"
+#include "threading.h"
+#include "logging.h"
+
+#define STRAND_BATCH 64
+
+static thread_local const DispatchPool *currentPool = nullptr;
+static thread_local size_t currentWorker = 0;
+
+DispatchPool::DispatchPool(int threads, size_t queueDepth, const std::vector<int> &cpus) :
+        queueDepth(queueDepth > 0 ? queueDepth : 1), queued(0), nextWorker(0), running(true) {
+    if(threads < 1)
+        threads = 1;
+    for(int i=0; i<threads; i++)
+        workers.push_back(std::make_unique<Worker>());
+    for(size_t i=0; i<workers.size(); i++)
+        workers[i]->thread = std::thread([this, i, cpus = nthCpu(cpus, i)](){
+            setupThread("p2p-dispatch-" + std::to_string(i), cpus);
+            workerLoop(i);
+        });
+    getLogger()->info("Started dispatch pool with {} workers", workers.size());
+}
+
+DispatchPool::~DispatchPool() {
+    {
+        std::lock_guard<std::mutex> lock(idleMutex);
+        running = false;
+    }
+    workAvailable.notify_all();
+    spaceAvailable.notify_all();
+    //Workers finish whatever is still queued before they exit
+    for(auto &worker : workers)
+        worker->thread.join();
+}
+
+bool DispatchPool::isWorkerThread() const {
+    return currentPool == this;
+}
+
+void DispatchPool::submit(Task task) {
+    size_t target;
+    if(isWorkerThread()) {
+        //Workers never wait for space: they are the ones that make space
+        target = currentWorker;
+    } else {
+        if(queued >= queueDepth) {
+            std::unique_lock<std::mutex> lock(idleMutex);
+            spaceAvailable.wait(lock, [this](){ return queued < queueDepth || !running; });
+        }
+        target = nextWorker++ % workers.size();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(workers[target]->mutex);
+        workers[target]->tasks.push_back(std::move(task));
+    }
+    queued++;
+    std::lock_guard<std::mutex> lock(idleMutex);
+    workAvailable.notify_one();
+}
+
+bool DispatchPool::popLocal(size_t index, Task &task) {
+    auto &worker = *workers[index];
+    std::lock_guard<std::mutex> lock(worker.mutex);
+    if(worker.tasks.empty())
+        return false;
+    task = std::move(worker.tasks.front());
+    worker.tasks.pop_front();
+    return true;
+}
+
+bool DispatchPool::steal(size_t thief, Task &task) {
+    for(size_t i=1; i<workers.size(); i++) {
+        auto &victim = *workers[(thief + i) % workers.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if(victim.tasks.empty())
+            continue;
+        task = std::move(victim.tasks.back());
+        victim.tasks.pop_back();
+        return true;
+    }
+    return false;
+}
+
+void DispatchPool::workerLoop(size_t index) {
+    currentPool = this;
+    currentWorker = index;
+    while(true) {
+        Task task;
+        if(popLocal(index, task) || steal(index, task)) {
+            if(queued-- >= queueDepth) {
+                std::lock_guard<std::mutex> lock(idleMutex);
+                spaceAvailable.notify_all();
+            }
+            task();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(idleMutex);
+        workAvailable.wait(lock, [this](){ return queued > 0 || !running; });
+        if(!running && queued == 0)
+            break;
+    }
+}
+
+std::shared_ptr<Strand> DispatchPool::makeStrand(size_t queueDepth) {
+    return std::make_shared<Strand>(*this, queueDepth);
+}
+
+Strand::Strand(DispatchPool &pool, size_t queueDepth) :
+        pool(pool), queueDepth(queueDepth > 0 ? queueDepth : 1), scheduled(false) {}
+
+void Strand::post(DispatchPool::Task task) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if(!pool.isWorkerThread())
+        spaceAvailable.wait(lock, [this](){ return tasks.size() < queueDepth; });
+    tasks.push_back(std::move(task));
+    if(scheduled)
+        return;
+    scheduled = true;
+    lock.unlock();
+    pool.submit([self = shared_from_this()](){ self->drain(); });
+}
+
+void Strand::drain() {
+    for(int i=0; i<STRAND_BATCH; i++) {
+        DispatchPool::Task task;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if(tasks.empty()) {
+                scheduled = false;
+                return;
+            }
+            task = std::move(tasks.front());
+            tasks.pop_front();
+        }
+        spaceAvailable.notify_one();
+        task();
+    }
+    //Give other peers a turn, the rest of this strand goes back to the pool
+    pool.submit([self = shared_from_this()](){ self->drain(); });
+}
@@ -0,0 +1,77 @@
+#ifndef P2PCHAT_DISPATCH_H
+#define P2PCHAT_DISPATCH_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class Strand;
+
+/*
+ Work-stealing pool that runs message decoding and UiCallbacks away from the socket readers.
+ Every worker owns a deque, takes work from its front and steals from the back of the others
+ when it runs dry. Submissions from outside the pool block while queueDepth tasks are waiting,
+ which pushes back on the readers instead of buffering without limit.
+ */
+class DispatchPool {
+public:
+    using Task = std::function<void()>;
+
+private:
+    struct Worker {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+        std::thread thread;
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    size_t queueDepth;
+    std::atomic<size_t> queued;
+    std::atomic<size_t> nextWorker;
+    std::atomic<bool> running;
+    std::mutex idleMutex;
+    std::condition_variable workAvailable;
+    std::condition_variable spaceAvailable;
+
+    bool popLocal(size_t index, Task &task);
+    bool steal(size_t thief, Task &task);
+    void workerLoop(size_t index);
+
+public:
+    //Worker i is named p2p-dispatch-i and runs on the i-th of cpus, if there are any
+    DispatchPool(int threads, size_t queueDepth, const std::vector<int> &cpus = {});
+    ~DispatchPool();
+    DispatchPool(const DispatchPool&) = delete;
+    DispatchPool& operator=(const DispatchPool&) = delete;
+
+    void submit(Task task);
+    bool isWorkerThread() const;
+    std::shared_ptr<Strand> makeStrand(size_t queueDepth);
+};
+
+/*
+ Runs its tasks one at a time and in the order they were posted, on whichever pool worker
+ picks it up. We keep one strand per peer so messages of a peer are never reordered.
+ */
+class Strand : public std::enable_shared_from_this<Strand> {
+private:
+    DispatchPool &pool;
+    size_t queueDepth;
+    std::mutex mutex;
+    std::condition_variable spaceAvailable;
+    std::deque<DispatchPool::Task> tasks;
+    bool scheduled;
+
+    void drain();
+
+public:
+    Strand(DispatchPool &pool, size_t queueDepth);
+    void post(DispatchPool::Task task);
+};
+
+#endif
@@ -0,0 +1,132 @@
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <cerrno>
+
+#include "eventloop.h"
+#include "threading.h"
+#include "logging.h"
+
+#define MAX_EPOLL_EVENTS 256
+
+EventLoop::EventLoop() : running(false) {
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    wakeupFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(epollFd < 0 || wakeupFd < 0) {
+        getLogger()->error("Cannot create event loop. errno: {}", errno);
+        exit(EXIT_FAILURE);
+    }
+
+    struct epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.fd = wakeupFd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeupFd, &event);
+}
+
+EventLoop::~EventLoop() {
+    stop();
+    close(wakeupFd);
+    close(epollFd);
+}
+
+void EventLoop::start(const std::string &name, const std::vector<int> &cpus) {
+    running = true;
+    loopThread = std::thread([this, name, cpus](){
+        setupThread(name, cpus);
+        this->run();
+    });
+}
+
+void EventLoop::stop() {
+    if(!running.exchange(false))
+        return;
+    wakeup();
+    if(loopThread.joinable() && !isInLoopThread())
+        loopThread.join();
+}
+
+bool EventLoop::isInLoopThread() const {
+    return loopThread.get_id() == std::this_thread::get_id();
+}
+
+void EventLoop::wakeup() {
+    uint64_t one = 1;
+    if(write(wakeupFd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        getLogger()->error("Cannot wake up event loop. errno: {}", errno);
+}
+
+void EventLoop::post(Task task) {
+    {
+        std::lock_guard<std::mutex> lock(tasksMutex);
+        pendingTasks.push_back(std::move(task));
+    }
+    wakeup();
+}
+
+void EventLoop::watch(int fd, uint32_t events, Handler handler) {
+    if(!isInLoopThread()) {
+        post([this, fd, events, handler = std::move(handler)]() mutable {
+            watch(fd, events, std::move(handler));
+        });
+        return;
+    }
+
+    handlers[fd] = std::move(handler);
+    struct epoll_event event{};
+    event.events = events;
+    event.data.fd = fd;
+    if(epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        getLogger()->error("Cannot add socket {} to event loop. errno: {}", fd, errno);
+        handlers.erase(fd);
+    }
+}
+
+void EventLoop::unwatch(int fd) {
+    if(!isInLoopThread()) {
+        post([this, fd](){ unwatch(fd); });
+        return;
+    }
+
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+    handlers.erase(fd);
+}
+
+void EventLoop::runPendingTasks() {
+    std::vector<Task> tasks;
+    {
+        std::lock_guard<std::mutex> lock(tasksMutex);
+        tasks.swap(pendingTasks);
+    }
+    for(auto &task : tasks)
+        task();
+}
+
+void EventLoop::run() {
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    while(running) {
+        int count = epoll_wait(epollFd, events, MAX_EPOLL_EVENTS, -1);
+        if(count < 0) {
+            if(errno == EINTR)
+                continue;
+            getLogger()->error("epoll_wait() failed. errno: {}", errno);
+            break;
+        }
+
+        for(int i=0; i<count; i++) {
+            int fd = events[i].data.fd;
+            if(fd == wakeupFd) {
+                uint64_t value;
+                while(read(wakeupFd, &value, sizeof(value)) > 0);
+                continue;
+            }
+            //A previous handler in this batch may have closed the socket
+            auto it = handlers.find(fd);
+            if(it == handlers.end())
+                continue;
+            auto handler = it->second;
+            handler(events[i].events);
+        }
+        runPendingTasks();
+    }
+    runPendingTasks();
+}
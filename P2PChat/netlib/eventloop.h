@@ -0,0 +1,50 @@
+#ifndef P2PCHAT_EVENTLOOP_H
+#define P2PCHAT_EVENTLOOP_H
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/*
+ A single epoll instance with its own thread. Handlers are only ever invoked (and the handler
+ table only ever touched) on the loop thread, other threads talk to the loop through post().
+ */
+class EventLoop {
+public:
+    using Handler = std::function<void(uint32_t events)>;
+    using Task = std::function<void()>;
+
+private:
+    int epollFd;
+    int wakeupFd;
+    std::thread loopThread;
+    std::atomic<bool> running;
+    std::mutex tasksMutex;
+    std::vector<Task> pendingTasks;
+    std::unordered_map<int, Handler> handlers;
+
+    void run();
+    void runPendingTasks();
+    void wakeup();
+
+public:
+    EventLoop();
+    ~EventLoop();
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    //The loop thread is named name and kept on cpus, see setupThread()
+    void start(const std::string &name, const std::vector<int> &cpus = {});
+    void stop();
+    bool isInLoopThread() const;
+
+    void post(Task task);
+    void watch(int fd, uint32_t events, Handler handler);
+    void unwatch(int fd);
+};
+
+#endif
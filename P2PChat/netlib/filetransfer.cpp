@@ -0,0 +1,341 @@
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cerrno>
+#include <filesystem>
+#include <future>
+
+#include "networking.h"
+#include "threading.h"
+#include "messages.pb.h"
+#include "protoarena.h"
+#include "logging.h"
+
+/*
+ FILE transfers. The sender announces a file with a FILE frame and streams its content in
+ FILE_CHUNK frames: the frame header and the protobuf keys are written with sendmsg, the content
+ goes from the file to the socket with sendfile and never enters our memory. The receiver
+ appends every chunk to the destination file as it arrives, on the strand of the peer.
+ Over AF_UNIX the FILE frame may carry the file itself instead, see unixpeers.cpp.
+ */
+
+void NetworkCom::queueFile(const std::string &peerName, const FileMessage &file, SendCompletion completion) {
+    std::unique_lock<std::mutex> lock(filesMutex);
+    if(fileSenderStopped) {
+        lock.unlock();
+        getLogger()->warn("Networking is stopped, not sending {}", file.path);
+        if(completion != nullptr)
+            completion(false);
+        return;
+    }
+    outgoingFiles.push_back({peerName, file.path, std::move(completion)});
+    if(!fileSender.joinable())
+        fileSender = std::thread([this](){
+            setupThread("p2p-files", config.serviceCpus);
+            fileSenderLoop();
+        });
+    filesQueued.notify_one();
+}
+
+void NetworkCom::fileSenderLoop() {
+    while(true) {
+        OutgoingFile file;
+        {
+            std::unique_lock<std::mutex> lock(filesMutex);
+            filesQueued.wait(lock, [this](){ return !outgoingFiles.empty() || fileSenderStopped; });
+            if(fileSenderStopped)
+                return;
+            file = std::move(outgoingFiles.front());
+            outgoingFiles.pop_front();
+        }
+        sendFile(file);
+    }
+}
+
+//Engines call this before they tear down, the sender thread writes through their overrides
+void NetworkCom::stopFileTransfers() {
+    {
+        std::lock_guard<std::mutex> lock(filesMutex);
+        fileSenderStopped = true;
+    }
+    filesQueued.notify_all();
+    if(fileSender.joinable())
+        fileSender.join();
+
+    std::deque<OutgoingFile> dropped;
+    {
+        std::lock_guard<std::mutex> lock(filesMutex);
+        dropped.swap(outgoingFiles);
+    }
+    for(auto &file : dropped) {
+        if(file.completion != nullptr)
+            file.completion(false);
+    }
+}
+
+void NetworkCom::sendFile(const OutgoingFile &file) {
+    bool sent = streamFile(file);
+    if(file.completion != nullptr)
+        file.completion(sent);
+}
+
+bool NetworkCom::streamFile(const OutgoingFile &file) {
+    int clientSocket = getClientSocket(file.peerName);
+    if(clientSocket < 0) {
+        getLogger()->warn("Invalid peer with name: {}", file.peerName);
+        return false;
+    }
+    if(peerWireVersion(clientSocket) < 3) {
+        getLogger()->warn("{} does not support FILE messages, not sending {}", file.peerName, file.path);
+        return false;
+    }
+
+    int fileFd = open(file.path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat fileStat{};
+    if(fileFd < 0 || fstat(fileFd, &fileStat) < 0) {
+        getLogger()->error("Cannot open {} for sending. errno: {}", file.path, errno);
+        if(fileFd >= 0)
+            close(fileFd);
+        return false;
+    }
+
+    uint32_t transferId = nextTransferId++;
+    auto fileSize = static_cast<uint64_t>(fileStat.st_size);
+    std::string fileName = std::filesystem::path(file.path).filename().string();
+    //A peer on this host copies the content from our descriptor itself, no chunks follow
+    std::shared_ptr<const PassedDescriptor> descriptor;
+    if(passesDescriptor(clientSocket, fileSize)) {
+        int passed = fcntl(fileFd, F_DUPFD_CLOEXEC, 0);
+        if(passed >= 0)
+            descriptor = std::make_shared<const PassedDescriptor>(passed);
+    }
+    bool attached = descriptor != nullptr;
+
+    std::shared_ptr<std::vector<uint8_t>> offer;
+    {
+        ProtoArenaScope arenaScope;
+        auto offerProto = google::protobuf::Arena::CreateMessage<messages::FileMessage>(arenaScope.arena());
+        offerProto->set_transfer_id(transferId);
+        offerProto->set_name(fileName);
+        offerProto->set_size(fileSize);
+        offerProto->set_attached(attached);
+        offer = std::make_shared<std::vector<uint8_t>>(offerProto->ByteSizeLong());
+        offerProto->SerializeWithCachedSizesToArray(offer->data());
+    }
+    OutboundFrame offerFrame;
+    offerFrame.payload = offer->data();
+    offerFrame.payloadLength = offer->size();
+    offerFrame.storage = offer;
+    offerFrame.descriptor = std::move(descriptor);
+    //Chunks may take a different path than queued frames, they must not overtake the offer
+    std::promise<bool> offerSent;
+    offerFrame.completion = [&offerSent](bool sent){ offerSent.set_value(sent); };
+    if(!finishFrame(clientSocket, MessageType::FILE, nullptr, 0, offerFrame)) {
+        close(fileFd);
+        return false;
+    }
+    getLogger()->info("Sending file {} ({} bytes) to {}", fileName, fileSize, file.peerName);
+    if(!waitForCredit(clientSocket, offerFrame.size())) {
+        close(fileFd);
+        return false;
+    }
+    transmit(clientSocket, offerFrame);
+    if(!offerSent.get_future().get()) {
+        close(fileFd);
+        return false;
+    }
+    if(attached) {
+        close(fileFd);
+        uiCallbacks->fileProgress(file.peerName, fileName, fileSize, fileSize, false);
+        return true;
+    }
+
+    size_t chunkSize = std::max<size_t>(config.fileChunkSize, 1);
+    uint64_t sent = 0;
+    while(sent < fileSize) {
+        size_t len = std::min<uint64_t>(chunkSize, fileSize - sent);
+        uint8_t prefix[BODY_PREFIX_MAX_LEN];
+        size_t prefixLength = encodeVarintField(messages::FileChunk::kTransferIdFieldNumber, transferId, prefix);
+        prefixLength += encodeFieldKey(messages::FileChunk::kDataFieldNumber, len, prefix + prefixLength);
+
+        //The content is counted in the header, but transmitFileChunk() sends it from the file
+        OutboundFrame chunkFrame;
+        chunkFrame.payloadLength = len;
+        if(!finishFrame(clientSocket, MessageType::FILE_CHUNK, prefix, prefixLength, chunkFrame))
+            break;
+        //Only this thread sends on the FILE stream, so the chunk can wait for credit after it was numbered
+        if(!waitForCredit(clientSocket, chunkFrame.size()))
+            break;
+        chunkFrame.payloadLength = 0;
+        if(!transmitFileChunk(clientSocket, chunkFrame, fileFd, static_cast<off_t>(sent), len)) {
+            getLogger()->error("Sending {} to {} failed after {} bytes", fileName, file.peerName, sent);
+            break;
+        }
+        sent += len;
+        uiCallbacks->fileProgress(file.peerName, fileName, sent, fileSize, false);
+    }
+    close(fileFd);
+    return sent == fileSize;
+}
+
+bool NetworkCom::writeFileChunk(int clientSocket, OutboundFrame &frame, int fileFd, off_t offset, size_t len) {
+    auto writeMutex = linkWriteMutex(clientSocket);
+    std::lock_guard<std::mutex> lock(*writeMutex);
+    return writeFully(clientSocket, frame) && sendFileFully(clientSocket, fileFd, offset, len);
+}
+
+bool NetworkCom::sendFileFully(int clientSocket, int fileFd, off_t offset, size_t len) {
+    while(len > 0) {
+        ssize_t sent = sendfile(clientSocket, fileFd, &offset, len);
+        if(sent < 0) {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                pollfd pfd{clientSocket, POLLOUT, 0};
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            getLogger()->error("sendfile() to socket {} failed. errno: {}", clientSocket, errno);
+            return false;
+        }
+        if(sent == 0) {
+            getLogger()->error("File shrank while sending it to socket {}", clientSocket);
+            return false;
+        }
+        len -= sent;
+    }
+    return true;
+}
+
+static int createUniqueFile(const std::filesystem::path &directory, const std::string &name, std::string &path) {
+    std::filesystem::path base(name);
+    for(int attempt=0; attempt<1000; attempt++) {
+        std::filesystem::path candidate = directory / base;
+        if(attempt > 0)
+            candidate = directory / (base.stem().string() + " (" + std::to_string(attempt) + ")" +
+                                     base.extension().string());
+        int fd = open(candidate.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if(fd >= 0 || errno != EEXIST) {
+            path = candidate.string();
+            return fd;
+        }
+    }
+    errno = EEXIST;
+    return -1;
+}
+
+void NetworkCom::fileOffered(int clientSocket, const std::string &peerName, const uint8_t *body, size_t len) {
+    ProtoArenaScope arenaScope;
+    auto offerProto = google::protobuf::Arena::CreateMessage<messages::FileMessage>(arenaScope.arena());
+    offerProto->ParseFromArray(body, static_cast<int>(len));
+    //Taken first, the next frame with one must not get it
+    std::unique_ptr<PassedDescriptor> attached;
+    if(offerProto->attached()) {
+        attached = takeDescriptor(clientSocket);
+        if(attached == nullptr) {
+            getLogger()->error("FILE from {} came without its descriptor.", peerName);
+            return;
+        }
+    }
+
+    //Only the last component of the name is used, a peer must not choose where we write
+    IncomingFile file;
+    file.name = std::filesystem::path(offerProto->name()).filename().string();
+    if(file.name.empty() || file.name == "." || file.name == "..")
+        file.name = "file-" + std::to_string(offerProto->transfer_id());
+    file.size = offerProto->size();
+
+    std::error_code error;
+    std::filesystem::create_directories(config.downloadDirectory, error);
+    file.fd = createUniqueFile(config.downloadDirectory, file.name, file.path);
+    if(file.fd < 0) {
+        getLogger()->error("Cannot create {} in {}. errno: {}", file.name, config.downloadDirectory, errno);
+        return;
+    }
+    getLogger()->info("Receiving file {} ({} bytes) from {} into {}", file.name, file.size, peerName, file.path);
+
+    if(attached != nullptr) {
+        if(!copyAttachedFile(peerName, attached->fd, file)) {
+            getLogger()->warn("Transfer of {} ended after {} of {} bytes", file.path, file.received, file.size);
+            close(file.fd);
+            return;
+        }
+        incomingFileDone(peerName, file);
+        return;
+    }
+    //An empty file is complete as soon as it is announced
+    if(file.size == 0) {
+        incomingFileDone(peerName, file);
+        return;
+    }
+    std::lock_guard<std::mutex> lock(filesMutex);
+    incomingFiles[std::make_pair(clientSocket, offerProto->transfer_id())] = file;
+}
+
+void NetworkCom::fileChunkReceived(int clientSocket, const std::string &peerName, const uint8_t *body, size_t len) {
+    ProtoArenaScope arenaScope;
+    auto chunkProto = google::protobuf::Arena::CreateMessage<messages::FileChunk>(arenaScope.arena());
+    chunkProto->ParseFromArray(body, static_cast<int>(len));
+
+    IncomingFile file;
+    auto key = std::make_pair(clientSocket, chunkProto->transfer_id());
+    {
+        std::lock_guard<std::mutex> lock(filesMutex);
+        auto it = incomingFiles.find(key);
+        if(it == incomingFiles.end()) {
+            getLogger()->warn("Chunk of unknown file transfer {} from {}", chunkProto->transfer_id(), peerName);
+            return;
+        }
+        file = it->second;
+    }
+
+    //Chunks of a peer are handled one at a time, nobody else touches this fd meanwhile
+    const std::string &data = chunkProto->data();
+    size_t written = 0;
+    while(written < data.size()) {
+        ssize_t count = write(file.fd, data.data() + written, data.size() - written);
+        if(count < 0 && errno == EINTR)
+            continue;
+        if(count <= 0) {
+            getLogger()->error("Cannot write to {}. errno: {}", file.path, errno);
+            break;
+        }
+        written += count;
+    }
+    file.received += written;
+    uiCallbacks->fileProgress(peerName, file.name, file.received, file.size, true);
+
+    bool complete = file.received >= file.size;
+    {
+        std::lock_guard<std::mutex> lock(filesMutex);
+        if(complete)
+            incomingFiles.erase(key);
+        else
+            incomingFiles[key].received = file.received;
+    }
+    if(complete)
+        incomingFileDone(peerName, file);
+}
+
+void NetworkCom::incomingFileDone(const std::string &peerName, const IncomingFile &file) {
+    close(file.fd);
+    getLogger()->info("Received FILE {} from {}", file.name, peerName);
+    std::unique_ptr<FileMessage> fileMessage(new FileMessage(file.path));
+    fileMessage->name = file.name;
+    fileMessage->size = file.received;
+    uiCallbacks->newFileMessage(peerName, std::move(fileMessage));
+}
+
+void NetworkCom::closeIncomingFiles(int clientSocket) {
+    std::lock_guard<std::mutex> lock(filesMutex);
+    auto it = incomingFiles.lower_bound({clientSocket, 0});
+    while(it != incomingFiles.end() && it->first.first == clientSocket) {
+        getLogger()->warn("Transfer of {} ended after {} of {} bytes", it->second.path,
+                          it->second.received, it->second.size);
+        close(it->second.fd);
+        it = incomingFiles.erase(it);
+    }
+}
@@ -0,0 +1,205 @@
+#include "networking.h"
+#include "messages.pb.h"
+#include "logging.h"
+
+#include <algorithm>
+#include <chrono>
+
+/*
+ Credit based flow control, with peers of wire version 5 or later. Both sides announce a
+ receive window in the AUTH exchange. A sender starts with the peer's window as credit and
+ pays the size of every data frame (anything but the CONTROL stream) from it; frames it cannot
+ pay are held back here instead of going to the engine. The receiver gives the bytes back in a
+ CREDIT frame once UiCallbacks handled them, so a slow consumer slows its senders down and never
+ buffers more than its window of any of them.
+ Fragments are paid back as soon as they arrive: the rest of their message could not come otherwise.
+ */
+
+#define CREDIT_BATCH_DIVISOR 4  //a CREDIT is sent once a quarter of the window was handled
+
+static size_t waitingBytes(const PeerLink &link) {
+    return static_cast<size_t>(std::max<int64_t>(link.sendWindow - link.sendCredit, 0)) + link.heldBytes;
+}
+
+//A frame may go when it is paid for, or when nothing is in flight, so a frame bigger than the window cannot get stuck
+static bool affordable(const PeerLink &link, size_t cost) {
+    return link.sendCredit >= static_cast<int64_t>(cost) || link.sendCredit >= link.sendWindow;
+}
+
+NetworkCom::Watermark NetworkCom::checkWatermarks(PeerLink &link) {
+    size_t waiting = waitingBytes(link);
+    if(!link.backpressured && waiting >= config.sendHighWatermark) {
+        link.backpressured = true;
+        return Watermark::HIGH;
+    }
+    if(link.backpressured && waiting <= config.sendLowWatermark) {
+        link.backpressured = false;
+        return Watermark::LOW;
+    }
+    return Watermark::NONE;
+}
+
+void NetworkCom::notifyWatermark(const std::string &peerName, Watermark crossed) {
+    if(crossed == Watermark::HIGH) {
+        getLogger()->info("{} is backpressured", peerName);
+        uiCallbacks->peerBackpressured(peerName);
+    } else if(crossed == Watermark::LOW) {
+        getLogger()->info("{} is writable again", peerName);
+        uiCallbacks->peerWritable(peerName);
+    }
+}
+
+void NetworkCom::setPeerWindow(int clientSocket, uint64_t window) {
+    if(peerWireVersion(clientSocket) < 5)
+        return;
+    auto peer = peers.context(clientSocket);
+    std::lock_guard<std::mutex> lock(peer->mutex);
+    auto &link = peer->link;
+    //Whatever is already in flight counts against the new window
+    int64_t inFlight = link.sendWindow - link.sendCredit;
+    link.sendWindow = static_cast<int64_t>(std::min<uint64_t>(window, MAX_FRAME_BODY_LEN));
+    link.sendCredit = link.sendWindow - (link.sendWindow > 0 ? inFlight : 0);
+    getLogger()->info("Socket {} has a receive window of {} bytes", clientSocket, link.sendWindow);
+}
+
+//Called with the peer's sendMutex held, so frames leave in the order they were numbered
+void NetworkCom::sendFrame(int clientSocket, OutboundFrame &frame) {
+    if(frame.stream == static_cast<uint16_t>(FrameStream::CONTROL)) {
+        transmit(clientSocket, frame);
+        return;
+    }
+
+    auto peer = peers.context(clientSocket);
+    bool held = false;
+    Watermark crossed;
+    std::string peerName;
+    {
+        std::lock_guard<std::mutex> lock(peer->mutex);
+        auto &link = peer->link;
+        if(link.sendWindow <= 0) {
+            crossed = Watermark::NONE;
+        } else {
+            size_t cost = frame.size();
+            if(link.heldFrames.empty() && affordable(link, cost)) {
+                link.sendCredit -= static_cast<int64_t>(cost);
+            } else {
+                frame.own();
+                link.heldBytes += cost;
+                link.heldFrames.push(std::move(frame));
+                held = true;
+            }
+            crossed = checkWatermarks(link);
+            peerName = peer->name;
+        }
+    }
+    if(!held)
+        transmit(clientSocket, frame);
+    notifyWatermark(peerName, crossed);
+}
+
+bool NetworkCom::waitForCredit(int clientSocket, size_t cost) {
+    auto peer = peers.find(clientSocket);
+    if(peer == nullptr)
+        return false;
+    Watermark crossed;
+    std::string peerName;
+    {
+        std::unique_lock<std::mutex> lock(peer->mutex);
+        auto &link = peer->link;
+        if(link.sendWindow <= 0)
+            return true;
+        //Checks for a shutdown now and then, stopFileTransfers() does not know which peer we wait for
+        while(!link.closed && !(link.heldFrames.empty() && affordable(link, cost))) {
+            peer->creditGranted.wait_for(lock, std::chrono::milliseconds(100));
+            std::lock_guard<std::mutex> filesLock(filesMutex);
+            if(fileSenderStopped)
+                return false;
+        }
+        if(link.closed)
+            return false;
+        link.sendCredit -= static_cast<int64_t>(cost);
+        crossed = checkWatermarks(link);
+        peerName = peer->name;
+    }
+    notifyWatermark(peerName, crossed);
+    return true;
+}
+
+void NetworkCom::creditGranted(int clientSocket, uint64_t bytes) {
+    auto peer = peers.context(clientSocket);
+    std::lock_guard<std::recursive_mutex> sendLock(peer->sendMutex);
+    std::vector<OutboundFrame> released;
+    Watermark crossed;
+    std::string peerName;
+    {
+        std::lock_guard<std::mutex> lock(peer->mutex);
+        auto &link = peer->link;
+        if(link.sendWindow <= 0)
+            return;
+        //Frames sent before the window was known were granted too, credit never exceeds the window
+        link.sendCredit = std::min<int64_t>(link.sendCredit + static_cast<int64_t>(bytes), link.sendWindow);
+        while(!link.heldFrames.empty() && affordable(link, link.heldFrames.front().size())) {
+            size_t cost = link.heldFrames.front().size();
+            link.sendCredit -= static_cast<int64_t>(cost);
+            link.heldBytes -= cost;
+            released.push_back(std::move(link.heldFrames.front()));
+            link.heldFrames.pop();
+        }
+        crossed = checkWatermarks(link);
+        peerName = peer->name;
+    }
+    peer->creditGranted.notify_all();
+    for(auto &frame : released)
+        transmit(clientSocket, frame);
+    notifyWatermark(peerName, crossed);
+}
+
+void NetworkCom::frameConsumed(int clientSocket, size_t bytes) {
+    if(config.receiveWindow == 0 || bytes == 0 || peerWireVersion(clientSocket) < 5)
+        return;
+    auto peer = peers.find(clientSocket);
+    if(peer == nullptr)
+        return;
+    size_t grant = 0;
+    {
+        std::lock_guard<std::mutex> lock(peer->mutex);
+        auto &link = peer->link;
+        link.unconfirmedBytes += bytes;
+        if(link.unconfirmedBytes >= config.receiveWindow / CREDIT_BATCH_DIVISOR) {
+            grant = link.unconfirmedBytes;
+            link.unconfirmedBytes = 0;
+        }
+    }
+    if(grant > 0)
+        sendCredit(clientSocket, grant);
+}
+
+void NetworkCom::sendCredit(int clientSocket, uint64_t bytes) {
+    uint8_t prefix[BODY_PREFIX_MAX_LEN];
+    size_t prefixLength = encodeVarintField(messages::Credit::kBytesFieldNumber, bytes, prefix);
+    OutboundFrame frame;
+    if(finishFrame(clientSocket, MessageType::CREDIT, prefix, prefixLength, frame))
+        transmit(clientSocket, frame);
+}
+
+//Held frames of a connection that is gone fail, and a file sender waiting for its credit gives up
+void NetworkCom::dropHeldFrames(const std::shared_ptr<PeerContext> &peer) {
+    StreamQueue dropped;
+    {
+        std::lock_guard<std::mutex> lock(peer->mutex);
+        peer->link.closed = true;
+        std::swap(dropped, peer->link.heldFrames);
+        peer->link.heldBytes = 0;
+    }
+    peer->creditGranted.notify_all();
+    dropped.fail();
+}
+
+//For engines that tear all connections down at once, without connectionClosed() for each
+void NetworkCom::clearPeers() {
+    std::vector<std::shared_ptr<PeerContext>> all;
+    peers.forEach([&all](const std::shared_ptr<PeerContext> &peer){ all.push_back(peer); });
+    peers.clear();
+    for(auto &peer : all)
+        dropHeldFrames(peer);
+}
@@ -0,0 +1,255 @@
+#include "framing.h"
+
+#include <unistd.h>
+
+#include <cstring>
+#include <vector>
+
+#define LEGACY_TYPE_TAG    0x08  //field 1, varint
+#define LEGACY_LENGTH_TAG  0x10  //field 2, varint
+
+static void putLe16(uint8_t *out, uint16_t value) {
+    out[0] = static_cast<uint8_t>(value);
+    out[1] = static_cast<uint8_t>(value >> 8);
+}
+
+static void putLe32(uint8_t *out, uint32_t value) {
+    for(int i=0; i<4; i++)
+        out[i] = static_cast<uint8_t>(value >> (8 * i));
+}
+
+static uint16_t getLe16(const uint8_t *in) {
+    return static_cast<uint16_t>(in[0] | (in[1] << 8));
+}
+
+static uint32_t getLe32(const uint8_t *in) {
+    return static_cast<uint32_t>(in[0]) | (static_cast<uint32_t>(in[1]) << 8) |
+           (static_cast<uint32_t>(in[2]) << 16) | (static_cast<uint32_t>(in[3]) << 24);
+}
+
+static bool toMessageType(uint32_t value, MessageType &type) {
+    switch (value) {
+        case static_cast<uint32_t>(MessageType::AUTH):
+        case static_cast<uint32_t>(MessageType::TEXT):
+        case static_cast<uint32_t>(MessageType::IMAGE):
+        case static_cast<uint32_t>(MessageType::AUTH_ACK):
+        case static_cast<uint32_t>(MessageType::FILE):
+        case static_cast<uint32_t>(MessageType::FILE_CHUNK):
+        case static_cast<uint32_t>(MessageType::CREDIT):
+        case static_cast<uint32_t>(MessageType::IMAGE_CHUNK):
+        case static_cast<uint32_t>(MessageType::IMAGE_RESUME):
+        case static_cast<uint32_t>(MessageType::PING):
+        case static_cast<uint32_t>(MessageType::RING_OFFER):
+        case static_cast<uint32_t>(MessageType::RING_SWITCH):
+            type = static_cast<MessageType>(value);
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool readVarint(const uint8_t *&pos, const uint8_t *end, uint64_t &value) {
+    value = 0;
+    for(int shift=0; pos < end && shift < 64; shift += 7) {
+        uint8_t byte = *pos++;
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if(!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+//The legacy header is a protobuf MessageHeader{type, length + MSG_HEADER_PADD} zero padded to 8 bytes
+static FrameStatus decodeLegacyHeader(const uint8_t *data, FrameHeader &header) {
+    const uint8_t *pos = data, *end = data + MSG_HEADER_LEN;
+    uint64_t type = 0, length = 0;
+    bool hasLength = false;
+    while(pos < end && *pos != 0) {
+        uint8_t tag = *pos++;
+        uint64_t value;
+        if(!readVarint(pos, end, value))
+            return FrameStatus::INVALID;
+        if(tag == LEGACY_TYPE_TAG) {
+            type = value;
+        } else if(tag == LEGACY_LENGTH_TAG) {
+            length = value;
+            hasLength = true;
+        } else {
+            return FrameStatus::INVALID;
+        }
+    }
+
+    if(!hasLength || length < MSG_HEADER_PADD + MSG_HEADER_LEN ||
+       length - MSG_HEADER_PADD - MSG_HEADER_LEN > MAX_FRAME_BODY_LEN ||
+       !toMessageType(static_cast<uint32_t>(type), header.type))
+        return FrameStatus::INVALID;
+
+    header.version = 0;
+    header.flags = 0;
+    header.stream = 0;
+    header.sequence = 0;
+    header.bodyLength = static_cast<uint32_t>(length - MSG_HEADER_PADD - MSG_HEADER_LEN);
+    header.legacy = true;
+    return FrameStatus::COMPLETE;
+}
+
+uint16_t streamOf(MessageType type) {
+    switch (type) {
+        case MessageType::TEXT:
+            return static_cast<uint16_t>(FrameStream::TEXT);
+        case MessageType::IMAGE:
+        case MessageType::IMAGE_CHUNK:
+            return static_cast<uint16_t>(FrameStream::IMAGE);
+        case MessageType::FILE:
+        case MessageType::FILE_CHUNK:
+            return static_cast<uint16_t>(FrameStream::FILE);
+        default:
+            return static_cast<uint16_t>(FrameStream::CONTROL);
+    }
+}
+
+size_t frameHeaderLength(uint8_t firstByte) {
+    return firstByte == FRAME_MAGIC ? FRAME_HEADER_LEN : MSG_HEADER_LEN;
+}
+
+FrameStatus decodeFrameHeader(const uint8_t *data, size_t available, FrameHeader &header) {
+    if(available == 0 || available < frameHeaderLength(data[0]))
+        return FrameStatus::NEED_MORE;
+    if(data[0] != FRAME_MAGIC)
+        return decodeLegacyHeader(data, header);
+
+    header.version = data[1];
+    header.flags = getLe16(data + 4);
+    header.stream = getLe16(data + 6);
+    header.bodyLength = getLe32(data + 8);
+    header.sequence = getLe32(data + 12);
+    header.legacy = false;
+    if(header.version != FRAME_VERSION || header.bodyLength > MAX_FRAME_BODY_LEN || header.stream >= FRAME_MAX_STREAMS ||
+       !toMessageType(getLe16(data + 2), header.type))
+        return FrameStatus::INVALID;
+    return FrameStatus::COMPLETE;
+}
+
+static size_t writeVarint(uint64_t value, uint8_t *out) {
+    size_t written = 0;
+    do {
+        out[written++] = static_cast<uint8_t>((value & 0x7f) | (value > 0x7f ? 0x80 : 0));
+        value >>= 7;
+    } while(value > 0);
+    return written;
+}
+
+size_t encodeFieldKey(uint32_t fieldNumber, size_t length, uint8_t *out) {
+    size_t written = writeVarint((static_cast<uint64_t>(fieldNumber) << 3) | 2, out);  //wire type 2: length-delimited
+    return written + writeVarint(length, out + written);
+}
+
+size_t encodeVarintField(uint32_t fieldNumber, uint64_t value, uint8_t *out) {
+    size_t written = writeVarint(static_cast<uint64_t>(fieldNumber) << 3, out);  //wire type 0: varint
+    return written + writeVarint(value, out + written);
+}
+
+int OutboundFrame::iovecs(size_t offset, iovec *iov) const {
+    int count = 0;
+    if(offset < headLength) {
+        iov[count++] = {const_cast<uint8_t*>(head) + offset, headLength - offset};
+        offset = 0;
+    } else {
+        offset -= headLength;
+    }
+    if(offset < payloadLength)
+        iov[count++] = {const_cast<uint8_t*>(payload) + offset, payloadLength - offset};
+    return count;
+}
+
+PassedDescriptor::~PassedDescriptor() {
+    if(fd >= 0)
+        close(fd);
+}
+
+void attachDescriptor(msghdr &msg, int descriptor, uint8_t *control) {
+    msg.msg_control = control;
+    msg.msg_controllen = DESCRIPTOR_CONTROL_LEN;
+    cmsghdr *header = CMSG_FIRSTHDR(&msg);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int));
+    std::memcpy(CMSG_DATA(header), &descriptor, sizeof(int));
+}
+
+void OutboundFrame::complete(bool sent) {
+    if(completion == nullptr)
+        return;
+    auto done = std::move(completion);
+    completion = nullptr;
+    done(sent);
+}
+
+void OutboundFrame::own() {
+    if(storage != nullptr || payloadLength == 0)
+        return;
+    auto copy = std::make_shared<std::vector<uint8_t>>(payload, payload + payloadLength);
+    payload = copy->data();
+    storage = std::move(copy);
+}
+
+size_t encodeFrameHeader(const FrameHeader &header, uint8_t *out) {
+    if(header.legacy) {
+        //Always 8 bytes: both tags are written and the padded length is a 5 byte varint
+        uint32_t length = MSG_HEADER_PADD + MSG_HEADER_LEN + header.bodyLength;
+        out[0] = LEGACY_TYPE_TAG;
+        out[1] = static_cast<uint8_t>(header.type);
+        out[2] = LEGACY_LENGTH_TAG;
+        for(int i=0; i<5; i++) {
+            out[3 + i] = static_cast<uint8_t>(length & 0x7f) | (i < 4 ? 0x80 : 0);
+            length >>= 7;
+        }
+        return MSG_HEADER_LEN;
+    }
+
+    out[0] = FRAME_MAGIC;
+    out[1] = FRAME_VERSION;
+    putLe16(out + 2, static_cast<uint16_t>(header.type));
+    putLe16(out + 4, header.flags);
+    putLe16(out + 6, header.stream);
+    putLe32(out + 8, header.bodyLength);
+    putLe32(out + 12, header.sequence);
+    return FRAME_HEADER_LEN;
+}
+
+void StreamQueue::push(OutboundFrame &&frame) {
+    queues[frame.stream % FRAME_MAX_STREAMS].push_back(std::move(frame));
+    count++;
+}
+
+OutboundFrame &StreamQueue::front() {
+    if(current < 0) {
+        size_t stream = nextStream;
+        while(queues[stream].empty())
+            stream = (stream + 1) % FRAME_MAX_STREAMS;
+        current = static_cast<int>(stream);
+    }
+    return queues[current].front();
+}
+
+void StreamQueue::pop() {
+    front();
+    queues[current].pop_front();
+    count--;
+    nextStream = (current + 1) % FRAME_MAX_STREAMS;
+    current = -1;
+}
+
+void StreamQueue::fail(bool keepFront) {
+    for(int stream=0; stream<FRAME_MAX_STREAMS; stream++) {
+        auto &queue = queues[stream];
+        for(auto &frame : queue)
+            frame.complete(false);
+        size_t keep = keepFront && stream == current ? 1 : 0;
+        while(queue.size() > keep)
+            queue.pop_back();
+    }
+    count = keepFront && current >= 0 ? 1 : 0;
+    if(count == 0)
+        current = -1;
+}
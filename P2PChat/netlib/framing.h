@@ -0,0 +1,154 @@
+#ifndef P2PCHAT_FRAMING_H
+#define P2PCHAT_FRAMING_H
+
+#include "MessageTypes.h"
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+
+/*
+ Every message on the wire is a fixed 16 byte header followed by the protobuf encoded body.
+ All fields are little-endian:
+
+   0        1         2              4              6              8                12               16
+   +--------+---------+--------------+--------------+--------------+----------------+----------------+
+   | magic  | version | type (u16)   | flags (u16)  | stream (u16) | body length    | sequence       |
+   | 0xC5   |         |              |              |              | (u32)          | (u32)          |
+   +--------+---------+--------------+--------------+--------------+----------------+----------------+
+
+ Control, text, image and file traffic travel in separate streams. From wire version 4 a big
+ body is cut into fragments of FRAGMENT_LEN bytes: every fragment is a frame of its own with
+ FRAME_FLAG_MORE set on all but the last, and senders take turns between streams after every
+ frame, so a text does not wait behind a whole image. Sequence numbers count per stream.
+
+ The old header was a protobuf MessageHeader padded to 8 bytes with MSG_HEADER_PADD. Its first
+ byte is always a protobuf tag (0x08 or 0x10), never FRAME_MAGIC, so both can be told apart
+ from the first byte and we keep accepting it from peers that still send it.
+ */
+
+#define FRAME_MAGIC         0xC5
+#define FRAME_VERSION       1
+#define FRAME_HEADER_LEN    16
+#define MSG_HEADER_PADD     1000000000
+#define MSG_HEADER_LEN      8    //legacy protobuf header
+#define MAX_FRAME_BODY_LEN  (256u * 1024 * 1024)  //also the limit of a reassembled message
+
+#define FRAME_FLAG_MORE     0x0001  //a fragment, the message goes on in the next frame of the stream
+#define FRAME_FLAG_COMPRESSED 0x0002  //the (reassembled) body is compressed, see compression.h
+#define FRAME_MAX_STREAMS   8
+#define FRAGMENT_LEN        (64 * 1024)
+
+/*
+ Version of the message bodies, announced in AUTH and confirmed with AUTH_ACK.
+ 1: images are repeated int32. 2: images are raw bytes. 3: FILE transfers. 4: fragments.
+ 5: flow control with CREDIT. 6: big images in resumable IMAGE_CHUNKs. 7: keepalive PINGs.
+ 8: shared memory rings between peers on the same host.
+ A peer is talked to in version 1 until it proves it knows better.
+ */
+#define WIRE_VERSION        8
+
+#define BODY_PREFIX_MAX_LEN 48   //protobuf fields written in front of a payload that is sent from elsewhere
+#define DESCRIPTOR_CONTROL_LEN CMSG_SPACE(sizeof(int))  //control message that passes one file descriptor
+
+enum class FrameStream : uint16_t {
+    CONTROL = 0,  //AUTH, AUTH_ACK, CREDIT, IMAGE_RESUME, PING, RING_*: never held back by flow control
+    TEXT = 1,
+    IMAGE = 2,
+    FILE = 3
+};
+
+uint16_t streamOf(MessageType type);
+
+struct FrameHeader {
+    uint8_t version = FRAME_VERSION;
+    MessageType type = MessageType::INVALID;
+    uint16_t flags = 0;
+    uint16_t stream = 0;    //always 0 in the legacy header
+    uint32_t bodyLength = 0;
+    uint32_t sequence = 0;  //per connection counter, the legacy header does not carry it
+    bool legacy = false;    //received with (or to be sent with) the legacy protobuf header
+
+    size_t headerLength() const { return legacy ? MSG_HEADER_LEN : FRAME_HEADER_LEN; }
+    size_t frameLength() const { return headerLength() + bodyLength; }
+};
+
+enum class FrameStatus {
+    COMPLETE,   //header decoded
+    NEED_MORE,  //not enough bytes for the header yet
+    INVALID     //not a header we understand, the stream cannot be resynchronized
+};
+
+//Bytes needed before decodeFrameHeader() can decide, given the first byte of a frame
+size_t frameHeaderLength(uint8_t firstByte);
+FrameStatus decodeFrameHeader(const uint8_t *data, size_t available, FrameHeader &header);
+//Writes header.headerLength() bytes to out
+size_t encodeFrameHeader(const FrameHeader &header, uint8_t *out);
+//Protobuf key and length of a bytes/string field, so its content can be sent from where it already is
+size_t encodeFieldKey(uint32_t fieldNumber, size_t length, uint8_t *out);
+//A whole protobuf varint field
+size_t encodeVarintField(uint32_t fieldNumber, uint64_t value, uint8_t *out);
+
+//A file descriptor that goes to the peer of an AF_UNIX connection (SCM_RIGHTS), closed with its last owner
+struct PassedDescriptor {
+    const int fd;
+    explicit PassedDescriptor(int fd) : fd(fd) {}
+    ~PassedDescriptor();
+    PassedDescriptor(const PassedDescriptor&) = delete;
+    PassedDescriptor& operator=(const PassedDescriptor&) = delete;
+};
+
+//Makes msg pass descriptor along with the bytes it sends, control has DESCRIPTOR_CONTROL_LEN bytes
+void attachDescriptor(msghdr &msg, int descriptor, uint8_t *control);
+
+/*
+ A serialized message ready for writev/sendmsg: the frame header (and the protobuf fields
+ in front of the payload) in head, and the payload wherever it already lives.
+ storage keeps the payload alive when it is not borrowed from the caller's message.
+ */
+struct OutboundFrame {
+    uint8_t head[FRAME_HEADER_LEN + BODY_PREFIX_MAX_LEN];
+    size_t headLength = 0;
+    const uint8_t *payload = nullptr;
+    size_t payloadLength = 0;
+    std::shared_ptr<const void> storage;
+    std::function<void(bool)> completion;  //the caller's SendCompletion, if any
+    uint16_t stream = 0;
+    //Sent with the first byte of the frame, so the peer finds it when it reads the frame
+    std::shared_ptr<const PassedDescriptor> descriptor;
+
+    size_t size() const { return headLength + payloadLength; }
+    void complete(bool sent);
+    //Fills at most 2 entries with the bytes after offset, returns how many were used
+    int iovecs(size_t offset, iovec *iov) const;
+    //Copies a borrowed payload, for engines that send after sendMessage() returned
+    void own();
+};
+
+/*
+ Frames waiting for a connection, one FIFO per stream. front() takes the streams in turns,
+ and the frame it returned stays the front until pop(), also while it is partly sent.
+ */
+class StreamQueue {
+private:
+    std::array<std::deque<OutboundFrame>, FRAME_MAX_STREAMS> queues;
+    size_t count = 0;
+    int current = -1;  //stream of the frame front() returned
+    size_t nextStream = 0;
+
+public:
+    bool empty() const { return count == 0; }
+    void push(OutboundFrame &&frame);
+    OutboundFrame &front();
+    void pop();
+    //Completes every frame with false and drops it; a front frame the kernel still reads survives when keepFront
+    void fail(bool keepFront = false);
+};
+
+#endif
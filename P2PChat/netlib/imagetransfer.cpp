@@ -0,0 +1,288 @@
+#include <zlib.h>
+
+#include <numeric>
+
+#include "networking.h"
+#include "compression.h"
+#include "messages.pb.h"
+#include "protoarena.h"
+#include "logging.h"
+
+/*
+ Big IMAGEs travel in IMAGE_CHUNK frames with a CRC32 each. The sender keeps the image until
+ the receiver confirms it has all chunks with IMAGE_RESUME done. A receiver still missing
+ chunks (a CRC did not match) when the sender's last chunk arrives answers with the chunks it
+ has, and the sender sends the rest again. Both sides keep their half of a transfer under the
+ peer's name when its connection drops: after the next AUTH exchange the sender asks the
+ receiver what it has, so only the missing chunks are sent.
+ */
+
+#define IMAGE_MAX_CHUNKS    65536  //the chunk size grows for bigger images
+#define IMAGE_MAX_PASSES    8      //a transfer is given up after sending chunks that often
+#define IMAGE_MAX_INCOMING  16     //unfinished images kept per peer
+
+static size_t chunkCount(size_t size, size_t chunkSize) {
+    return (size + chunkSize - 1) / chunkSize;
+}
+
+void NetworkCom::sendImage(int clientSocket, const std::string &peerName, const ImageMessage &message,
+                           SendCompletion completion) {
+    size_t size = message.image->size();
+    size_t chunkSize = std::max(config.imageChunkSize, chunkCount(size, IMAGE_MAX_CHUNKS));
+    uint64_t transferId;
+    {
+        std::lock_guard<std::mutex> lock(imagesMutex);
+        transferId = imageTransferIds();
+        OutgoingImage &image = outgoingImages[std::make_pair(peerName, transferId)];
+        image.peerName = peerName;
+        image.image = message.image;
+        image.chunkSize = chunkSize;
+        image.passes = 1;
+        image.completion = std::move(completion);
+    }
+    getLogger()->info("Sending image of {} bytes to {} in chunks of {} bytes", size, peerName, chunkSize);
+
+    std::vector<uint32_t> chunks(chunkCount(size, chunkSize));
+    std::iota(chunks.begin(), chunks.end(), 0);
+    sendImageChunks(clientSocket, transferId, message.image, chunkSize, chunks);
+}
+
+void NetworkCom::sendImageChunks(int clientSocket, uint64_t transferId, const std::shared_ptr<std::vector<uint8_t>> &image,
+                                 size_t chunkSize, const std::vector<uint32_t> &chunks) {
+    auto peer = peers.context(clientSocket);
+    std::lock_guard<std::recursive_mutex> lock(peer->sendMutex);
+    for(size_t i = 0; i < chunks.size(); i++) {
+        size_t offset = size_t(chunks[i]) * chunkSize;
+        size_t len = std::min(chunkSize, image->size() - offset);
+        const uint8_t *data = image->data() + offset;
+
+        //Every chunk describes the whole transfer, the receiver may see any of them first
+        uint8_t prefix[BODY_PREFIX_MAX_LEN];
+        size_t prefixLength = encodeVarintField(messages::ImageChunk::kTransferIdFieldNumber, transferId, prefix);
+        prefixLength += encodeVarintField(messages::ImageChunk::kSizeFieldNumber, image->size(), prefix + prefixLength);
+        prefixLength += encodeVarintField(messages::ImageChunk::kChunkSizeFieldNumber, chunkSize, prefix + prefixLength);
+        prefixLength += encodeVarintField(messages::ImageChunk::kIndexFieldNumber, chunks[i], prefix + prefixLength);
+        prefixLength += encodeVarintField(messages::ImageChunk::kCrc32FieldNumber, crc32(0L, data, len),
+                                          prefix + prefixLength);
+        if(i + 1 == chunks.size())
+            prefixLength += encodeVarintField(messages::ImageChunk::kLastFieldNumber, 1, prefix + prefixLength);
+        prefixLength += encodeFieldKey(messages::ImageChunk::kDataFieldNumber, len, prefix + prefixLength);
+
+        OutboundFrame frame;
+        frame.payload = data;
+        frame.payloadLength = len;
+        frame.storage = image;
+        uint16_t flags = 0;
+        if((peerCompression(clientSocket) & COMPRESSION_ZLIB) && compressPayload(config, prefix, prefixLength, frame))
+            flags = FRAME_FLAG_COMPRESSED;
+        if(!finishFrame(clientSocket, MessageType::IMAGE_CHUNK, prefix, prefixLength, frame, flags))
+            return;
+        writeFragments(clientSocket, frame);
+    }
+}
+
+//received is null for a query or done, an empty vector for a transfer we know nothing about
+void NetworkCom::sendImageResume(int clientSocket, uint64_t transferId, const std::vector<bool> *received, bool done,
+                                 bool query) {
+    std::shared_ptr<std::vector<uint8_t>> body;
+    {
+        ProtoArenaScope arenaScope;
+        auto resumeProto = google::protobuf::Arena::CreateMessage<messages::ImageResume>(arenaScope.arena());
+        resumeProto->set_transfer_id(transferId);
+        resumeProto->set_done(done);
+        resumeProto->set_query(query);
+        if(received != nullptr) {
+            std::string chunks((received->size() + 7) / 8, '\0');
+            for(size_t i = 0; i < received->size(); i++) {
+                if((*received)[i])
+                    chunks[i / 8] = static_cast<char>(chunks[i / 8] | (1 << (i % 8)));
+            }
+            resumeProto->set_chunks(std::move(chunks));
+        }
+        body = std::make_shared<std::vector<uint8_t>>(resumeProto->ByteSizeLong());
+        resumeProto->SerializeWithCachedSizesToArray(body->data());
+    }
+
+    auto peer = peers.context(clientSocket);
+    std::lock_guard<std::recursive_mutex> lock(peer->sendMutex);
+    OutboundFrame frame;
+    frame.payload = body->data();
+    frame.payloadLength = body->size();
+    frame.storage = body;
+    if(finishFrame(clientSocket, MessageType::IMAGE_RESUME, nullptr, 0, frame))
+        transmit(clientSocket, frame);
+}
+
+//After the AUTH exchange with a peer: asks it about the images we did not finish sending it
+void NetworkCom::resumeImages(int clientSocket, const std::string &peerName) {
+    if(peerWireVersion(clientSocket) < 6)
+        return;
+    std::vector<uint64_t> transferIds;
+    {
+        std::lock_guard<std::mutex> lock(imagesMutex);
+        for(auto it = outgoingImages.lower_bound({peerName, 0}); it != outgoingImages.end() &&
+                                                                  it->first.first == peerName; ++it)
+            transferIds.push_back(it->first.second);
+    }
+    for(uint64_t transferId : transferIds) {
+        getLogger()->info("Resuming image transfer {} to {}", transferId, peerName);
+        sendImageResume(clientSocket, transferId, nullptr, false, true);
+    }
+}
+
+void NetworkCom::imageChunkReceived(int clientSocket, const std::string &peerName, const uint8_t *body, size_t len) {
+    ProtoArenaScope arenaScope;
+    auto chunkProto = google::protobuf::Arena::CreateMessage<messages::ImageChunk>(arenaScope.arena());
+    chunkProto->ParseFromArray(body, static_cast<int>(len));
+
+    uint64_t transferId = chunkProto->transfer_id();
+    size_t size = chunkProto->size();
+    size_t chunkSize = chunkProto->chunk_size();
+    const std::string &data = chunkProto->data();
+    if(size == 0 || size > MAX_FRAME_BODY_LEN || chunkSize == 0 || chunkCount(size, chunkSize) > IMAGE_MAX_CHUNKS ||
+       chunkProto->index() >= chunkCount(size, chunkSize) ||
+       data.size() != std::min(chunkSize, size - size_t(chunkProto->index()) * chunkSize)) {
+        getLogger()->warn("Invalid chunk of image transfer {} from {}", transferId, peerName);
+        return;
+    }
+    bool intact = crc32(0L, reinterpret_cast<const uint8_t*>(data.data()), data.size()) == chunkProto->crc32();
+    if(!intact)
+        getLogger()->warn("Chunk {} of image transfer {} from {} is corrupt", chunkProto->index(), transferId, peerName);
+
+    auto key = std::make_pair(peerName, transferId);
+    std::shared_ptr<std::vector<uint8_t>> complete;
+    std::vector<bool> received;
+    bool resume = false;
+    {
+        std::lock_guard<std::mutex> lock(imagesMutex);
+        auto it = incomingImages.find(key);
+        if(it == incomingImages.end()) {
+            size_t unfinished = 0;
+            for(auto other = incomingImages.lower_bound({peerName, 0}); other != incomingImages.end() &&
+                                                                       other->first.first == peerName; ++other)
+                unfinished++;
+            if(unfinished >= IMAGE_MAX_INCOMING) {
+                getLogger()->warn("{} has too many unfinished images, dropping transfer {}", peerName, transferId);
+                return;
+            }
+            IncomingImage image;
+            image.image = std::make_shared<std::vector<uint8_t>>(size);
+            image.chunkSize = chunkSize;
+            image.received.resize(chunkCount(size, chunkSize));
+            it = incomingImages.emplace(key, std::move(image)).first;
+        }
+        IncomingImage &image = it->second;
+        if(image.image->size() != size || image.chunkSize != chunkSize) {
+            getLogger()->warn("Chunk of image transfer {} from {} does not match the others", transferId, peerName);
+            return;
+        }
+        if(intact && !image.received[chunkProto->index()]) {
+            std::copy(data.begin(), data.end(), image.image->begin() + size_t(chunkProto->index()) * chunkSize);
+            image.received[chunkProto->index()] = true;
+            image.receivedCount++;
+        }
+        if(image.receivedCount == image.received.size()) {
+            complete = image.image;
+            incomingImages.erase(it);
+        } else if(chunkProto->last()) {
+            received = image.received;
+            resume = true;
+        }
+    }
+
+    if(complete != nullptr) {
+        sendImageResume(clientSocket, transferId, nullptr, true, false);
+        getLogger()->info("Received IMAGE message from {} in chunks", peerName);
+        uiCallbacks->newImageMessage(peerName, std::unique_ptr<ImageMessage>(new ImageMessage(complete)));
+    } else if(resume) {
+        sendImageResume(clientSocket, transferId, &received, false, false);
+    }
+}
+
+void NetworkCom::imageResumeReceived(int clientSocket, const std::string &peerName, const uint8_t *body, size_t len) {
+    ProtoArenaScope arenaScope;
+    auto resumeProto = google::protobuf::Arena::CreateMessage<messages::ImageResume>(arenaScope.arena());
+    resumeProto->ParseFromArray(body, static_cast<int>(len));
+    uint64_t transferId = resumeProto->transfer_id();
+    auto key = std::make_pair(peerName, transferId);
+
+    //We receive this image: the sender wants to know what is missing
+    if(resumeProto->query()) {
+        std::vector<bool> received;
+        {
+            std::lock_guard<std::mutex> lock(imagesMutex);
+            auto it = incomingImages.find(key);
+            if(it != incomingImages.end())
+                received = it->second.received;
+        }
+        sendImageResume(clientSocket, transferId, &received, false, false);
+        return;
+    }
+
+    SendCompletion completion;
+    std::shared_ptr<std::vector<uint8_t>> image;
+    size_t chunkSize = 0;
+    bool known = false;
+    bool givenUp = false;
+    {
+        std::lock_guard<std::mutex> lock(imagesMutex);
+        if(resumeProto->done()) {
+            //Either side may end a transfer: the receiver has the image, or the sender cannot send it anymore
+            auto outgoing = outgoingImages.find(key);
+            if(outgoing != outgoingImages.end()) {
+                completion = std::move(outgoing->second.completion);
+                outgoingImages.erase(outgoing);
+            } else if(incomingImages.erase(key) > 0) {
+                getLogger()->warn("{} gave up sending image transfer {}", peerName, transferId);
+            }
+        } else {
+            auto outgoing = outgoingImages.find(key);
+            known = outgoing != outgoingImages.end();
+            if(known && ++outgoing->second.passes > IMAGE_MAX_PASSES) {
+                givenUp = true;
+                completion = std::move(outgoing->second.completion);
+                outgoingImages.erase(outgoing);
+            } else if(known) {
+                image = outgoing->second.image;
+                chunkSize = outgoing->second.chunkSize;
+            }
+        }
+    }
+
+    if(resumeProto->done()) {
+        if(completion != nullptr)
+            completion(true);
+        return;
+    }
+    if(!known || givenUp) {
+        getLogger()->warn("Giving up image transfer {} to {}", transferId, peerName);
+        sendImageResume(clientSocket, transferId, nullptr, true, false);
+        if(completion != nullptr)
+            completion(false);
+        return;
+    }
+
+    //What the receiver does not have goes again
+    const std::string &chunks = resumeProto->chunks();
+    std::vector<uint32_t> missing;
+    for(size_t i = 0; i < chunkCount(image->size(), chunkSize); i++) {
+        if(i / 8 >= chunks.size() || !(static_cast<uint8_t>(chunks[i / 8]) & (1 << (i % 8))))
+            missing.push_back(static_cast<uint32_t>(i));
+    }
+    getLogger()->info("Sending {} missing chunks of image transfer {} to {}", missing.size(), transferId, peerName);
+    if(!missing.empty())
+        sendImageChunks(clientSocket, transferId, image, chunkSize, missing);
+}
+
+void NetworkCom::stopImageTransfers() {
+    std::map<std::pair<std::string, uint64_t>, OutgoingImage> dropped;
+    {
+        std::lock_guard<std::mutex> lock(imagesMutex);
+        dropped.swap(outgoingImages);
+        incomingImages.clear();
+    }
+    for(auto &[key, image] : dropped) {
+        if(image.completion != nullptr)
+            image.completion(false);
+    }
+}
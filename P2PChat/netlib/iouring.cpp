@@ -0,0 +1,148 @@
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+
+#include "iouring.h"
+#include "logging.h"
+
+IoUring::IoUring() : ringFd(-1), sqRingPtr(MAP_FAILED), sqRingSize(0), cqRingPtr(MAP_FAILED), cqRingSize(0),
+                     sqes(nullptr), sqesSize(0), sqHead(nullptr), sqTail(nullptr), sqMask(nullptr),
+                     sqArray(nullptr), sqEntries(0), localSqTail(0), cqHead(nullptr), cqTail(nullptr),
+                     cqMask(nullptr), cqes(nullptr), bufRing(nullptr), bufRingSize(0), bufMemory(nullptr),
+                     bufCount(0), bufSize(0), bufGroup(0) {}
+
+IoUring::~IoUring() {
+    release();
+}
+
+void IoUring::release() {
+    if(bufRing != nullptr) {
+        io_uring_buf_reg reg{};
+        reg.bgid = bufGroup;
+        syscall(__NR_io_uring_register, ringFd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+        munmap(bufRing, bufRingSize);
+        munmap(bufMemory, bufCount * bufSize);
+        bufRing = nullptr;
+    }
+    if(sqes != nullptr)
+        munmap(sqes, sqesSize);
+    if(cqRingPtr != MAP_FAILED && cqRingPtr != sqRingPtr)
+        munmap(cqRingPtr, cqRingSize);
+    if(sqRingPtr != MAP_FAILED)
+        munmap(sqRingPtr, sqRingSize);
+    if(ringFd >= 0)
+        close(ringFd);
+    sqes = nullptr;
+    sqRingPtr = cqRingPtr = MAP_FAILED;
+    ringFd = -1;
+}
+
+bool IoUring::init(unsigned entries) {
+    io_uring_params params{};
+    ringFd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+    if(ringFd < 0) {
+        getLogger()->error("io_uring_setup() failed. errno: {}", errno);
+        return false;
+    }
+
+    sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if(singleMmap)
+        sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+
+    sqRingPtr = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     ringFd, IORING_OFF_SQ_RING);
+    cqRingPtr = singleMmap ? sqRingPtr :
+                mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     ringFd, IORING_OFF_CQ_RING);
+    sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    void *sqesPtr = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ringFd, IORING_OFF_SQES);
+    if(sqRingPtr == MAP_FAILED || cqRingPtr == MAP_FAILED || sqesPtr == MAP_FAILED) {
+        getLogger()->error("Cannot map io_uring rings. errno: {}", errno);
+        release();
+        return false;
+    }
+    sqes = static_cast<io_uring_sqe*>(sqesPtr);
+
+    auto *sq = static_cast<uint8_t*>(sqRingPtr);
+    sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sqMask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    sqEntries = params.sq_entries;
+    localSqTail = *sqTail;
+
+    auto *cq = static_cast<uint8_t*>(cqRingPtr);
+    cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cqMask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    return true;
+}
+
+bool IoUring::registerBufferRing(uint16_t group, unsigned count, size_t size) {
+    //The kernel wants a power of two number of entries
+    bufRingSize = count * sizeof(io_uring_buf);
+    void *ringPtr = mmap(nullptr, bufRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    void *memory = mmap(nullptr, count * size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(ringPtr == MAP_FAILED || memory == MAP_FAILED) {
+        getLogger()->error("Cannot allocate io_uring receive buffers. errno: {}", errno);
+        return false;
+    }
+
+    io_uring_buf_reg reg{};
+    reg.ring_addr = reinterpret_cast<uint64_t>(ringPtr);
+    reg.ring_entries = count;
+    reg.bgid = group;
+    if(syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        getLogger()->error("Cannot register io_uring buffer ring. errno: {}", errno);
+        munmap(ringPtr, bufRingSize);
+        munmap(memory, count * size);
+        return false;
+    }
+
+    bufRing = static_cast<io_uring_buf_ring*>(ringPtr);
+    bufMemory = static_cast<uint8_t*>(memory);
+    bufCount = count;
+    bufSize = size;
+    bufGroup = group;
+    bufRing->tail = 0;
+    for(unsigned i=0; i<count; i++)
+        recycleBuffer(static_cast<uint16_t>(i));
+    return true;
+}
+
+void IoUring::recycleBuffer(uint16_t id) {
+    uint16_t tail = bufRing->tail;
+    //Not bufRing->bufs: in C++ the kernel's flexible array macro shifts it by 8 bytes
+    io_uring_buf &buf = reinterpret_cast<io_uring_buf*>(bufRing)[tail & (bufCount - 1)];
+    buf.addr = reinterpret_cast<uint64_t>(buffer(id));
+    buf.len = static_cast<uint32_t>(bufSize);
+    buf.bid = id;
+    __atomic_store_n(&bufRing->tail, static_cast<uint16_t>(tail + 1), __ATOMIC_RELEASE);
+}
+
+io_uring_sqe *IoUring::getSqe() {
+    unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+    if(localSqTail - head >= sqEntries)
+        return nullptr;
+    unsigned index = localSqTail & *sqMask;
+    io_uring_sqe *sqe = &sqes[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sqArray[index] = index;
+    localSqTail++;
+    return sqe;
+}
+
+int IoUring::submitAndWait(unsigned waitNr) {
+    unsigned toSubmit = localSqTail - *sqTail;
+    __atomic_store_n(sqTail, localSqTail, __ATOMIC_RELEASE);
+    unsigned flags = waitNr > 0 ? IORING_ENTER_GETEVENTS : 0;
+    int ret = static_cast<int>(syscall(__NR_io_uring_enter, ringFd, toSubmit, waitNr, flags, nullptr, 0));
+    return ret < 0 ? -errno : ret;
+}
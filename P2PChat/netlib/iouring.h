@@ -0,0 +1,75 @@
+#ifndef P2PCHAT_IOURING_H
+#define P2PCHAT_IOURING_H
+
+#include <linux/io_uring.h>
+#include <cstddef>
+#include <cstdint>
+
+/*
+ Thin wrapper over the raw io_uring syscalls (we do not depend on liburing).
+ It owns the submission/completion rings and one provided-buffer ring that multishot
+ recv picks its buffers from. Not thread safe: only the engine thread may use it.
+ */
+class IoUring {
+private:
+    int ringFd;
+
+    void *sqRingPtr;
+    size_t sqRingSize;
+    void *cqRingPtr;
+    size_t cqRingSize;
+    io_uring_sqe *sqes;
+    size_t sqesSize;
+
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned *sqMask;
+    unsigned *sqArray;
+    unsigned sqEntries;
+    unsigned localSqTail;
+
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned *cqMask;
+    io_uring_cqe *cqes;
+
+    io_uring_buf_ring *bufRing;
+    size_t bufRingSize;
+    uint8_t *bufMemory;
+    unsigned bufCount;
+    size_t bufSize;
+    uint16_t bufGroup;
+
+    void release();
+
+public:
+    IoUring();
+    ~IoUring();
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    bool init(unsigned entries);
+    bool registerBufferRing(uint16_t group, unsigned count, size_t size);
+
+    io_uring_sqe *getSqe();
+    int submitAndWait(unsigned waitNr);
+
+    uint16_t bufferGroup() const { return bufGroup; }
+    uint8_t *buffer(uint16_t id) const { return bufMemory + id * bufSize; }
+    void recycleBuffer(uint16_t id);
+
+    template<typename F> unsigned forEachCompletion(F &&handler) {
+        unsigned head = *cqHead;
+        unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        unsigned count = 0;
+        for(; head != tail; head++, count++) {
+            io_uring_cqe cqe = cqes[head & *cqMask];
+            //Give the slot back before the handler runs, it may want to submit more work
+            __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+            handler(cqe);
+        }
+        return count;
+    }
+};
+
+#endif
@@ -0,0 +1,227 @@
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <cstring>
+
+#include "networking.h"
+#include "messages.pb.h"
+#include "protoarena.h"
+#include "logging.h"
+
+/*
+ Peers on the same host, with NetConfig::sharedMemoryRing on both sides and wire version 8,
+ move their frames off TCP into a SharedRing. The side that accepted the connection creates
+ the segment and offers it with RING_OFFER after its AUTH_ACK. The other side maps it and
+ answers RING_SWITCH as the last frame it sends over TCP, then writes to its ring. The offerer
+ reads that ring once the SWITCH arrived and does the same in turn, so every frame is read
+ after the ones that took TCP before it. The TCP connection stays open, idle, and its end is
+ still what tells that the peer is gone.
+ Frames are numbered and then written without a common lock (the file sender, CREDIT), so the
+ writes of a peer that may switch go through transmit() under its transmitMutex: none is halfway
+ into the engine when the SWITCH goes out.
+ */
+
+static bool onThisHost(int clientSocket) {
+    sockaddr_storage local{}, remote{};
+    socklen_t localLength = sizeof(local), remoteLength = sizeof(remote);
+    if(getsockname(clientSocket, reinterpret_cast<sockaddr*>(&local), &localLength) < 0 ||
+       getpeername(clientSocket, reinterpret_cast<sockaddr*>(&remote), &remoteLength) < 0 ||
+       local.ss_family != remote.ss_family)
+        return false;
+    if(remote.ss_family == AF_INET) {
+        auto localAddress = reinterpret_cast<const sockaddr_in*>(&local)->sin_addr.s_addr;
+        auto remoteAddress = reinterpret_cast<const sockaddr_in*>(&remote)->sin_addr.s_addr;
+        return (ntohl(remoteAddress) >> 24) == 127 || remoteAddress == localAddress;
+    }
+    if(remote.ss_family == AF_INET6) {
+        auto &localAddress = reinterpret_cast<const sockaddr_in6*>(&local)->sin6_addr;
+        auto &remoteAddress = reinterpret_cast<const sockaddr_in6*>(&remote)->sin6_addr;
+        return IN6_IS_ADDR_LOOPBACK(&remoteAddress) || std::memcmp(&localAddress, &remoteAddress, sizeof(in6_addr)) == 0;
+    }
+    return false;
+}
+
+//Null for peers that never switch. Decided by the first frame we send (AUTH or AUTH_ACK), before any offer
+std::shared_ptr<PeerContext> NetworkCom::ringCandidate(int clientSocket) {
+    if(config.sharedMemoryRing == 0)
+        return nullptr;
+    auto peer = peers.find(clientSocket);
+    if(peer == nullptr)
+        return nullptr;
+    std::lock_guard<std::mutex> lock(peer->mutex);
+    if(peer->link.sameHost < 0)
+        peer->link.sameHost = onThisHost(clientSocket) ? 1 : 0;
+    return peer->link.sameHost > 0 ? peer : nullptr;
+}
+
+void NetworkCom::transmit(int clientSocket, OutboundFrame &frame) {
+    auto peer = ringCandidate(clientSocket);
+    if(peer == nullptr) {
+        writeMessage(clientSocket, frame);
+        return;
+    }
+    std::lock_guard<std::recursive_mutex> lock(peer->transmitMutex);
+    if(peer->ringLink != nullptr && peer->ringLink->isWriting())
+        peer->ringLink->write(frame);
+    else
+        writeMessage(clientSocket, frame);
+}
+
+bool NetworkCom::transmitFileChunk(int clientSocket, OutboundFrame &frame, int fileFd, off_t offset, size_t len) {
+    auto peer = ringCandidate(clientSocket);
+    if(peer == nullptr)
+        return writeFileChunk(clientSocket, frame, fileFd, offset, len);
+    std::shared_ptr<RingLink> link;
+    {
+        std::lock_guard<std::recursive_mutex> lock(peer->transmitMutex);
+        if(peer->ringLink == nullptr || !peer->ringLink->isWriting())
+            return writeFileChunk(clientSocket, frame, fileFd, offset, len);
+        link = peer->ringLink;
+    }
+    //Switched for good, only this thread writes the FILE stream, so the chunk may wait for room unlocked
+    return link->writeFileChunk(frame, fileFd, offset, len);
+}
+
+void NetworkCom::sendRingMessage(int clientSocket, MessageType type, const std::string &name, size_t capacity,
+                                 bool accepted) {
+    std::shared_ptr<std::vector<uint8_t>> body;
+    {
+        ProtoArenaScope arenaScope;
+        auto ringProto = google::protobuf::Arena::CreateMessage<messages::SharedRing>(arenaScope.arena());
+        ringProto->set_name(name);
+        ringProto->set_capacity(capacity);
+        ringProto->set_accepted(accepted);
+        body = std::make_shared<std::vector<uint8_t>>(ringProto->ByteSizeLong());
+        ringProto->SerializeWithCachedSizesToArray(body->data());
+    }
+    OutboundFrame frame;
+    frame.payload = body->data();
+    frame.payloadLength = body->size();
+    frame.storage = body;
+    if(finishFrame(clientSocket, type, nullptr, 0, frame))
+        transmit(clientSocket, frame);
+}
+
+std::shared_ptr<RingLink> NetworkCom::openRingLink(int clientSocket, std::unique_ptr<SharedRing> ring) {
+    //The connection is closed with shutdown() like a timed out one, its engine cleans up
+    auto link = std::make_shared<RingLink>(std::move(ring),
+            [this, clientSocket](const uint8_t *data, size_t len, bool &valid){
+                return consumeFrames(clientSocket, data, len, valid);
+            },
+            [clientSocket](){ shutdown(clientSocket, SHUT_RDWR); });
+    std::lock_guard<std::mutex> lock(ringLinksMutex);
+    if(ringLinksStopped)
+        return nullptr;
+    ringLinks[clientSocket] = link;
+    link->start("p2p-ring", config.ioCpus);
+    return link;
+}
+
+//The accepting side, right after its AUTH_ACK
+void NetworkCom::offerSharedRing(int clientSocket) {
+    auto peer = ringCandidate(clientSocket);
+    if(peer == nullptr)
+        return;
+    auto ring = SharedRing::create(config.sharedMemoryRing);
+    if(ring == nullptr)
+        return;
+    std::string name = ring->name();
+    size_t capacity = ring->size();
+    auto link = openRingLink(clientSocket, std::move(ring));
+    if(link == nullptr)
+        return;
+    {
+        std::lock_guard<std::recursive_mutex> lock(peer->transmitMutex);
+        peer->ringLink = link;
+    }
+    getLogger()->info("Offering shared ring {} of {} bytes to socket {}", name, capacity, clientSocket);
+    sendRingMessage(clientSocket, MessageType::RING_OFFER, name, capacity, false);
+}
+
+void NetworkCom::sharedRingOffered(int clientSocket, const uint8_t *body, size_t len) {
+    ProtoArenaScope arenaScope;
+    auto ringProto = google::protobuf::Arena::CreateMessage<messages::SharedRing>(arenaScope.arena());
+    ringProto->ParseFromArray(body, static_cast<int>(len));
+
+    auto peer = ringCandidate(clientSocket);
+    std::shared_ptr<RingLink> link;
+    if(peer != nullptr) {
+        auto ring = SharedRing::open(ringProto->name(), ringProto->capacity());
+        if(ring != nullptr)
+            link = openRingLink(clientSocket, std::move(ring));
+    }
+    if(link == nullptr) {
+        sendRingMessage(clientSocket, MessageType::RING_SWITCH, "", 0, false);
+        return;
+    }
+    std::lock_guard<std::recursive_mutex> lock(peer->transmitMutex);
+    peer->ringLink = link;
+    sendRingMessage(clientSocket, MessageType::RING_SWITCH, "", 0, true);
+    link->startWriting();
+    getLogger()->info("Socket {} switched to shared ring {}", clientSocket, ringProto->name());
+}
+
+void NetworkCom::sharedRingSwitched(int clientSocket, const uint8_t *body, size_t len) {
+    ProtoArenaScope arenaScope;
+    auto ringProto = google::protobuf::Arena::CreateMessage<messages::SharedRing>(arenaScope.arena());
+    ringProto->ParseFromArray(body, static_cast<int>(len));
+
+    auto peer = peers.find(clientSocket);
+    if(peer == nullptr)
+        return;
+    std::shared_ptr<RingLink> link;
+    {
+        std::lock_guard<std::recursive_mutex> lock(peer->transmitMutex);
+        link = peer->ringLink;
+        if(!ringProto->accepted())
+            peer->ringLink = nullptr;
+    }
+    if(link == nullptr)
+        return;
+    //Mapped by the peer or refused, nobody else is going to open it
+    std::string name = link->sharedRing().name();
+    link->sharedRing().unlink();
+    if(!ringProto->accepted()) {
+        getLogger()->info("Socket {} stays on TCP", clientSocket);
+        {
+            std::lock_guard<std::mutex> lock(ringLinksMutex);
+            auto it = ringLinks.find(clientSocket);
+            if(it != ringLinks.end() && it->second == link)
+                ringLinks.erase(it);
+        }
+        link->stop(false);
+        return;
+    }
+
+    link->startReading();
+    std::lock_guard<std::recursive_mutex> lock(peer->transmitMutex);
+    if(!link->isWriting()) {
+        sendRingMessage(clientSocket, MessageType::RING_SWITCH, "", 0, true);
+        link->startWriting();
+        getLogger()->info("Socket {} switched to shared ring {}", clientSocket, name);
+    }
+}
+
+//Before the socket is forgotten: what the peer wrote into its ring is consumed first
+void NetworkCom::closeSharedRing(int clientSocket) {
+    std::shared_ptr<RingLink> link;
+    {
+        std::lock_guard<std::mutex> lock(ringLinksMutex);
+        auto it = ringLinks.find(clientSocket);
+        if(it == ringLinks.end())
+            return;
+        link = std::move(it->second);
+        ringLinks.erase(it);
+    }
+    link->stop(true);
+}
+
+void NetworkCom::stopSharedRings() {
+    std::unordered_map<int, std::shared_ptr<RingLink>> links;
+    {
+        std::lock_guard<std::mutex> lock(ringLinksMutex);
+        ringLinksStopped = true;
+        links.swap(ringLinks);
+    }
+    for(auto &[clientSocket, link] : links)
+        link->stop(false);
+}
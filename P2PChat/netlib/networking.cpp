@@ -3,309 +3,984 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <poll.h>
 #include <google/protobuf/io/zero_copy_stream_impl.h>
 #include <google/protobuf/util/delimited_message_util.h>
 
+#include <algorithm>
+#include <future>
 #include <memory>
 #include "MessageTypes.h"
-#include "UiNetlibInterfaces.h"
+#include "networking.h"
+#include "reactor.h"
+#include "proactor.h"
 #include "messages.pb.h"
+#include "protoarena.h"
+#include "compression.h"
+#include "threading.h"
 #include "logging.h"
 
-#define MSG_HEADER_PADD 1000000000
-#define MSG_HEADER_LEN  8
-
-NetworkCom::NetworkCom(int _localPort, UiCallbacks *_uiCallbacks):
-        localPort(_localPort), uiCallbacks(_uiCallbacks) {
+NetworkCom::NetworkCom(int _localPort, UiCallbacks *_uiCallbacks, const NetConfig &_config):
+        config(_config), localPort(_localPort), localSocket(-1), uiCallbacks(_uiCallbacks), unixSocket(-1),
+        fileSenderStopped(false), nextTransferId(0), imageTransferIds(std::random_device{}()),
+        timers(config.serviceCpus), connector(config.connectTimeout, config.connectAttemptDelay, config.serviceCpus) {
     isListeningLocally = false;
-    listenerThread = std::make_unique<std::thread>([this](){this->startListening();});
+    if(config.dispatchThreads > 0)
+        dispatchPool = std::make_unique<DispatchPool>(config.dispatchThreads, config.dispatchQueueDepth, config.dispatchCpus);
 }
 
 NetworkCom::~NetworkCom(){
+    stopListening();
+    stopFileTransfers();
+    stopImageTransfers();
+    timers.stop();
+    connector.stop();
+    stopSharedRings();
+    if(listenerThread && listenerThread->joinable())
+        listenerThread->join();
+    if(unixListenerThread && unixListenerThread->joinable())
+        unixListenerThread->join();
+
+    //Connection threads are detached, but they still use this object until they return
+    std::unique_lock<std::mutex> lock(handlerSocketsMutex);
+    handlerSocketsEmpty.wait(lock, [this](){ return handlerSockets.empty(); });
+}
+
+void NetworkCom::start() {
+    listenerThread = std::make_unique<std::thread>([this](){
+        setupThread("p2p-listener", config.ioCpus);
+        this->startListening();
+    });
 }
 
 void NetworkCom::addNewSocket(const std::string &peerName, int clientSocket) {
-    std::unique_lock<std::shared_mutex> lock(openSocketsMutex);
-    openSockets[peerName] = clientSocket;
-    openSocketsToName[clientSocket] = peerName;
+    peers.bindName(peerName, clientSocket);
 }
 
-void NetworkCom::removeSocket(const std::string &peerName) {
-    std::unique_lock<std::shared_mutex> lock(openSocketsMutex);
-    auto it = openSockets.find(peerName);
-    int clientSocket =-1;
-    if(it != openSockets.end()) {
-        clientSocket = it->second;
-        openSockets.erase(it);
-    }
-    auto iter = openSocketsToName.find(clientSocket);
-    if(iter!=openSocketsToName.end()){
-        openSocketsToName.erase(iter);
-    }
+//Only the name goes, the link state of the socket lives until its last task was delivered
+std::string NetworkCom::removeSocket(int clientSocket) {
+    return peers.unbindName(clientSocket);
 }
 
 int NetworkCom::getClientSocket(const std::string &peerName) {
-    std::shared_lock<std::shared_mutex> lock(openSocketsMutex);
-    auto it = openSockets.find(peerName);
-    if(it != openSockets.end())
-        return it->second;
-    return -1;
+    auto peer = peers.find(peerName);
+    return peer != nullptr ? peer->socket : -1;
 }
 
 std::string NetworkCom::getSocketName(int clientSocket) {
-    std::shared_lock<std::shared_mutex> lock(openSocketsMutex);
-    auto it = openSocketsToName.find(clientSocket);
-    if(it != openSocketsToName.end())
-        return it->second;
+    auto peer = peers.find(clientSocket);
+    if(peer != nullptr) {
+        std::lock_guard<std::mutex> lock(peer->mutex);
+        if(!peer->name.empty())
+            return peer->name;
+    }
     return "[INVALID]";
 }
 
 void NetworkCom::stopListening() {
-    std::unique_lock<std::shared_mutex> lock(openSocketsMutex);
+    stopFileTransfers();
+    stopImageTransfers();
+    timers.stop();
+    connector.stop();
+    stopSharedRings();
+    std::lock_guard<std::mutex> lock(listeningMutex);
     if(!isListeningLocally) {
         getLogger()->info("Application is not listening on any ports. Exiting.");
         return;
     }
 
     getLogger()->info("Disconnecting from all peers and shutting down networking.");
-    for (auto &[clientSocket, name]: openSocketsToName) {
-        close(clientSocket);
+    {
+        //Connection threads notice the shutdown, report the disconnection and close their sockets
+        std::lock_guard<std::mutex> handlersLock(handlerSocketsMutex);
+        for (int clientSocket: handlerSockets) {
+            shutdown(clientSocket, SHUT_RDWR);
+        }
     }
+    //shutdown() is what wakes up a thread blocked in accept(), close() alone does not.
+    shutdown(localSocket, SHUT_RDWR);
     close(localSocket);
+    closeUnixListeningSocket();
     isListeningLocally = false;
     getLogger()->info("Networking stopped!");
 }
 
-void NetworkCom::startListening() {
+void NetworkCom::createListeningSocket(int socketFlags) {
+    localSocket = openListeningSocket(socketFlags, false);
+    getLogger()->info("Waiting for connections on: {}", localPort);
+    isListeningLocally = true;
+}
+
+//With reusePort every call gets a socket of its own on the same port, the kernel spreads connections over them
+int NetworkCom::openListeningSocket(int socketFlags, bool reusePort) {
     getLogger()->info("Creating local socket on: {}",localPort);
 
-    localSocket = socket(AF_INET, SOCK_STREAM, 0);
-    if (localSocket < 0) {
+    int listeningSocket = socket(AF_INET, SOCK_STREAM | socketFlags, 0);
+    if (listeningSocket < 0) {
         getLogger()->error("socket creation on {} failed. errno: {}", localPort, errno);
         exit(EXIT_FAILURE);
     }
 
+    //Let a restarted instance bind while old connections are still in TIME_WAIT
+    int reuse = 1;
+    setsockopt(listeningSocket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (reusePort && setsockopt(listeningSocket, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0) {
+        getLogger()->error("Cannot set SO_REUSEPORT on {}. errno: {}", localPort, errno);
+        exit(EXIT_FAILURE);
+    }
+
     struct sockaddr_in addr{};
     std::memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
     addr.sin_port = htons(localPort);
     addr.sin_addr.s_addr = INADDR_ANY;
 
-    if (bind(localSocket, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    if (bind(listeningSocket, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
         getLogger()->error("Failed to bind for socker on {}. errno: {}", localPort, errno);
         exit(EXIT_FAILURE);
     }
 
-    if (listen(localSocket, SOMAXCONN) < 0) {
+    if (listen(listeningSocket, SOMAXCONN) < 0) {
         getLogger()->error("Failed to listen on {}. errno: {}", localPort, errno);
         exit(EXIT_FAILURE);
     }
+    return listeningSocket;
+}
 
-    getLogger()->info("Waiting for connections on: {}", localPort);
+void NetworkCom::startListening() {
+    createListeningSocket(0);
+    int unixListeningSocket = openUnixListeningSocket(0);
+    if(unixListeningSocket >= 0)
+        unixListenerThread = std::make_unique<std::thread>([this, unixListeningSocket](){
+            setupThread("p2p-listen-unix", config.ioCpus);
+            acceptLoop(unixListeningSocket);
+        });
     uiCallbacks->bindSucceeded();
-    isListeningLocally = true;
+    acceptLoop(localSocket);
+}
 
+void NetworkCom::acceptLoop(int listeningSocket) {
     while(true) {
-        struct sockaddr_in client_addr{};
-        socklen_t client_addr_len = sizeof(client_addr);
-        int client_sockfd = accept(localSocket, (struct sockaddr *) &client_addr, &client_addr_len);
+        int client_sockfd = accept(listeningSocket, nullptr, nullptr);
         if (client_sockfd < 0) {
+            if(errno == EINVAL) //listening socket was shut down by stopListening()
+                break;
             getLogger()->error("accept() failed on {}. errno: {}", localPort, errno);
             break;
         }
         getLogger()->info("Received a new connection. Waiting for AUTH message.");
-        new std::thread([this, client_sockfd](){ this->handleConnections(client_sockfd);});
+        watchConnection(client_sockfd, true);
+        attachConnection(client_sockfd);
+    }
+}
+
+void NetworkCom::attachConnection(int clientSocket) {
+    {
+        std::lock_guard<std::mutex> lock(handlerSocketsMutex);
+        handlerSockets.insert(clientSocket);
     }
+    //Every connection gets a writer too, so that sendMessage() only has to queue
+    auto outbox = std::make_shared<PeerOutbox>();
+    {
+        std::lock_guard<std::mutex> lock(outboxesMutex);
+        outboxes[clientSocket] = outbox;
+    }
+    outbox->writer = std::thread([this, clientSocket, outbox](){
+        setupThread("p2p-send-" + std::to_string(clientSocket), config.ioCpus);
+        drainOutbox(clientSocket, outbox);
+    });
+    std::thread([this, clientSocket](){
+        setupThread("p2p-recv-" + std::to_string(clientSocket), config.ioCpus);
+        this->handleConnections(clientSocket);
+    }).detach();
 }
 
-std::tuple< std::unique_ptr<std::vector<uint8_t>>, int> NetworkCom::serializeMessage(const Message &message) {
-    std::unique_ptr<messages::MessageHeader> headerProto(new messages::MessageHeader);
-    std::unique_ptr<std::vector<uint8_t>> bodyBuffer(new std::vector<uint8_t>());
+void NetworkCom::drainOutbox(int clientSocket, const std::shared_ptr<PeerOutbox> &outbox) {
+    auto writeMutex = linkWriteMutex(clientSocket);
+    while(true) {
+        OutboundFrame frame;
+        {
+            std::unique_lock<std::mutex> lock(outbox->mutex);
+            outbox->ready.wait(lock, [&outbox](){ return !outbox->frames.empty() || outbox->closed; });
+            if(outbox->closed)
+                break;
+            frame = std::move(outbox->frames.front());
+            outbox->frames.pop();
+        }
 
-    int bodySize = 0;
-    switch (message.header.type) {
-        case MessageType::AUTH: {
-            headerProto->set_type(messages::MessageType::AUTH);
-            auto authMsg = dynamic_cast<const AuthMessage*>(&message);
-            std::unique_ptr<messages::AuthMessage> authMsgProto(new messages::AuthMessage());
-            authMsgProto->set_name(authMsg->name);
-
-            bodySize = authMsgProto->ByteSizeLong();
-            bodyBuffer->reserve(bodySize);
-            authMsgProto->SerializeToArray(bodyBuffer->data(), bodySize);
+        bool sent;
+        {
+            std::lock_guard<std::mutex> lock(*writeMutex);
+            sent = writeFully(clientSocket, frame);
+        }
+        frame.complete(sent);
+        if(!sent) {
+            //Let the reader notice, it owns the rest of the teardown
+            shutdown(clientSocket, SHUT_RDWR);
             break;
         }
+    }
+
+    StreamQueue dropped;
+    {
+        std::lock_guard<std::mutex> lock(outbox->mutex);
+        outbox->closed = true;
+        std::swap(dropped, outbox->frames);
+    }
+    dropped.fail();
+}
+
+void NetworkCom::closeOutbox(int clientSocket) {
+    std::shared_ptr<PeerOutbox> outbox;
+    {
+        std::lock_guard<std::mutex> lock(outboxesMutex);
+        auto it = outboxes.find(clientSocket);
+        if(it == outboxes.end())
+            return;
+        outbox = it->second;
+        outboxes.erase(it);
+    }
+    {
+        std::lock_guard<std::mutex> lock(outbox->mutex);
+        outbox->closed = true;
+    }
+    outbox->ready.notify_all();
+    //A writer stuck on a peer that stopped reading is released by the shutdown
+    shutdown(clientSocket, SHUT_RDWR);
+    outbox->writer.join();
+}
+
+void NetworkCom::connectionClosed(int clientSocket) {
+    closeSharedRing(clientSocket);
+    auto peerName = getSocketName(clientSocket);
+    getLogger()->warn("Network connection to {} ended.", peerName);
+    removeSocket(clientSocket);
+    if(auto peer = peers.find(clientSocket)) {
+        TimerWheel::cancel(peer->link.watchdog);
+        dropHeldFrames(peer);
+    }
+    //Queued messages of this peer are still delivered before the disconnection
+    deliverToPeer(clientSocket, [this, clientSocket, peerName](){
+        closeIncomingFiles(clientSocket);
+        uiCallbacks->peerDisconnected(peerName);
+    }, true);
+}
+
+void NetworkCom::deliverToPeer(int clientSocket, DispatchPool::Task task, bool lastTask) {
+    std::shared_ptr<Strand> strand;
+    auto peer = peers.context(clientSocket);
+    {
+        std::lock_guard<std::mutex> lock(peer->mutex);
+        if(dispatchPool != nullptr && peer->link.strand == nullptr)
+            peer->link.strand = dispatchPool->makeStrand(config.peerQueueDepth);
+        strand = peer->link.strand;
+    }
+    //The socket number can be reused by the next connection, which must start from a fresh link
+    if(lastTask)
+        peers.remove(clientSocket);
+    if(strand == nullptr) {
+        task();
+        return;
+    }
+    strand->post(std::move(task));
+}
+
+FrameHeader NetworkCom::nextFrameHeader(int clientSocket, MessageType type, size_t bodyLength) {
+    FrameHeader header;
+    header.type = type;
+    header.stream = streamOf(type);
+    header.bodyLength = static_cast<uint32_t>(bodyLength);
+    auto peer = peers.context(clientSocket);
+    std::lock_guard<std::mutex> lock(peer->mutex);
+    auto &link = peer->link;
+    header.sequence = link.sendSequence[header.stream]++;
+    header.legacy = config.legacyFraming || link.legacyFraming;
+    return header;
+}
+
+uint32_t NetworkCom::peerWireVersion(int clientSocket) {
+    auto peer = peers.find(clientSocket);
+    if(peer == nullptr)
+        return 1;
+    std::lock_guard<std::mutex> lock(peer->mutex);
+    return peer->link.wireVersion;
+}
+
+void NetworkCom::setPeerWireVersion(int clientSocket, uint32_t announcedVersion) {
+    auto peer = peers.context(clientSocket);
+    std::lock_guard<std::mutex> lock(peer->mutex);
+    peer->link.wireVersion = std::clamp<uint32_t>(announcedVersion, 1, WIRE_VERSION);
+}
+
+uint32_t NetworkCom::peerCompression(int clientSocket) {
+    auto peer = peers.find(clientSocket);
+    if(peer == nullptr || config.legacyFraming)
+        return 0;
+    std::lock_guard<std::mutex> lock(peer->mutex);
+    //The legacy header has no flags to mark a compressed body with
+    return peer->link.legacyFraming ? 0 : peer->link.compression;
+}
+
+void NetworkCom::setPeerCompression(int clientSocket, uint32_t announcedCodecs) {
+    auto peer = peers.context(clientSocket);
+    std::lock_guard<std::mutex> lock(peer->mutex);
+    peer->link.compression = announcedCodecs;
+}
+
+/*
+ Hands a received frame on to dispatchMessage(), or keeps it while the rest of its message is
+ still coming in fragments. False when the fragments add up to more than a frame may carry.
+ */
+bool NetworkCom::receiveFrame(int clientSocket, FrameHeader header, const uint8_t *body, const PooledBuffer &owner) {
+    PooledBuffer partial;
+    auto peer = peers.context(clientSocket);
+    {
+        std::lock_guard<std::mutex> lock(peer->mutex);
+        auto &link = peer->link;
+        link.lastReceived = std::chrono::steady_clock::now();
+        link.frameStarted = std::chrono::steady_clock::time_point();
+        if(header.legacy) {
+            if(!link.legacyFraming)
+                getLogger()->info("Socket {} uses the legacy message header, answering in kind.", clientSocket);
+            link.legacyFraming = true;
+        } else {
+            uint32_t &expected = link.receiveSequence[header.stream];
+            if(header.sequence != expected)
+                getLogger()->debug("Socket {} skipped from sequence {} to {} on stream {}", clientSocket, expected,
+                                   header.sequence, header.stream);
+            expected = header.sequence + 1;
+        }
+        partial = std::move(link.partialBodies[header.stream]);
+    }
+    //Control frames are not paid for with credit, so they are not given back either. By type: the legacy header has no stream
+    size_t frameBytes = streamOf(header.type) == static_cast<uint16_t>(FrameStream::CONTROL) ? 0 : header.frameLength();
+    if(!partial && !(header.flags & FRAME_FLAG_MORE)) {
+        dispatchMessage(clientSocket, body, header, owner, frameBytes);
+        return true;
+    }
+
+    size_t collected = partial ? partial.size() : 0;
+    if(collected + header.bodyLength > MAX_FRAME_BODY_LEN) {
+        getLogger()->error("Fragmented message on socket {} is bigger than {} bytes", clientSocket, MAX_FRAME_BODY_LEN);
+        return false;
+    }
+    if(!partial || collected + header.bodyLength > partial.capacity()) {
+        //Doubling keeps the copies of a long message linear in its size
+        PooledBuffer bigger = BufferPool::instance().acquire(std::max<size_t>(collected + header.bodyLength, 2 * collected));
+        if(collected > 0)
+            std::copy_n(partial.data(), collected, bigger.data());
+        partial = std::move(bigger);
+    }
+    std::copy_n(body, header.bodyLength, partial.data() + collected);
+    partial.resize(collected + header.bodyLength);
+
+    if(header.flags & FRAME_FLAG_MORE) {
+        {
+            std::lock_guard<std::mutex> lock(peer->mutex);
+            peer->link.partialBodies[header.stream] = std::move(partial);
+        }
+        frameConsumed(clientSocket, frameBytes);
+        return true;
+    }
+    header.flags &= ~FRAME_FLAG_MORE;
+    header.bodyLength = static_cast<uint32_t>(partial.size());
+    dispatchMessage(clientSocket, partial.data(), header, partial, frameBytes);
+    return true;
+}
+
+/*
+ owner is the pooled buffer messageBuff lives in, if any; otherwise the body is copied into one.
+ consumedBytes go back to the peer's credit once the message was handled.
+ */
+void NetworkCom::dispatchMessage(int clientSocket, const uint8_t *messageBuff, const FrameHeader &header,
+                                 const PooledBuffer &owner, size_t consumedBytes) {
+    std::string socketName = getSocketName(clientSocket);
+    //AUTH registers the peer name and the wire version, which later frames and sendMessage() rely on,
+    //so it is never deferred; neither is CREDIT, which must not wait behind the messages it unblocks
+    if(dispatchPool == nullptr || header.type == MessageType::AUTH || header.type == MessageType::AUTH_ACK ||
+       header.type == MessageType::CREDIT) {
+        deserializeHandleMessage(clientSocket, socketName, messageBuff, header);
+        frameConsumed(clientSocket, consumedBytes);
+        return;
+    }
+
+    //The buffer goes back to the pool when the task, and so the UiCallbacks call, is done
+    PooledBuffer body = owner;
+    if(!body) {
+        body = BufferPool::instance().acquire(header.bodyLength);
+        std::copy_n(messageBuff, header.bodyLength, body.data());
+    }
+    deliverToPeer(clientSocket, [this, clientSocket, socketName, body, header, consumedBytes](){
+        deserializeHandleMessage(clientSocket, socketName, body.data(), header);
+        frameConsumed(clientSocket, consumedBytes);
+    });
+}
+
+bool NetworkCom::serializeMessage(int clientSocket, const Message &message, OutboundFrame &frame) {
+    EncodedBody body;
+    if(message.header.type == MessageType::AUTH || message.header.type == MessageType::AUTH_ACK) {
+        ProtoArenaScope arenaScope;
+        auto authMsgProto = google::protobuf::Arena::CreateMessage<messages::AuthMessage>(arenaScope.arena());
+        if(message.header.type == MessageType::AUTH) {
+            authMsgProto->set_name(dynamic_cast<const AuthMessage&>(message).name);
+            authMsgProto->set_wire_version(WIRE_VERSION);
+        } else {
+            authMsgProto->set_wire_version(peerWireVersion(clientSocket));
+        }
+        authMsgProto->set_receive_window(config.receiveWindow);
+        authMsgProto->set_compression(config.compression ? COMPRESSION_ZLIB : 0);
+        authMsgProto->set_descriptors(receivesDescriptors() && isUnixSocket(clientSocket));
+        auto content = std::make_shared<std::vector<uint8_t>>(authMsgProto->ByteSizeLong());
+        authMsgProto->SerializeWithCachedSizesToArray(content->data());
+        body.content.payload = content->data();
+        body.content.payloadLength = content->size();
+        body.content.storage = std::move(content);
+    } else if(!encodeBody(config, message, bodyVariant(clientSocket), body)) {
+        return false;
+    }
+    return frameBody(clientSocket, message.header.type, body, nullptr, frame);
+}
+
+bool encodeBody(const NetConfig &config, const Message &message, int variant, EncodedBody &body) {
+    //The bulky field of TEXT and IMAGE is not copied into a protobuf buffer: we only encode its key
+    //and length behind the frame header and the field itself is sent from the message
+    OutboundFrame &content = body.content;
+    switch (message.header.type) {
         case MessageType::TEXT: {
-            headerProto->set_type(messages::MessageType::TEXT);
             auto textMsg = dynamic_cast<const TextMessage*>(&message);
-            std::unique_ptr<messages::TextMessage> textMsgProto(new messages::TextMessage());
-            textMsgProto->set_text(textMsg->text);
-
-            bodySize = textMsgProto->ByteSizeLong();
-            bodyBuffer->reserve(bodySize);
-            textMsgProto->SerializeToArray(bodyBuffer->data(), bodySize);
+            body.prefixLength = encodeFieldKey(messages::TextMessage::kTextFieldNumber, textMsg->text.size(), body.prefix);
+            content.payload = reinterpret_cast<const uint8_t*>(textMsg->text.data());
+            content.payloadLength = textMsg->text.size();
             break;
         }
         case MessageType::IMAGE: {
-            headerProto->set_type(messages::MessageType::IMAGE);
             auto imgMsg = dynamic_cast<const ImageMessage*>(&message);
-            std::unique_ptr<messages::ImageMessage> imgMsgProto(new messages::ImageMessage());
-            *imgMsgProto->mutable_image() = {imgMsg->image->begin(), imgMsg->image->end()};
-
-            bodySize = imgMsgProto->ByteSizeLong();
-            bodyBuffer->reserve(bodySize);
-            imgMsgProto->SerializeToArray(bodyBuffer->data(), bodySize);
+            if(variant & BODY_IMAGE_BYTES) {
+                body.prefixLength = encodeFieldKey(messages::ImageMessage::kDataFieldNumber, imgMsg->image->size(),
+                                                   body.prefix);
+                content.payload = imgMsg->image->data();
+                content.payloadLength = imgMsg->image->size();
+                content.storage = imgMsg->image;
+                break;
+            }
+            ProtoArenaScope arenaScope;
+            auto imgMsgProto = google::protobuf::Arena::CreateMessage<messages::ImageMessage>(arenaScope.arena());
+            imgMsgProto->mutable_image()->Add(imgMsg->image->begin(), imgMsg->image->end());
+            auto proto = std::make_shared<std::vector<uint8_t>>(imgMsgProto->ByteSizeLong());
+            imgMsgProto->SerializeWithCachedSizesToArray(proto->data());
+            content.payload = proto->data();
+            content.payloadLength = proto->size();
+            content.storage = std::move(proto);
             break;
         }
         default:
             //TODO: exception
-            return {nullptr, 0};
+            return false;
     }
 
-    int headerSize = MSG_HEADER_LEN;
-    int bufferLen = headerSize + bodySize;
-    headerProto->set_length(MSG_HEADER_PADD + bufferLen );
+    if((variant & BODY_ZLIB) && compressPayload(config, body.prefix, body.prefixLength, content))
+        body.flags |= FRAME_FLAG_COMPRESSED;
+    return true;
+}
 
-    std::unique_ptr<std::vector<uint8_t>> messageBuffer(new std::vector<uint8_t>(bufferLen));
-    headerProto->SerializeToArray(messageBuffer->data(), headerSize);
-    getLogger()->info("Serializing message with body size: {}", bodySize);
+bool compressPayload(const NetConfig &config, const uint8_t *prefix, size_t &prefixLength, OutboundFrame &frame) {
+    if(!config.compression || prefixLength + frame.payloadLength < std::max<size_t>(config.compressionMinSize, 1))
+        return false;
+    if(!looksCompressible(frame.payload, frame.payloadLength))
+        return false;
+    PooledBuffer body = compressBody(prefix, prefixLength, frame.payload, frame.payloadLength, config.compressionLevel);
+    if(!body)
+        return false;
+    frame.payload = body.data();
+    frame.payloadLength = body.size();
+    frame.storage = std::make_shared<PooledBuffer>(std::move(body));
+    prefixLength = 0;
+    return true;
+}
 
-    std::copy(bodyBuffer->data(), bodyBuffer->data()+bodySize, messageBuffer->data()+headerSize);
-    return {std::move(messageBuffer), bufferLen};
+int NetworkCom::bodyVariant(int clientSocket) {
+    return (peerWireVersion(clientSocket) >= 2 ? BODY_IMAGE_BYTES : 0) |
+           ((peerCompression(clientSocket) & COMPRESSION_ZLIB) ? BODY_ZLIB : 0);
 }
 
-MessageHeader NetworkCom::getMessageHeader(std::unique_ptr<uint8_t> headerBuff) {
-    std::unique_ptr<messages::MessageHeader> header(new messages::MessageHeader());
-    header->ParseFromArray(headerBuff.get(), MSG_HEADER_LEN);
-    MessageHeader msgHeader{};
-    switch (header->type()) {
-        case messages::MessageType::AUTH:
-            msgHeader.type = MessageType::AUTH;
-            break;
-        case messages::MessageType::TEXT:
-            msgHeader.type = MessageType::TEXT;
-            break;
-        case messages::MessageType::IMAGE:
-            msgHeader.type = MessageType::IMAGE;
-            break;
+//owner keeps a borrowed payload alive; without one it is copied when the frame is queued
+bool NetworkCom::frameBody(int clientSocket, MessageType type, const EncodedBody &body,
+                           const std::shared_ptr<const void> &owner, OutboundFrame &frame) {
+    frame.payload = body.content.payload;
+    frame.payloadLength = body.content.payloadLength;
+    frame.storage = body.content.storage != nullptr ? body.content.storage : owner;
+    return finishFrame(clientSocket, type, body.prefix, body.prefixLength, frame, body.flags);
+}
+
+bool NetworkCom::finishFrame(int clientSocket, MessageType type, const uint8_t *prefix, size_t prefixLength,
+                             OutboundFrame &frame, uint16_t flags) {
+    size_t bodySize = prefixLength + frame.payloadLength;
+    if(bodySize > MAX_FRAME_BODY_LEN) {
+        getLogger()->error("Message body of {} bytes does not fit in a frame.", bodySize);
+        return false;
     }
-    msgHeader.length = header->length() - MSG_HEADER_PADD;
-    return msgHeader;
+    FrameHeader header = nextFrameHeader(clientSocket, type, bodySize);
+    header.flags = flags;
+    frame.headLength = encodeFrameHeader(header, frame.head);
+    frame.stream = header.stream;
+    std::copy(prefix, prefix + prefixLength, frame.head + frame.headLength);
+    frame.headLength += prefixLength;
+    getLogger()->info("Serializing message with body size: {}", bodySize);
+    return true;
 }
 
 void NetworkCom::deserializeHandleMessage(int clientSocket,
-                                          std::unique_ptr<uint8_t> messageBuff,
-                                          const MessageHeader &header) {
-    ssize_t bufferSize = header.length - MSG_HEADER_LEN;
-    std::string socketName = getSocketName(clientSocket);
+                                          const std::string &peerName,
+                                          const uint8_t *messageBuff,
+                                          const FrameHeader &header) {
+    auto bufferSize = static_cast<int>(header.bodyLength);
+    //Inflated here rather than by the reader, so the dispatch pool does it in parallel for many peers
+    PooledBuffer plainBody;
+    if(header.flags & FRAME_FLAG_COMPRESSED) {
+        plainBody = decompressBody(messageBuff, header.bodyLength);
+        if(!plainBody) {
+            getLogger()->error("Dropping a message with a broken compressed body from {}", peerName);
+            return;
+        }
+        messageBuff = plainBody.data();
+        bufferSize = static_cast<int>(plainBody.size());
+    }
+    ProtoArenaScope arenaScope;
+    std::string socketName = peerName;
     //TODO: do it in a more general way!
     switch (header.type) {
         case MessageType::AUTH: {
-            std::unique_ptr<messages::AuthMessage> authMsgProto(new messages::AuthMessage());
-            authMsgProto->ParseFromArray(messageBuff.get(), bufferSize);
+            auto authMsgProto = google::protobuf::Arena::CreateMessage<messages::AuthMessage>(arenaScope.arena());
+            authMsgProto->ParseFromArray(messageBuff, bufferSize);
             std::unique_ptr<AuthMessage> authMessage(new AuthMessage(authMsgProto->name()));
 
             socketName = authMessage->name;
             addNewSocket(socketName, clientSocket);
-            getLogger()->info("Received AUTH message from {}", socketName);
+            setPeerWireVersion(clientSocket, authMsgProto->wire_version());
+            setPeerWindow(clientSocket, authMsgProto->receive_window());
+            setPeerCompression(clientSocket, authMsgProto->compression());
+            setPeerDescriptors(clientSocket, authMsgProto->descriptors());
+            getLogger()->info("Received AUTH message from {} with wire version {}", socketName,
+                              authMsgProto->wire_version());
+            //Peers that do not announce a version would not understand the answer
+            if(authMsgProto->wire_version() >= 2)
+                sendToSocket(clientSocket, Message(MessageType::AUTH_ACK));
+            if(authMsgProto->wire_version() >= 8)
+                offerSharedRing(clientSocket);
+            resumeImages(clientSocket, socketName);
             uiCallbacks->newAuthMessage(socketName, std::move(authMessage));
             break;
         }
+        case MessageType::AUTH_ACK: {
+            auto ackProto = google::protobuf::Arena::CreateMessage<messages::AuthMessage>(arenaScope.arena());
+            ackProto->ParseFromArray(messageBuff, bufferSize);
+            setPeerWireVersion(clientSocket, ackProto->wire_version());
+            setPeerWindow(clientSocket, ackProto->receive_window());
+            setPeerCompression(clientSocket, ackProto->compression());
+            setPeerDescriptors(clientSocket, ackProto->descriptors());
+            getLogger()->info("{} talks wire version {}", socketName, peerWireVersion(clientSocket));
+            resumeImages(clientSocket, socketName);
+            break;
+        }
         case MessageType::TEXT: {
-            std::unique_ptr<messages::TextMessage> textMsgProto(new messages::TextMessage());
-            textMsgProto->ParseFromArray(messageBuff.get(), bufferSize);
-            std::unique_ptr<TextMessage> textMessage(new TextMessage(textMsgProto->text()));
+            auto textMsgProto = google::protobuf::Arena::CreateMessage<messages::TextMessage>(arenaScope.arena());
+            textMsgProto->ParseFromArray(messageBuff, bufferSize);
+            //The parsed text is not needed anymore, take it instead of copying
+            std::unique_ptr<TextMessage> textMessage(new TextMessage());
+            textMessage->header.type = MessageType::TEXT;
+            textMessage->text.swap(*textMsgProto->mutable_text());
 
             getLogger()->info("Received TEXT message from {}", socketName);
             uiCallbacks->newTextMessage(socketName, std::move(textMessage));
             break;
         }
         case MessageType::IMAGE: {
-            std::unique_ptr<messages::ImageMessage> imgMsgProto(new messages::ImageMessage());
-            imgMsgProto->ParseFromArray(messageBuff.get(), bufferSize);
-            std::unique_ptr<ImageMessage> imageMessage(new ImageMessage(imgMsgProto->image()));
+            auto imgMsgProto = google::protobuf::Arena::CreateMessage<messages::ImageMessage>(arenaScope.arena());
+            imgMsgProto->ParseFromArray(messageBuff, bufferSize);
+            std::unique_ptr<ImageMessage> imageMessage;
+            if(imgMsgProto->attached() > 0) {
+                auto image = attachedImage(clientSocket, socketName, imgMsgProto->attached());
+                if(image == nullptr)
+                    break;
+                imageMessage.reset(new ImageMessage(image));
+            } else if(!imgMsgProto->data().empty())
+                imageMessage.reset(new ImageMessage(std::make_shared<std::vector<uint8_t>>(
+                        imgMsgProto->data().begin(), imgMsgProto->data().end())));
+            else
+                imageMessage.reset(new ImageMessage(imgMsgProto->image()));
 
             getLogger()->info("Received IMAGE message from {}", socketName);
             uiCallbacks->newImageMessage(socketName, std::move(imageMessage));
             break;
         }
+        case MessageType::FILE:
+            fileOffered(clientSocket, socketName, messageBuff, bufferSize);
+            break;
+        case MessageType::FILE_CHUNK:
+            fileChunkReceived(clientSocket, socketName, messageBuff, bufferSize);
+            break;
+        case MessageType::CREDIT: {
+            auto creditProto = google::protobuf::Arena::CreateMessage<messages::Credit>(arenaScope.arena());
+            creditProto->ParseFromArray(messageBuff, bufferSize);
+            creditGranted(clientSocket, creditProto->bytes());
+            break;
+        }
+        case MessageType::IMAGE_CHUNK:
+            imageChunkReceived(clientSocket, socketName, messageBuff, bufferSize);
+            break;
+        case MessageType::IMAGE_RESUME:
+            imageResumeReceived(clientSocket, socketName, messageBuff, bufferSize);
+            break;
+        case MessageType::PING:  //receiveFrame() already noted that the peer is alive
+            break;
+        case MessageType::RING_OFFER:
+            sharedRingOffered(clientSocket, messageBuff, bufferSize);
+            break;
+        case MessageType::RING_SWITCH:
+            sharedRingSwitched(clientSocket, messageBuff, bufferSize);
+            break;
+    }
+}
+
+size_t NetworkCom::consumeFrames(int clientSocket, const uint8_t *data, size_t len, bool &valid) {
+    size_t offset = 0;
+    valid = true;
+    //Frames handled right here (AUTH, or all of them without a pool) share one arena reset
+    ProtoArenaScope arenaScope;
+    while(offset < len) {
+        FrameHeader header;
+        FrameStatus status = decodeFrameHeader(data + offset, len - offset, header);
+        if(status == FrameStatus::INVALID) {
+            getLogger()->error("Invalid message header on socket {}", clientSocket);
+            valid = false;
+            break;
+        }
+        if(status == FrameStatus::NEED_MORE || len - offset < header.frameLength())
+            break;
+
+        getLogger()->info("Received a message with body size: {}", header.bodyLength);
+        if(!receiveFrame(clientSocket, header, data + offset + header.headerLength(), PooledBuffer())) {
+            valid = false;
+            break;
+        }
+        offset += header.frameLength();
     }
+    //The rest is the start of a frame that has to arrive within the read timeout
+    if(valid && offset < len)
+        frameStarting(clientSocket);
+    return offset;
 }
 
 void NetworkCom::handleConnections(int clientSocket) {
-    bool waitAndReceive = true;
-    while(waitAndReceive) {
-        size_t headerSize = MSG_HEADER_LEN;
-        std::unique_ptr<uint8_t> headerBuff(new uint8_t[headerSize]);
-        ssize_t bytesReceived = recv(clientSocket, headerBuff.get(), headerSize, 0);
+    uint8_t headerBuff[FRAME_HEADER_LEN];
+    while(true) {
+        //A header can be split between two segments, do not parse half of it.
+        //The legacy header is shorter, so read its size first and the rest once we know the format
+        ssize_t bytesReceived = receiveFully(clientSocket, headerBuff, MSG_HEADER_LEN);
         if(bytesReceived == 0)
             break;
-        if(bytesReceived <= 0) {
+        size_t headerSize = frameHeaderLength(headerBuff[0]);
+        if(bytesReceived == MSG_HEADER_LEN && headerSize > MSG_HEADER_LEN)
+            bytesReceived += receiveFully(clientSocket, headerBuff + MSG_HEADER_LEN, headerSize - MSG_HEADER_LEN);
+        if(bytesReceived < static_cast<ssize_t>(headerSize)) {
             getLogger()->error("Error in receiving message header. errno: {}", errno);
             break;
         }
 
-        MessageHeader msgHeader = getMessageHeader(std::move(headerBuff));
-        size_t msgBodySize = msgHeader.length - headerSize;
+        FrameHeader header;
+        if(decodeFrameHeader(headerBuff, headerSize, header) != FrameStatus::COMPLETE) {
+            getLogger()->error("Invalid message header on socket {}", clientSocket);
+            break;
+        }
+        size_t msgBodySize = header.bodyLength;
         getLogger()->info("Received a message with body size: {}", msgBodySize);
-        std::unique_ptr<uint8_t> messageBuffer(new uint8_t[msgBodySize]);
+        if(msgBodySize > 0)
+            frameStarting(clientSocket);
+        PooledBuffer messageBuffer = BufferPool::instance().acquire(msgBodySize);
         size_t totalBytesReceived = 0;
 
+        bool bodyReceived = true;
         while (totalBytesReceived < msgBodySize) {
-            bytesReceived = recv(clientSocket, messageBuffer.get() + totalBytesReceived,
-                                 msgBodySize - totalBytesReceived, 0);
+            bytesReceived = receiveFromSocket(clientSocket, messageBuffer.data() + totalBytesReceived,
+                                              msgBodySize - totalBytesReceived, 0);
             if (bytesReceived <= 0) {
                 getLogger()->error("Error getting message body! errno: {}", errno);
-                waitAndReceive = false;
+                bodyReceived = false;
                 break;
             }
             totalBytesReceived += bytesReceived;
         }
 
-        deserializeHandleMessage(clientSocket, std::move(messageBuffer), msgHeader);
+        if(!bodyReceived)
+            break;
+        if(!receiveFrame(clientSocket, header, messageBuffer.data(), messageBuffer))
+            break;
     }
 
-    auto peerName = getSocketName(clientSocket);
-    getLogger()->warn("Network connection to {} ended.", peerName);
-    removeSocket(peerName);
-    uiCallbacks->peerDisconnected(peerName);
+    closeOutbox(clientSocket);
+    connectionClosed(clientSocket);
+    close(clientSocket);
+
+    std::lock_guard<std::mutex> lock(handlerSocketsMutex);
+    handlerSockets.erase(clientSocket);
+    handlerSocketsEmpty.notify_all();
 }
 
 void NetworkCom::sendMessage(const std::string & peerName, const Message& message) {
+    sendMessage(peerName, message, nullptr);
+}
+
+void NetworkCom::sendMessage(const std::string &peerName, const Message &message, SendCompletion completion) {
     int clientSocket = getClientSocket(peerName);
     if(clientSocket<0){
         getLogger()->warn("Invalid peer with name: {}", peerName);
+        if(completion != nullptr)
+            completion(false);
         return;
     }
 
-    auto [messageBytes, len] = serializeMessage(message);
-    getLogger()->info("Sending {} bytes of data to peer: {}", len, peerName);
-    send(clientSocket, messageBytes->data(), len, 0);
+    if(message.header.type == MessageType::FILE) {
+        queueFile(peerName, dynamic_cast<const FileMessage&>(message), std::move(completion));
+        return;
+    }
+    //Over AF_UNIX the peer maps the image from a memfd, neither chunks nor the socket carry it
+    if(message.header.type == MessageType::IMAGE) {
+        auto &image = dynamic_cast<const ImageMessage&>(message);
+        if(passesDescriptor(clientSocket, image.image->size()) && sendAttachedImage(clientSocket, image, completion))
+            return;
+    }
+    if(message.header.type == MessageType::IMAGE && config.imageChunkSize > 0 && peerWireVersion(clientSocket) >= 6) {
+        auto &image = dynamic_cast<const ImageMessage&>(message);
+        if(image.image->size() > config.imageChunkSize) {
+            sendImage(clientSocket, peerName, image, std::move(completion));
+            return;
+        }
+    }
+    getLogger()->info("Sending message to peer: {}", peerName);
+    sendToSocket(clientSocket, message, std::move(completion));
 }
 
-bool NetworkCom::connectPeer(const Peer& peer) {
-    struct hostent* host = gethostbyname(peer.IPv4.c_str());
-    sockaddr_in sockAddr{};
-    std::memset(&sockAddr, 0, sizeof(sockAddr));
-    sockAddr.sin_family = AF_INET;
-    sockAddr.sin_addr.s_addr = inet_addr(inet_ntoa(*(struct in_addr*)*host->h_addr_list));
-    sockAddr.sin_port = htons(peer.port);
-
-    int clientSocket = socket(AF_INET, SOCK_STREAM, 0);
-    int status = connect(clientSocket, (sockaddr*) &sockAddr, sizeof(sockAddr));
-    if(status < 0){
-        getLogger()->warn("Cannot connect to {} on port {}", peer.IPv4, peer.port);
-        return false;
+void NetworkCom::sendToSocket(int clientSocket, const Message &message, SendCompletion completion) {
+    //Concurrent senders must not mix the fragments of their messages, nor queue them out of sequence
+    auto peer = peers.context(clientSocket);
+    std::lock_guard<std::recursive_mutex> lock(peer->sendMutex);
+    OutboundFrame frame;
+    frame.completion = std::move(completion);
+    if(!serializeMessage(clientSocket, message, frame)) {
+        frame.complete(false);
+        return;
+    }
+    getLogger()->info("Sending {} bytes of data to socket: {}", frame.size(), clientSocket);
+    writeFragments(clientSocket, frame);
+}
+
+//Cuts a frame with a big body into FRAGMENT_LEN fragments for peers that can put them back together
+void NetworkCom::writeFragments(int clientSocket, OutboundFrame &frame) {
+    FrameHeader header;
+    decodeFrameHeader(frame.head, frame.headLength, header);
+    if(header.legacy || header.bodyLength <= FRAGMENT_LEN || peerWireVersion(clientSocket) < 4) {
+        sendFrame(clientSocket, frame);
+        return;
+    }
+
+    //Fragments share the payload, which has to outlive all of them
+    frame.own();
+    size_t headerLength = header.headerLength();
+    const uint8_t *prefix = frame.head + headerLength;
+    size_t prefixLength = frame.headLength - headerLength;
+    size_t bodyLength = header.bodyLength;
+    for(size_t offset = 0; offset < bodyLength; ) {
+        size_t len = std::min<size_t>(FRAGMENT_LEN, bodyLength - offset);
+        //The first fragment keeps the sequence number the frame already got
+        FrameHeader fragmentHeader = offset == 0 ? header : nextFrameHeader(clientSocket, header.type, 0);
+        fragmentHeader.flags = header.flags;
+        fragmentHeader.bodyLength = static_cast<uint32_t>(len);
+        if(offset + len < bodyLength)
+            fragmentHeader.flags |= FRAME_FLAG_MORE;
+
+        OutboundFrame fragment;
+        fragment.headLength = encodeFrameHeader(fragmentHeader, fragment.head);
+        fragment.stream = fragmentHeader.stream;
+        size_t prefixPart = offset < prefixLength ? std::min(prefixLength - offset, len) : 0;
+        std::copy_n(prefix + offset, prefixPart, fragment.head + fragment.headLength);
+        fragment.headLength += prefixPart;
+        fragment.payload = frame.payload + (offset + prefixPart - prefixLength);
+        fragment.payloadLength = len - prefixPart;
+        fragment.storage = frame.storage;
+        offset += len;
+        if(offset == bodyLength)
+            fragment.completion = std::move(frame.completion);
+        sendFrame(clientSocket, fragment);
+    }
+}
+
+std::shared_ptr<std::mutex> NetworkCom::linkWriteMutex(int clientSocket) {
+    auto peer = peers.context(clientSocket);
+    std::lock_guard<std::mutex> lock(peer->mutex);
+    auto &link = peer->link;
+    if(link.writeMutex == nullptr)
+        link.writeMutex = std::make_shared<std::mutex>();
+    return link.writeMutex;
+}
+
+void NetworkCom::writeMessage(int clientSocket, OutboundFrame &frame) {
+    std::shared_ptr<PeerOutbox> outbox;
+    {
+        std::lock_guard<std::mutex> lock(outboxesMutex);
+        auto it = outboxes.find(clientSocket);
+        if(it != outboxes.end())
+            outbox = it->second;
+    }
+    if(outbox == nullptr) {
+        getLogger()->warn("Socket {} has no writer.", clientSocket);
+        frame.complete(false);
+        return;
     }
 
-    getLogger()->info("Successfully connected to peer {} on {}:{}", peer.name, peer.IPv4, peer.port);
-    addNewSocket(peer.name, clientSocket);
+    //The writer sends it after we returned, a payload borrowed from the caller is copied
+    frame.own();
+    {
+        std::lock_guard<std::mutex> lock(outbox->mutex);
+        if(!outbox->closed) {
+            outbox->frames.push(std::move(frame));
+            outbox->ready.notify_one();
+            return;
+        }
+    }
+    frame.complete(false);
+}
 
-    //Waiting for messages from connected peer
-    new std::thread([this, clientSocket](){ this->handleConnections(clientSocket);});
+bool NetworkCom::writeFully(int clientSocket, const OutboundFrame &frame) {
+    size_t written = 0;
+    while(written < frame.size()) {
+        iovec iov[2];
+        msghdr msg{};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = frame.iovecs(written, iov);
+        alignas(cmsghdr) uint8_t control[DESCRIPTOR_CONTROL_LEN];
+        if(written == 0 && frame.descriptor != nullptr)
+            attachDescriptor(msg, frame.descriptor->fd, control);
+        ssize_t sent = sendmsg(clientSocket, &msg, MSG_NOSIGNAL);
+        if(sent < 0) {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                //Only with a send timeout on this blocking socket, wait until the kernel takes more
+                pollfd pfd{clientSocket, POLLOUT, 0};
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            getLogger()->error("Error in sending to socket {}. errno: {}", clientSocket, errno);
+            return false;
+        }
+        written += sent;
+    }
     return true;
 }
 
+bool NetworkCom::connectPeer(const Peer& peer) {
+    std::promise<bool> connected;
+    auto result = connected.get_future();
+    connectPeer(peer, [&connected](bool success){ connected.set_value(success); });
+    return result.get();
+}
+
+void NetworkCom::connectPeer(const Peer &peer, ConnectCompletion completion) {
+    std::string address = peer.unixPath.empty() ? peer.IPv4 + ":" + std::to_string(peer.port) : peer.unixPath;
+    ConnectDone done = [this, peer, address, completion](int clientSocket){
+        if(clientSocket < 0) {
+            getLogger()->warn("Cannot connect to {}", address);
+            if(completion != nullptr)
+                completion(false);
+            return;
+        }
+
+        getLogger()->info("Successfully connected to peer {} on {}", peer.name, address);
+        addNewSocket(peer.name, clientSocket);
+        watchConnection(clientSocket, false);
+
+        //Waiting for messages from connected peer
+        attachConnection(clientSocket);
+        if(completion != nullptr)
+            completion(true);
+    };
+    if(peer.unixPath.empty())
+        connector.connect(peer.IPv4, peer.port, std::move(done));
+    else
+        connector.connectLocal(peer.unixPath, std::move(done));
+}
+
+void NetworkCom::connectPeers(const std::vector<Peer> &peers, const AuthMessage &auth, PeerConnectCompletion completion) {
+    auto bulk = std::make_shared<BulkConnect>();
+    bulk->peers = peers;
+    bulk->auth = auth;
+    bulk->completion = std::move(completion);
+    connectNextPeers(bulk);
+}
+
+/*
+ Starts connections until connectConcurrency of them are pending, and every completion starts the next.
+ A completion can run inside connectPeer() (after stopListening()), so only one thread at a time starts
+ connections and the others just leave it a free slot, instead of recursing once per peer.
+ */
+void NetworkCom::connectNextPeers(const std::shared_ptr<BulkConnect> &bulk) {
+    {
+        std::lock_guard<std::mutex> lock(bulk->mutex);
+        if(bulk->launching)
+            return;
+        bulk->launching = true;
+    }
+    size_t concurrency = std::max<size_t>(config.connectConcurrency, 1);
+    while(true) {
+        Peer peer;
+        {
+            std::lock_guard<std::mutex> lock(bulk->mutex);
+            if(bulk->next == bulk->peers.size() || bulk->pending >= concurrency) {
+                bulk->launching = false;
+                return;
+            }
+            peer = bulk->peers[bulk->next++];
+            bulk->pending++;
+        }
+        connectPeer(peer, [this, bulk, peer](bool connected){
+            //Queued right behind the connection, the peer gets it before anything the completion sends
+            if(connected)
+                sendMessage(peer.name, bulk->auth);
+            if(bulk->completion != nullptr)
+                bulk->completion(peer, connected);
+            {
+                std::lock_guard<std::mutex> lock(bulk->mutex);
+                bulk->pending--;
+            }
+            connectNextPeers(bulk);
+        });
+    }
+}
+
 std::unique_ptr<NetOps> createNetworking(int port, UiCallbacks *callbacks) {
-    return std::unique_ptr<NetOps>(reinterpret_cast<NetOps*>(new NetworkCom(port, callbacks)));
+    return createNetworking(port, callbacks, NetConfig{});
+}
+
+std::unique_ptr<NetOps> createNetworking(int port, UiCallbacks *callbacks, const NetConfig &config) {
+    if(!config.loggingCpus.empty())
+        pinLoggingThread(config.loggingCpus);
+    std::unique_ptr<NetworkCom> networking;
+    switch (config.engine) {
+        case NetEngine::IO_URING:
+            if(UringNetworkCom::isSupported()) {
+                networking = std::make_unique<UringNetworkCom>(port, callbacks, config);
+                break;
+            }
+            getLogger()->warn("io_uring is not available, using the epoll engine instead.");
+            [[fallthrough]];
+        case NetEngine::EPOLL:
+            networking = std::make_unique<EpollNetworkCom>(port, callbacks, config);
+            break;
+        case NetEngine::THREADED:
+        default:
+            networking = std::make_unique<NetworkCom>(port, callbacks, config);
+            break;
+    }
+    networking->start();
+    return networking;
 }
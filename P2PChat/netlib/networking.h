@@ -0,0 +1,298 @@
+#ifndef P2PCHAT_NETWORKING_H
+#define P2PCHAT_NETWORKING_H
+
+#include "UiNetlibInterfaces.h"
+#include "dispatch.h"
+#include "framing.h"
+#include "bufferpool.h"
+#include "peerregistry.h"
+#include "timerwheel.h"
+#include "connector.h"
+#include "sharedring.h"
+
+#include <sys/types.h>
+
+#include <array>
+#include <atomic>
+#include <deque>
+#include <random>
+#include <thread>
+#include <shared_mutex>
+#include <map>
+#include <set>
+#include <condition_variable>
+#include <vector>
+#include <unordered_map>
+
+//SO_DOMAIN of the socket is AF_UNIX
+bool isUnixSocket(int socket);
+
+//A received file that is being written while its FILE_CHUNKs arrive
+struct IncomingFile {
+    int fd = -1;
+    std::string name;
+    std::string path;
+    uint64_t size = 0;
+    uint64_t received = 0;
+};
+
+struct OutgoingFile {
+    std::string peerName;
+    std::string path;
+    SendCompletion completion;
+};
+
+//An IMAGE bigger than NetConfig::imageChunkSize, kept until the peer confirmed every chunk
+struct OutgoingImage {
+    std::string peerName;
+    std::shared_ptr<std::vector<uint8_t>> image;
+    size_t chunkSize = 0;
+    int passes = 0;  //times chunks were (re)sent
+    SendCompletion completion;
+};
+
+//The chunks of an IMAGE received so far, kept over a lost connection until the sender resumes
+struct IncomingImage {
+    std::shared_ptr<std::vector<uint8_t>> image;
+    size_t chunkSize = 0;
+    std::vector<bool> received;
+    size_t receivedCount = 0;
+};
+
+#define BODY_IMAGE_BYTES  0x1  //the peer reads images as bytes (wire version 2), not as int32s
+#define BODY_ZLIB         0x2  //the peer inflates zlib bodies
+#define BODY_VARIANTS     4
+
+//A message body without the frame header, which the frames for several peers can share
+struct EncodedBody {
+    uint8_t prefix[BODY_PREFIX_MAX_LEN];
+    size_t prefixLength = 0;
+    OutboundFrame content;  //only payload and storage, a payload without storage is borrowed
+    uint16_t flags = 0;
+};
+
+//TEXT or IMAGE body for peers of the BODY_* variant, compressed when config and variant allow it
+bool encodeBody(const NetConfig &config, const Message &message, int variant, EncodedBody &body);
+//Replaces the payload (and prefix) with their zlib stream, false when that is not worth it
+bool compressPayload(const NetConfig &config, const uint8_t *prefix, size_t &prefixLength, OutboundFrame &frame);
+
+//A SerializedMessage with its body for every variant a peer may need, each encoded once when first sent
+class PreparedMessage : public SerializedMessage, public std::enable_shared_from_this<PreparedMessage> {
+private:
+    NetConfig config;  //of the NetOps that made it
+    std::unique_ptr<Message> message;  //a TextMessage or ImageMessage, bodies borrow from it
+    mutable std::array<EncodedBody, BODY_VARIANTS> bodies;
+    mutable std::array<std::once_flag, BODY_VARIANTS> encoded;
+    mutable std::array<bool, BODY_VARIANTS> valid{};
+
+public:
+    PreparedMessage(const NetConfig &config, std::unique_ptr<Message> message);
+    MessageType type() const override { return message->header.type; }
+    size_t size() const override;
+    const Message &original() const { return *message; }
+    //Null when the message cannot be encoded
+    const EncodedBody *body(int variant) const;
+};
+
+//Frames waiting for the writer thread of a THREADED connection
+struct PeerOutbox {
+    std::mutex mutex;
+    std::condition_variable ready;
+    StreamQueue frames;
+    bool closed = false;
+    std::thread writer;
+};
+
+/*
+ NetworkCom keeps the peer bookkeeping and message (de)serialization that every engine shares.
+ On its own it is the THREADED engine; other engines derive from it and override
+ the protected hooks that accept, attach and write to sockets.
+ */
+class NetworkCom : public NetOps {
+protected:
+    bool isListeningLocally;
+    NetConfig config;
+    int localPort;
+    int localSocket;
+    UiCallbacks *uiCallbacks;
+    std::unique_ptr<std::thread> listenerThread;
+    int unixSocket;  //listening on NetConfig::unixSocketPath, -1 without one
+    std::unique_ptr<std::thread> unixListenerThread;  //only used by the THREADED engine
+    PeerRegistry peers; //socket <-> unique_name, and the link state of every socket
+    std::mutex listeningMutex;
+    std::set<int> handlerSockets; //sockets that still have a connection thread
+    std::mutex handlerSocketsMutex;
+    std::condition_variable handlerSocketsEmpty;
+    std::unique_ptr<DispatchPool> dispatchPool;
+    std::unordered_map<int, std::shared_ptr<PeerOutbox>> outboxes; //only used by the THREADED engine
+    std::mutex outboxesMutex;
+
+    std::thread fileSender;  //streams outgoingFiles one after the other, started by the first FILE
+    bool fileSenderStopped;
+    std::deque<OutgoingFile> outgoingFiles;
+    std::map<std::pair<int, uint32_t>, IncomingFile> incomingFiles; //(socket, transfer id) -> file
+    std::mutex filesMutex;
+    std::condition_variable filesQueued;
+    std::atomic<uint32_t> nextTransferId;
+
+    //(peer name, transfer id) -> image, names because a transfer outlives the socket it started on
+    std::map<std::pair<std::string, uint64_t>, OutgoingImage> outgoingImages;
+    std::map<std::pair<std::string, uint64_t>, IncomingImage> incomingImages;
+    std::mutex imagesMutex;
+    std::mt19937_64 imageTransferIds;  //random, so a restarted peer does not resume a transfer it never saw
+
+    TimerWheel timers;  //connection deadlines and keepalives
+    //A connectPeers() call, shared by the completions of its connections
+    struct BulkConnect {
+        std::mutex mutex;
+        std::vector<Peer> peers;
+        size_t next = 0;
+        size_t pending = 0;     //connections being established
+        bool launching = false;  //a thread is in connectNextPeers(), the others leave it the work
+        AuthMessage auth;
+        PeerConnectCompletion completion;
+    };
+    Connector connector;  //establishes the connections of connectPeer()
+    std::unordered_map<int, std::shared_ptr<RingLink>> ringLinks;  //connections of peers on this host that moved to shared memory
+    std::mutex ringLinksMutex;
+    bool ringLinksStopped = false;
+
+    void addNewSocket(const std::string& peerName, int clientSocket);
+    std::string removeSocket(int clientSocket);
+    int getClientSocket(const std::string& peerName);
+    std::string getSocketName(int clientSocket);
+
+    //template<typename T> std::unique_ptr<T> deserializeMessage(const std::unique_ptr<uint8_t>& buffer, size_t size);
+    FrameHeader nextFrameHeader(int clientSocket, MessageType type, size_t bodyLength);
+    bool receiveFrame(int clientSocket, FrameHeader header, const uint8_t *body, const PooledBuffer &owner);
+    uint32_t peerWireVersion(int clientSocket);
+    void setPeerWireVersion(int clientSocket, uint32_t announcedVersion);
+    //Codecs we may use for the peer: what it announced, nothing while we talk legacy framing to it
+    uint32_t peerCompression(int clientSocket);
+    void setPeerCompression(int clientSocket, uint32_t announcedCodecs);
+    void deserializeHandleMessage(int clientSocket, const std::string &socketName,
+                                  const uint8_t *messageBuff, const FrameHeader &);
+    void dispatchMessage(int clientSocket, const uint8_t *messageBuff, const FrameHeader &,
+                         const PooledBuffer &owner, size_t consumedBytes);
+    void deliverToPeer(int clientSocket, DispatchPool::Task task, bool lastTask = false);
+    bool serializeMessage(int clientSocket, const Message& message, OutboundFrame &frame);
+    int bodyVariant(int clientSocket);
+    bool frameBody(int clientSocket, MessageType type, const EncodedBody &body,
+                   const std::shared_ptr<const void> &owner, OutboundFrame &frame);
+    //Serialized messages and broadcasts, see serialized.cpp
+    std::shared_ptr<const PreparedMessage> prepare(const Message &message);
+    void sendPrepared(const std::string &peerName, int clientSocket,
+                      const std::shared_ptr<const PreparedMessage> &prepared, SendCompletion completion);
+    bool finishFrame(int clientSocket, MessageType type, const uint8_t *prefix, size_t prefixLength,
+                     OutboundFrame &frame, uint16_t flags = 0);
+    size_t consumeFrames(int clientSocket, const uint8_t *data, size_t len, bool &valid);
+
+    void createListeningSocket(int socketFlags);
+    int openListeningSocket(int socketFlags, bool reusePort);
+    void connectionClosed(int clientSocket);
+
+    virtual void startListening();
+    void acceptLoop(int listeningSocket);
+    virtual void attachConnection(int clientSocket);
+    virtual void writeMessage(int clientSocket, OutboundFrame &frame);
+    //Writes frame, whose body ends with len bytes of fileFd starting at offset. False if the socket broke
+    virtual bool writeFileChunk(int clientSocket, OutboundFrame &frame, int fileFd, off_t offset, size_t len);
+    std::shared_ptr<std::mutex> linkWriteMutex(int clientSocket);
+    bool writeFully(int clientSocket, const OutboundFrame &frame);
+    bool sendFileFully(int clientSocket, int fileFd, off_t offset, size_t len);
+    void sendToSocket(int clientSocket, const Message &message, SendCompletion completion = nullptr);
+    void writeFragments(int clientSocket, OutboundFrame &frame);
+
+    //Flow control, see flowcontrol.cpp
+    enum class Watermark { NONE, HIGH, LOW };
+    Watermark checkWatermarks(PeerLink &link);
+    void notifyWatermark(const std::string &peerName, Watermark crossed);
+    void setPeerWindow(int clientSocket, uint64_t window);
+    void sendFrame(int clientSocket, OutboundFrame &frame);
+    bool waitForCredit(int clientSocket, size_t cost);
+    void creditGranted(int clientSocket, uint64_t bytes);
+    void frameConsumed(int clientSocket, size_t bytes);
+    void sendCredit(int clientSocket, uint64_t bytes);
+    void dropHeldFrames(const std::shared_ptr<PeerContext> &peer);
+    void clearPeers();
+    void drainOutbox(int clientSocket, const std::shared_ptr<PeerOutbox> &outbox);
+    void closeOutbox(int clientSocket);
+
+    //File transfers, see filetransfer.cpp
+    void queueFile(const std::string &peerName, const FileMessage &file, SendCompletion completion);
+    void fileSenderLoop();
+    void sendFile(const OutgoingFile &file);
+    bool streamFile(const OutgoingFile &file);
+    void stopFileTransfers();
+    void fileOffered(int clientSocket, const std::string &peerName, const uint8_t *body, size_t len);
+    void fileChunkReceived(int clientSocket, const std::string &peerName, const uint8_t *body, size_t len);
+    void incomingFileDone(const std::string &peerName, const IncomingFile &file);
+    void closeIncomingFiles(int clientSocket);
+    void handleConnections(int clientSocket);
+
+    //Chunked image transfers, see imagetransfer.cpp
+    void sendImage(int clientSocket, const std::string &peerName, const ImageMessage &message,
+                   SendCompletion completion);
+    void sendImageChunks(int clientSocket, uint64_t transferId, const std::shared_ptr<std::vector<uint8_t>> &image,
+                         size_t chunkSize, const std::vector<uint32_t> &chunks);
+    void sendImageResume(int clientSocket, uint64_t transferId, const std::vector<bool> *received, bool done,
+                         bool query);
+    void resumeImages(int clientSocket, const std::string &peerName);
+    void imageChunkReceived(int clientSocket, const std::string &peerName, const uint8_t *body, size_t len);
+    void imageResumeReceived(int clientSocket, const std::string &peerName, const uint8_t *body, size_t len);
+    void stopImageTransfers();
+
+    //Timeouts and keepalives, see timeouts.cpp
+    void watchConnection(int clientSocket, bool accepted);
+    void checkConnection(int clientSocket, const std::weak_ptr<PeerContext> &watched);
+    void frameStarting(int clientSocket);
+    void sendPing(int clientSocket);
+
+    //Peers on this host, see localpeers.cpp. Every frame goes out through transmit()
+    std::shared_ptr<PeerContext> ringCandidate(int clientSocket);
+    void transmit(int clientSocket, OutboundFrame &frame);
+    bool transmitFileChunk(int clientSocket, OutboundFrame &frame, int fileFd, off_t offset, size_t len);
+    void sendRingMessage(int clientSocket, MessageType type, const std::string &name, size_t capacity, bool accepted);
+    std::shared_ptr<RingLink> openRingLink(int clientSocket, std::unique_ptr<SharedRing> ring);
+    void offerSharedRing(int clientSocket);
+    void sharedRingOffered(int clientSocket, const uint8_t *body, size_t len);
+    void sharedRingSwitched(int clientSocket, const uint8_t *body, size_t len);
+    void closeSharedRing(int clientSocket);
+    void stopSharedRings();
+
+    //AF_UNIX connections and the descriptors passed over them, see unixpeers.cpp
+    int openUnixListeningSocket(int socketFlags);
+    void closeUnixListeningSocket();
+    //Engines whose reads cannot take the descriptors that come with the bytes say so, peers then send none
+    virtual bool receivesDescriptors() const { return true; }
+    void setPeerDescriptors(int clientSocket, bool announced);
+    bool passesDescriptor(int clientSocket, size_t size);
+    ssize_t receiveFromSocket(int clientSocket, uint8_t *buffer, size_t len, int flags);
+    ssize_t receiveFully(int clientSocket, uint8_t *buffer, size_t len);
+    void descriptorsReceived(int clientSocket, msghdr &msg);
+    std::unique_ptr<PassedDescriptor> takeDescriptor(int clientSocket);
+    bool sendAttachedImage(int clientSocket, const ImageMessage &message, SendCompletion &completion);
+    std::shared_ptr<std::vector<uint8_t>> attachedImage(int clientSocket, const std::string &peerName, uint64_t size);
+    bool copyAttachedFile(const std::string &peerName, int source, IncomingFile &file);
+
+    void connectNextPeers(const std::shared_ptr<BulkConnect> &bulk);
+public:
+    NetworkCom(int _localPort, UiCallbacks *_uiCallbacks, const NetConfig &_config);
+    ~NetworkCom() override;
+
+    virtual void start();
+    void sendMessage(const std::string &peer, const Message& message) override;
+    void sendMessage(const std::string &peer, const Message& message, SendCompletion completion) override;
+    std::shared_ptr<const SerializedMessage> serialize(const Message &message) override;
+    void sendMessage(const std::string &peer, const std::shared_ptr<const SerializedMessage> &message,
+                     SendCompletion completion) override;
+    void broadcast(const std::vector<std::string> &peerNames, const Message& message) override;
+    void broadcast(const std::vector<std::string> &peerNames, const Message& message,
+                   BroadcastCompletion completion) override;
+    bool connectPeer(const Peer& peer) override;
+    void connectPeer(const Peer& peer, ConnectCompletion completion) override;
+    void connectPeers(const std::vector<Peer>& peers, const AuthMessage &auth, PeerConnectCompletion completion) override;
+    void stopListening() override;
+};
+
+#endif
@@ -0,0 +1,42 @@
+#include "peerregistry.h"
+
+std::shared_ptr<PeerContext> PeerRegistry::context(int socket) {
+    return bySocket.findOrInsert(socket, [socket](){ return std::make_shared<PeerContext>(socket); });
+}
+
+void PeerRegistry::bindName(const std::string &name, int socket) {
+    auto peer = context(socket);
+    std::string previous;
+    {
+        std::lock_guard<std::mutex> lock(peer->mutex);
+        previous = peer->name;
+        peer->name = name;
+    }
+    if(!previous.empty() && previous != name)
+        byName.erase(previous, peer);
+    //A peer that connects again takes its name over to the new socket
+    byName.assign(name, peer);
+}
+
+std::string PeerRegistry::unbindName(int socket) {
+    auto peer = find(socket);
+    if(peer == nullptr)
+        return "";
+    std::string name;
+    {
+        std::lock_guard<std::mutex> lock(peer->mutex);
+        name.swap(peer->name);
+    }
+    if(!name.empty())
+        byName.erase(name, peer);
+    return name;
+}
+
+void PeerRegistry::remove(int socket) {
+    bySocket.erase(socket);
+}
+
+void PeerRegistry::clear() {
+    byName.clear();
+    bySocket.clear();
+}
@@ -0,0 +1,264 @@
+#ifndef P2PCHAT_PEERREGISTRY_H
+#define P2PCHAT_PEERREGISTRY_H
+
+#include "dispatch.h"
+#include "framing.h"
+#include "bufferpool.h"
+#include "timerwheel.h"
+
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+
+class RingLink;
+
+#define REGISTRY_SHARD_BITS     6    //64 shards per table
+#define REGISTRY_SHARD_MIN_SLOTS 16  //power of two
+
+//What we keep for every connected socket besides its name
+struct PeerLink {
+    std::shared_ptr<Strand> strand;  //serial executor of the peer's messages, null without a dispatch pool
+    std::array<uint32_t, FRAME_MAX_STREAMS> sendSequence{};
+    std::array<uint32_t, FRAME_MAX_STREAMS> receiveSequence{};
+    std::array<PooledBuffer, FRAME_MAX_STREAMS> partialBodies;  //fragments received of a message, per stream
+    bool legacyFraming = false;      //the peer sent us legacy headers, so it gets them back
+    uint32_t wireVersion = 1;        //negotiated in the AUTH exchange
+    uint32_t compression = 0;        //codecs the peer can decode, announced in the AUTH exchange
+    std::shared_ptr<std::mutex> writeMutex;  //keeps frames of concurrent senders from interleaving
+
+    //Flow control, see flowcontrol.cpp
+    int64_t sendWindow = 0;      //receive window the peer announced, 0 when we do not have to respect one
+    int64_t sendCredit = 0;      //bytes we may still send before the peer grants more, may go negative
+    StreamQueue heldFrames;      //data frames waiting for credit
+    size_t heldBytes = 0;
+    bool backpressured = false;
+    bool closed = false;
+    size_t unconfirmedBytes = 0; //bytes of the peer's frames we handled since our last CREDIT
+
+    //Timeouts, see timeouts.cpp
+    TimerHandle watchdog;
+    bool awaitingAuth = false;   //accepted, the peer did not send AUTH yet
+    std::chrono::steady_clock::time_point connected;
+    std::chrono::steady_clock::time_point lastReceived;  //the last complete frame
+    std::chrono::steady_clock::time_point frameStarted;  //part of a frame arrived, epoch when none did
+    std::chrono::steady_clock::time_point lastPing;
+
+    int sameHost = -1;           //the peer may move to a shared ring, -1 until we first send to it (localpeers.cpp)
+
+    //AF_UNIX connections, see unixpeers.cpp
+    bool takesDescriptors = false;  //announced by the peer in the AUTH exchange
+    std::deque<std::unique_ptr<PassedDescriptor>> receivedDescriptors;  //for its frames still to be handled, in order
+};
+
+//Everything about one connection, found through its socket or the name of its peer
+struct PeerContext {
+    const int socket;
+    std::mutex mutex;  //guards name and link, only ever held for a few instructions
+    std::recursive_mutex sendMutex;  //held while a message is numbered and queued, a completion may send again
+    std::condition_variable creditGranted;  //with mutex, for the file sender
+    std::recursive_mutex transmitMutex;  //peers on this host: held while a frame goes to the engine or the ring
+    std::shared_ptr<RingLink> ringLink;  //with transmitMutex, the shared ring once one was offered
+    std::string name;  //empty until the peer authenticated (or we connected to it)
+    PeerLink link;
+
+    explicit PeerContext(int socket) : socket(socket) {}
+};
+
+/*
+ Open-addressing hash table split into shards with a lock each, so threads that look up
+ different keys do not wait for each other. Linear probing over a power of two number of
+ slots, erased slots become tombstones until the shard is rehashed.
+ */
+template<typename Key>
+class ShardedTable {
+public:
+    using Value = std::shared_ptr<PeerContext>;
+
+private:
+    enum class SlotState : uint8_t { EMPTY, USED, ERASED };
+    struct Slot {
+        Key key{};
+        Value value;
+        SlotState state = SlotState::EMPTY;
+    };
+    struct alignas(64) Shard {
+        mutable std::shared_mutex mutex;
+        std::vector<Slot> slots;
+        size_t live = 0;
+        size_t used = 0;  //live and erased slots, what probing has to walk over
+    };
+    std::array<Shard, size_t(1) << REGISTRY_SHARD_BITS> shards;
+
+    static uint64_t mix(uint64_t hash) {
+        //splitmix64 finalizer: socket numbers are sequential and std::hash<int> is the identity
+        hash ^= hash >> 30;
+        hash *= 0xbf58476d1ce4e5b9ULL;
+        hash ^= hash >> 27;
+        hash *= 0x94d049bb133111ebULL;
+        return hash ^ (hash >> 31);
+    }
+    static uint64_t hashOf(const Key &key) { return mix(std::hash<Key>{}(key)); }
+    Shard &shardOf(uint64_t hash) { return shards[hash >> (64 - REGISTRY_SHARD_BITS)]; }
+    const Shard &shardOf(uint64_t hash) const { return shards[hash >> (64 - REGISTRY_SHARD_BITS)]; }
+
+    //Slot holding key, or nullptr
+    static const Slot *findSlot(const Shard &shard, uint64_t hash, const Key &key) {
+        if(shard.slots.empty())
+            return nullptr;
+        size_t mask = shard.slots.size() - 1;
+        for(size_t i = hash & mask;; i = (i + 1) & mask) {
+            const Slot &slot = shard.slots[i];
+            if(slot.state == SlotState::EMPTY)
+                return nullptr;
+            if(slot.state == SlotState::USED && slot.key == key)
+                return &slot;
+        }
+    }
+    static Slot *findSlot(Shard &shard, uint64_t hash, const Key &key) {
+        return const_cast<Slot*>(findSlot(const_cast<const Shard&>(shard), hash, key));
+    }
+
+    static void rehash(Shard &shard, size_t slotCount) {
+        std::vector<Slot> old(slotCount);
+        old.swap(shard.slots);
+        shard.used = shard.live;
+        size_t mask = slotCount - 1;
+        for(auto &slot : old) {
+            if(slot.state != SlotState::USED)
+                continue;
+            size_t i = hashOf(slot.key) & mask;
+            while(shard.slots[i].state != SlotState::EMPTY)
+                i = (i + 1) & mask;
+            shard.slots[i] = std::move(slot);
+        }
+    }
+
+    //Keeps at least a quarter of the slots empty so probes stay short
+    static void reserveOne(Shard &shard) {
+        size_t slotCount = shard.slots.size();
+        if((shard.used + 1) * 4 <= slotCount * 3)
+            return;
+        if(slotCount == 0)
+            slotCount = REGISTRY_SHARD_MIN_SLOTS;
+        else if((shard.live + 1) * 2 > slotCount)
+            slotCount *= 2;
+        //otherwise mostly tombstones: same size, they are dropped
+        rehash(shard, slotCount);
+    }
+
+    static Slot &insertSlot(Shard &shard, uint64_t hash, const Key &key) {
+        reserveOne(shard);
+        size_t mask = shard.slots.size() - 1;
+        size_t i = hash & mask;
+        while(shard.slots[i].state == SlotState::USED)
+            i = (i + 1) & mask;
+        Slot &slot = shard.slots[i];
+        if(slot.state == SlotState::EMPTY)
+            shard.used++;
+        shard.live++;
+        slot.key = key;
+        slot.state = SlotState::USED;
+        return slot;
+    }
+
+public:
+    Value find(const Key &key) const {
+        uint64_t hash = hashOf(key);
+        const Shard &shard = shardOf(hash);
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        const Slot *slot = findSlot(shard, hash, key);
+        return slot != nullptr ? slot->value : nullptr;
+    }
+
+    //Returns the value stored for key, or stores and returns the one made by create
+    template<typename Create> Value findOrInsert(const Key &key, Create create) {
+        if(auto value = find(key))
+            return value;
+        uint64_t hash = hashOf(key);
+        Shard &shard = shardOf(hash);
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
+        if(Slot *slot = findSlot(shard, hash, key))
+            return slot->value;
+        Slot &slot = insertSlot(shard, hash, key);
+        slot.value = create();
+        return slot.value;
+    }
+
+    void assign(const Key &key, Value value) {
+        uint64_t hash = hashOf(key);
+        Shard &shard = shardOf(hash);
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
+        Slot *slot = findSlot(shard, hash, key);
+        if(slot == nullptr)
+            slot = &insertSlot(shard, hash, key);
+        slot->value = std::move(value);
+    }
+
+    //Erases key when it still maps to expected (any value if expected is null)
+    bool erase(const Key &key, const Value &expected = nullptr) {
+        uint64_t hash = hashOf(key);
+        Shard &shard = shardOf(hash);
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
+        Slot *slot = findSlot(shard, hash, key);
+        if(slot == nullptr || (expected != nullptr && slot->value != expected))
+            return false;
+        slot->key = Key{};
+        slot->value = nullptr;
+        slot->state = SlotState::ERASED;
+        shard.live--;
+        return true;
+    }
+
+    template<typename Visit> void forEach(Visit visit) const {
+        for(auto &shard : shards) {
+            std::shared_lock<std::shared_mutex> lock(shard.mutex);
+            for(auto &slot : shard.slots) {
+                if(slot.state == SlotState::USED)
+                    visit(slot.value);
+            }
+        }
+    }
+
+    void clear() {
+        for(auto &shard : shards) {
+            std::unique_lock<std::shared_mutex> lock(shard.mutex);
+            shard.slots.clear();
+            shard.live = 0;
+            shard.used = 0;
+        }
+    }
+};
+
+/*
+ Connections by socket and by peer name. Both lookups are a probe in one shard, so readers
+ that resolve the name of their socket on every message only meet the writers that happen
+ to use the same shard, never a lock over all peers.
+ */
+class PeerRegistry {
+private:
+    ShardedTable<int> bySocket;
+    ShardedTable<std::string> byName;
+
+public:
+    std::shared_ptr<PeerContext> find(int socket) const { return bySocket.find(socket); }
+    std::shared_ptr<PeerContext> find(const std::string &name) const { return byName.find(name); }
+    //The context of socket, created on first use
+    std::shared_ptr<PeerContext> context(int socket);
+
+    void bindName(const std::string &name, int socket);
+    //Forgets the name of socket, the context stays until remove()
+    std::string unbindName(int socket);
+    void remove(int socket);
+    void clear();
+    template<typename Visit> void forEach(Visit visit) const { bySocket.forEach(visit); }
+};
+
+#endif
@@ -0,0 +1,348 @@
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <cerrno>
+
+#include "proactor.h"
+#include "threading.h"
+#include "logging.h"
+
+#define URING_ENTRIES       1024
+#define URING_BUFFER_GROUP  0
+#define URING_BUFFER_COUNT  256   //must be a power of two
+#define URING_BUFFER_SIZE   (32 * 1024)
+
+UringNetworkCom::UringNetworkCom(int _localPort, UiCallbacks *_uiCallbacks, const NetConfig &_config) :
+        NetworkCom(_localPort, _uiCallbacks, _config), running(false), wakeupFd(-1), wakeupValue(0) {}
+
+UringNetworkCom::~UringNetworkCom() {
+    stopListening();
+}
+
+bool UringNetworkCom::isSupported() {
+    IoUring probe;
+    return probe.init(2);
+}
+
+uint64_t UringNetworkCom::userData(Op op, int fd) {
+    return (static_cast<uint64_t>(op) << 32) | static_cast<uint32_t>(fd);
+}
+
+void UringNetworkCom::start() {
+    if(!ring.init(URING_ENTRIES) ||
+       !ring.registerBufferRing(URING_BUFFER_GROUP, URING_BUFFER_COUNT, URING_BUFFER_SIZE)) {
+        getLogger()->error("Cannot initialize io_uring engine on {}", localPort);
+        exit(EXIT_FAILURE);
+    }
+    wakeupFd = eventfd(0, EFD_CLOEXEC);
+    running = true;
+    ringThread = std::thread([this](){
+        setupThread("p2p-uring", config.ioCpus);
+        this->startListening();
+    });
+}
+
+void UringNetworkCom::startListening() {
+    createListeningSocket(SOCK_CLOEXEC);
+    armAccept(localSocket);
+    int unixListeningSocket = openUnixListeningSocket(SOCK_CLOEXEC);
+    if(unixListeningSocket >= 0)
+        armAccept(unixListeningSocket);
+    armWakeup();
+    uiCallbacks->bindSucceeded();
+    run();
+}
+
+io_uring_sqe *UringNetworkCom::nextSqe() {
+    io_uring_sqe *sqe = ring.getSqe();
+    while(sqe == nullptr) {
+        //Submission queue is full, hand what we have to the kernel and try again
+        ring.submitAndWait(0);
+        sqe = ring.getSqe();
+    }
+    return sqe;
+}
+
+void UringNetworkCom::armAccept(int listeningSocket) {
+    io_uring_sqe *sqe = nextSqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listeningSocket;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = userData(Op::ACCEPT, listeningSocket);
+}
+
+void UringNetworkCom::armWakeup() {
+    io_uring_sqe *sqe = nextSqe();
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = wakeupFd;
+    sqe->addr = reinterpret_cast<uint64_t>(&wakeupValue);
+    sqe->len = sizeof(wakeupValue);
+    sqe->user_data = userData(Op::WAKEUP, wakeupFd);
+}
+
+void UringNetworkCom::armRecv(UringConnection &connection) {
+    io_uring_sqe *sqe = nextSqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = connection.socket;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = ring.bufferGroup();
+    sqe->user_data = userData(Op::RECV, connection.socket);
+    connection.recvArmed = true;
+}
+
+void UringNetworkCom::submitSend(UringConnection &connection) {
+    auto &front = connection.sendQueue.front();
+    connection.sendMsg = msghdr{};
+    connection.sendMsg.msg_iov = connection.sendIov;
+    connection.sendMsg.msg_iovlen = front.iovecs(connection.sendOffset, connection.sendIov);
+    if(connection.sendOffset == 0 && front.descriptor != nullptr)
+        attachDescriptor(connection.sendMsg, front.descriptor->fd, connection.sendControl);
+
+    io_uring_sqe *sqe = nextSqe();
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = connection.socket;
+    sqe->addr = reinterpret_cast<uint64_t>(&connection.sendMsg);
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = userData(Op::SEND, connection.socket);
+    connection.sendInFlight = true;
+}
+
+void UringNetworkCom::post(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lock(tasksMutex);
+        pendingTasks.push_back(std::move(task));
+    }
+    uint64_t one = 1;
+    if(write(wakeupFd, &one, sizeof(one)) < 0)
+        getLogger()->error("Cannot wake up io_uring engine. errno: {}", errno);
+}
+
+void UringNetworkCom::runPendingTasks() {
+    std::vector<std::function<void()>> tasks;
+    {
+        std::lock_guard<std::mutex> lock(tasksMutex);
+        tasks.swap(pendingTasks);
+    }
+    for(auto &task : tasks)
+        task();
+}
+
+void UringNetworkCom::run() {
+    getLogger()->info("io_uring engine is running on port {}", localPort);
+    while(running) {
+        runPendingTasks();
+        int ret = ring.submitAndWait(1);
+        if(ret < 0 && ret != -EINTR && ret != -EBUSY) {
+            getLogger()->error("io_uring_enter() failed. errno: {}", -ret);
+            break;
+        }
+        ring.forEachCompletion([this](const io_uring_cqe &cqe){ handleCompletion(cqe); });
+    }
+}
+
+void UringNetworkCom::handleCompletion(const io_uring_cqe &cqe) {
+    auto op = static_cast<Op>(cqe.user_data >> 32);
+    int fd = static_cast<int>(cqe.user_data & 0xffffffff);
+
+    switch (op) {
+        case Op::ACCEPT:
+            onAccept(cqe);
+            return;
+        case Op::WAKEUP:
+            if(running)
+                armWakeup();
+            return;
+        default:
+            break;
+    }
+
+    auto it = connections.find(fd);
+    if(it == connections.end()) {
+        //The only completions without a connection are recv buffers of an already closed socket
+        if(cqe.flags & IORING_CQE_F_BUFFER)
+            ring.recycleBuffer(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+        return;
+    }
+    auto connection = it->second;
+    if(op == Op::RECV)
+        onRecv(connection, cqe);
+    else if(op == Op::SEND)
+        onSend(connection, cqe);
+}
+
+void UringNetworkCom::onAccept(const io_uring_cqe &cqe) {
+    if(cqe.res >= 0) {
+        getLogger()->info("Received a new connection. Waiting for AUTH message.");
+        watchConnection(cqe.res, true);
+        attachConnection(cqe.res);
+    } else if(cqe.res != -EINTR && cqe.res != -ECONNABORTED) {
+        getLogger()->error("accept() failed on {}. errno: {}", localPort, -cqe.res);
+    }
+
+    if(!(cqe.flags & IORING_CQE_F_MORE) && running && isListeningLocally)
+        armAccept(static_cast<int>(cqe.user_data & 0xffffffff));
+}
+
+void UringNetworkCom::onRecv(const std::shared_ptr<UringConnection> &connection, const io_uring_cqe &cqe) {
+    bool alive = true;
+    if(cqe.res > 0 && (cqe.flags & IORING_CQE_F_BUFFER)) {
+        auto bufferId = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+        const uint8_t *data = ring.buffer(bufferId);
+        auto len = static_cast<size_t>(cqe.res);
+
+        if(!connection->closing) {
+            auto &inbound = connection->inbound;
+            size_t consumed;
+            if(inbound.empty()) {
+                //Common case: whole frames in one completion, dispatch them from the registered buffer
+                consumed = consumeFrames(connection->socket, data, len, alive);
+                inbound.assign(data + consumed, data + len);
+            } else {
+                inbound.insert(inbound.end(), data, data + len);
+                consumed = consumeFrames(connection->socket, inbound.data(), inbound.size(), alive);
+                inbound.erase(inbound.begin(), inbound.begin() + static_cast<long>(consumed));
+            }
+        }
+        ring.recycleBuffer(bufferId);
+    } else if(cqe.res == 0) {
+        alive = false;
+    } else if(cqe.res < 0 && cqe.res != -ENOBUFS) {
+        if(!connection->closing)
+            getLogger()->error("Error in receiving from socket {}. errno: {}", connection->socket, -cqe.res);
+        alive = false;
+    }
+
+    if(!(cqe.flags & IORING_CQE_F_MORE)) {
+        connection->recvArmed = false;
+        //ENOBUFS ends a multishot recv, buffers are recycled right away so it is safe to re-arm
+        if(alive && !connection->closing)
+            armRecv(*connection);
+    }
+
+    if(!alive)
+        beginClose(connection);
+    finishCloseIfIdle(connection);
+}
+
+void UringNetworkCom::onSend(const std::shared_ptr<UringConnection> &connection, const io_uring_cqe &cqe) {
+    connection->sendInFlight = false;
+    if(cqe.res < 0) {
+        if(!connection->closing)
+            getLogger()->error("Error in sending to socket {}. errno: {}", connection->socket, -cqe.res);
+        beginClose(connection);
+        finishCloseIfIdle(connection);
+        return;
+    }
+
+    connection->sendOffset += cqe.res;
+    if(connection->sendOffset == connection->sendQueue.front().size()) {
+        connection->sendQueue.front().complete(true);
+        connection->sendQueue.pop();
+        connection->sendOffset = 0;
+    }
+    if(!connection->sendQueue.empty() && !connection->closing)
+        submitSend(*connection);
+    finishCloseIfIdle(connection);
+}
+
+void UringNetworkCom::beginClose(const std::shared_ptr<UringConnection> &connection) {
+    if(connection->closing)
+        return;
+    connection->closing = true;
+    failQueuedSends(*connection);
+    connectionClosed(connection->socket);
+    //Makes the outstanding multishot recv (and any send) complete, then the socket is released
+    shutdown(connection->socket, SHUT_RDWR);
+}
+
+void UringNetworkCom::failQueuedSends(UringConnection &connection) {
+    //A SENDMSG still in flight keeps using the front frame until its completion arrives
+    connection.sendQueue.fail(connection.sendInFlight);
+}
+
+void UringNetworkCom::finishCloseIfIdle(const std::shared_ptr<UringConnection> &connection) {
+    if(!connection->closing || connection->recvArmed || connection->sendInFlight)
+        return;
+    connections.erase(connection->socket);
+    close(connection->socket);
+}
+
+void UringNetworkCom::attachConnection(int clientSocket) {
+    int noDelay = 1;
+    setsockopt(clientSocket, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+    post([this, clientSocket](){
+        auto connection = std::make_shared<UringConnection>(clientSocket);
+        connections[clientSocket] = connection;
+        armRecv(*connection);
+    });
+}
+
+void UringNetworkCom::writeMessage(int clientSocket, OutboundFrame &frame) {
+    //The payload must outlive the request, so the ring thread gets it unless the frame already shares it
+    frame.own();
+    post([this, clientSocket, frame]() mutable {
+        auto it = connections.find(clientSocket);
+        if(it == connections.end() || it->second->closing) {
+            getLogger()->warn("Socket {} is not attached to the io_uring engine.", clientSocket);
+            frame.complete(false);
+            return;
+        }
+        auto &connection = *it->second;
+        connection.sendQueue.push(std::move(frame));
+        if(!connection.sendInFlight)
+            submitSend(connection);
+    });
+}
+
+bool UringNetworkCom::writeFileChunk(int clientSocket, OutboundFrame &frame, int fileFd, off_t offset, size_t len) {
+    //No sendfile here: the chunk is read once and its buffer travels with the SENDMSG request
+    auto chunk = std::make_shared<std::vector<uint8_t>>(len);
+    size_t filled = 0;
+    while(filled < len) {
+        ssize_t bytesRead = pread(fileFd, chunk->data() + filled, len - filled, offset + static_cast<off_t>(filled));
+        if(bytesRead < 0 && errno == EINTR)
+            continue;
+        if(bytesRead <= 0) {
+            getLogger()->error("Cannot read file chunk for socket {}. errno: {}", clientSocket, errno);
+            return false;
+        }
+        filled += bytesRead;
+    }
+    frame.payload = chunk->data();
+    frame.payloadLength = len;
+    frame.storage = std::move(chunk);
+    writeMessage(clientSocket, frame);
+    return true;
+}
+
+void UringNetworkCom::stopListening() {
+    stopFileTransfers();
+    stopImageTransfers();
+    timers.stop();
+    connector.stop();
+    stopSharedRings();
+    if(!running.exchange(false))
+        return;
+
+    getLogger()->info("Disconnecting from all peers and stopping io_uring engine.");
+    post([](){});
+    if(ringThread.joinable())
+        ringThread.join();
+
+    for(auto &[clientSocket, connection] : connections) {
+        failQueuedSends(*connection);
+        close(clientSocket);
+    }
+    connections.clear();
+    clearPeers();
+    close(localSocket);
+    closeUnixListeningSocket();
+    close(wakeupFd);
+    isListeningLocally = false;
+    getLogger()->info("Networking stopped!");
+}
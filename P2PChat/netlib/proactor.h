@@ -0,0 +1,83 @@
+#ifndef P2PCHAT_PROACTOR_H
+#define P2PCHAT_PROACTOR_H
+
+#include "networking.h"
+#include "iouring.h"
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+
+struct UringConnection {
+    int socket;
+    std::vector<uint8_t> inbound;  //partial frame left over from previous completions
+    StreamQueue sendQueue;  //its front is the frame being sent
+    size_t sendOffset = 0;
+    iovec sendIov[2];  //the kernel reads these until the in-flight SENDMSG completes
+    msghdr sendMsg{};
+    alignas(cmsghdr) uint8_t sendControl[DESCRIPTOR_CONTROL_LEN];  //passes the front frame's descriptor
+    bool sendInFlight = false;
+    bool recvArmed = false;
+    bool closing = false;
+
+    explicit UringConnection(int socket) : socket(socket) {}
+};
+
+/*
+ io_uring engine. A single thread owns the ring: accept and recv are multishot requests,
+ received bytes land in a registered buffer ring, and a frame is dispatched straight from
+ that buffer whenever it arrived in one piece. Other threads hand work over through post().
+ */
+class UringNetworkCom : public NetworkCom {
+private:
+    enum class Op : uint8_t { ACCEPT = 1, RECV, SEND, WAKEUP };
+
+    IoUring ring;
+    std::thread ringThread;
+    std::atomic<bool> running;
+    int wakeupFd;
+    uint64_t wakeupValue;
+    std::mutex tasksMutex;
+    std::vector<std::function<void()>> pendingTasks;
+    std::unordered_map<int, std::shared_ptr<UringConnection>> connections; //ring thread only
+
+    static uint64_t userData(Op op, int fd);
+    io_uring_sqe *nextSqe();
+    void post(std::function<void()> task);
+    void run();
+    void runPendingTasks();
+
+    void armAccept(int listeningSocket);
+    void armWakeup();
+    void armRecv(UringConnection &connection);
+    void submitSend(UringConnection &connection);
+
+    void handleCompletion(const io_uring_cqe &cqe);
+    void onAccept(const io_uring_cqe &cqe);
+    void onRecv(const std::shared_ptr<UringConnection> &connection, const io_uring_cqe &cqe);
+    void onSend(const std::shared_ptr<UringConnection> &connection, const io_uring_cqe &cqe);
+    void failQueuedSends(UringConnection &connection);
+    void beginClose(const std::shared_ptr<UringConnection> &connection);
+    void finishCloseIfIdle(const std::shared_ptr<UringConnection> &connection);
+
+protected:
+    //A multishot recv has nowhere to put them
+    bool receivesDescriptors() const override { return false; }
+    void startListening() override;
+    void attachConnection(int clientSocket) override;
+    void writeMessage(int clientSocket, OutboundFrame &frame) override;
+    bool writeFileChunk(int clientSocket, OutboundFrame &frame, int fileFd, off_t offset, size_t len) override;
+
+public:
+    UringNetworkCom(int _localPort, UiCallbacks *_uiCallbacks, const NetConfig &_config);
+    ~UringNetworkCom() override;
+
+    static bool isSupported();
+
+    void start() override;
+    void stopListening() override;
+};
+
+#endif
@@ -0,0 +1,39 @@
+#include "protoarena.h"
+
+namespace {
+    struct ThreadArena {
+        alignas(8) char initialBlock[PROTO_ARENA_INITIAL_BLOCK];
+        google::protobuf::Arena arena;
+        int depth = 0;
+
+        static google::protobuf::ArenaOptions options(char *block) {
+            google::protobuf::ArenaOptions options;
+            options.initial_block = block;
+            options.initial_block_size = PROTO_ARENA_INITIAL_BLOCK;
+            options.max_block_size = PROTO_ARENA_MAX_BLOCK;
+            return options;
+        }
+
+        ThreadArena() : arena(options(initialBlock)) {}
+    };
+
+    ThreadArena &threadArena() {
+        static thread_local ThreadArena arena;
+        return arena;
+    }
+}
+
+ProtoArenaScope::ProtoArenaScope() {
+    threadArena().depth++;
+}
+
+ProtoArenaScope::~ProtoArenaScope() {
+    auto &thread = threadArena();
+    //Only the initial block survives a reset, what a big message needed goes back to the heap
+    if(--thread.depth == 0)
+        thread.arena.Reset();
+}
+
+google::protobuf::Arena *ProtoArenaScope::arena() {
+    return &threadArena().arena;
+}
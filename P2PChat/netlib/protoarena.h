@@ -0,0 +1,26 @@
+#ifndef P2PCHAT_PROTOARENA_H
+#define P2PCHAT_PROTOARENA_H
+
+#include <google/protobuf/arena.h>
+
+#define PROTO_ARENA_INITIAL_BLOCK  (64 * 1024)    //per thread, never freed
+#define PROTO_ARENA_MAX_BLOCK      (1024 * 1024)  //blocks the arena adds for bigger messages
+
+/*
+ The protobuf messages netlib encodes and decodes live on an arena of the current thread
+ instead of the heap. Open a scope around the work, create messages with
+ google::protobuf::Arena::CreateMessage<T>(scope.arena()) and do not keep them after the
+ scope. Scopes nest (an AUTH we handle sends an AUTH_ACK), and the arena is reset when the
+ outermost one ends, so a batch of frames handled in one scope shares the same memory.
+ */
+class ProtoArenaScope {
+public:
+    ProtoArenaScope();
+    ~ProtoArenaScope();
+    ProtoArenaScope(const ProtoArenaScope &) = delete;
+    ProtoArenaScope& operator=(const ProtoArenaScope &) = delete;
+
+    google::protobuf::Arena *arena();
+};
+
+#endif
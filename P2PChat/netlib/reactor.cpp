@@ -0,0 +1,404 @@
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <algorithm>
+#include <thread>
+
+#include "reactor.h"
+#include "threading.h"
+#include "logging.h"
+
+#define RECV_CHUNK_SIZE (64 * 1024)
+
+EpollNetworkCom::EpollNetworkCom(int _localPort, UiCallbacks *_uiCallbacks, const NetConfig &_config) :
+        NetworkCom(_localPort, _uiCallbacks, _config), nextLoop(0) {
+    int ioThreads = config.ioThreads > 0 ? config.ioThreads : static_cast<int>(std::thread::hardware_concurrency());
+    ioThreads = std::max(ioThreads, 1);
+    for(int i=0; i<ioThreads; i++)
+        loops.push_back(std::make_unique<EventLoop>());
+}
+
+EpollNetworkCom::~EpollNetworkCom() {
+    stopListening();
+}
+
+void EpollNetworkCom::start() {
+    startListening();
+}
+
+void EpollNetworkCom::startListening() {
+    if(config.reusePort) {
+        for(auto &loop : loops) {
+            int listeningSocket = openListeningSocket(SOCK_NONBLOCK | SOCK_CLOEXEC, true);
+            listeningSockets.push_back(listeningSocket);
+            loop->watch(listeningSocket, EPOLLIN | EPOLLET, [this, listeningSocket, owner = loop.get()](uint32_t){
+                acceptConnections(listeningSocket, owner);
+            });
+        }
+        localSocket = listeningSockets[0];
+        isListeningLocally = true;
+        getLogger()->info("Waiting for connections on: {} with {} listening sockets", localPort, listeningSockets.size());
+    } else {
+        createListeningSocket(SOCK_NONBLOCK | SOCK_CLOEXEC);
+        listeningSockets.push_back(localSocket);
+        loops[0]->watch(localSocket, EPOLLIN | EPOLLET, [this](uint32_t){ acceptConnections(localSocket, nullptr); });
+    }
+    int unixListeningSocket = openUnixListeningSocket(SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if(unixListeningSocket >= 0)
+        loops[0]->watch(unixListeningSocket, EPOLLIN | EPOLLET, [this, unixListeningSocket](uint32_t){
+            acceptConnections(unixListeningSocket, nullptr);
+        });
+    for(size_t i=0; i<loops.size(); i++)
+        loops[i]->start("p2p-epoll-" + std::to_string(i), nthCpu(config.ioCpus, i));
+    getLogger()->info("Started {} event loops for port {}", loops.size(), localPort);
+    loops[0]->post([this](){ uiCallbacks->bindSucceeded(); });
+}
+
+//owner keeps the connections it accepts, without one they are spread over all loops
+void EpollNetworkCom::acceptConnections(int listeningSocket, EventLoop *owner) {
+    while(true) {
+        int clientSocket = accept4(listeningSocket, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(clientSocket < 0) {
+            if(errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+                getLogger()->error("accept() failed on {}. errno: {}", localPort, errno);
+            return;
+        }
+        getLogger()->info("Received a new connection. Waiting for AUTH message.");
+        watchConnection(clientSocket, true);
+        if(owner != nullptr)
+            attachToLoop(clientSocket, owner);
+        else
+            attachConnection(clientSocket);
+    }
+}
+
+void EpollNetworkCom::attachConnection(int clientSocket) {
+    attachToLoop(clientSocket, loops[nextLoop++ % loops.size()].get());
+}
+
+void EpollNetworkCom::attachToLoop(int clientSocket, EventLoop *loop) {
+    int flags = fcntl(clientSocket, F_GETFL, 0);
+    fcntl(clientSocket, F_SETFL, flags | O_NONBLOCK);
+    int noDelay = 1;
+    setsockopt(clientSocket, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+    auto connection = std::make_shared<EpollConnection>(clientSocket, loop);
+    {
+        auto &table = shard(clientSocket);
+        std::lock_guard<std::mutex> lock(table.mutex);
+        table.connections[clientSocket] = connection;
+    }
+    loop->watch(clientSocket, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+                [this, connection](uint32_t events){ handleEvents(connection, events); });
+}
+
+//Senders of different peers look up their connections without contending for one lock
+EpollNetworkCom::ConnectionShard &EpollNetworkCom::shard(int clientSocket) {
+    return shards[static_cast<size_t>(clientSocket) % CONNECTION_SHARDS];
+}
+
+std::shared_ptr<EpollConnection> EpollNetworkCom::findConnection(int clientSocket) {
+    auto &table = shard(clientSocket);
+    std::lock_guard<std::mutex> lock(table.mutex);
+    auto it = table.connections.find(clientSocket);
+    if(it != table.connections.end())
+        return it->second;
+    return nullptr;
+}
+
+void EpollNetworkCom::handleEvents(const std::shared_ptr<EpollConnection> &connection, uint32_t events) {
+    bool alive = true;
+    if(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+        alive = readAvailable(*connection) && processFrames(*connection);
+
+    if(alive && (events & EPOLLOUT)) {
+        std::lock_guard<std::mutex> lock(connection->writeMutex);
+        alive = flushOutbound(*connection);
+    }
+
+    if(!alive)
+        closeConnection(connection);
+}
+
+bool EpollNetworkCom::readAvailable(EpollConnection &connection) {
+    uint8_t chunk[RECV_CHUNK_SIZE];
+    while(true) {
+        ssize_t bytesReceived = receiveFromSocket(connection.socket, chunk, sizeof(chunk), 0);
+        if(bytesReceived > 0) {
+            connection.inbound.insert(connection.inbound.end(), chunk, chunk + bytesReceived);
+            continue;
+        }
+        if(bytesReceived == 0)
+            return false;
+        if(errno == EINTR)
+            continue;
+        if(errno == EAGAIN || errno == EWOULDBLOCK)
+            return true;
+        getLogger()->error("Error in receiving from socket {}. errno: {}", connection.socket, errno);
+        return false;
+    }
+}
+
+bool EpollNetworkCom::processFrames(EpollConnection &connection) {
+    auto &inbound = connection.inbound;
+    bool valid = true;
+    size_t consumed = consumeFrames(connection.socket, inbound.data(), inbound.size(), valid);
+    inbound.erase(inbound.begin(), inbound.begin() + static_cast<long>(consumed));
+    return valid;
+}
+
+bool EpollNetworkCom::flushOutbound(EpollConnection &connection) {
+    while(true) {
+        while(connection.outboundOffset < connection.outbound.size()) {
+            iovec iov{connection.outbound.data() + connection.outboundOffset,
+                      connection.outbound.size() - connection.outboundOffset};
+            msghdr msg{};
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            alignas(cmsghdr) uint8_t control[DESCRIPTOR_CONTROL_LEN];
+            if(connection.outboundDescriptor != nullptr)
+                attachDescriptor(msg, connection.outboundDescriptor->fd, control);
+            ssize_t sent = sendmsg(connection.socket, &msg, MSG_NOSIGNAL);
+            if(sent < 0) {
+                if(errno == EINTR)
+                    continue;
+                if(errno == EAGAIN || errno == EWOULDBLOCK)
+                    return true;
+                getLogger()->error("Error in sending to socket {}. errno: {}", connection.socket, errno);
+                return false;
+            }
+            connection.outboundDescriptor = nullptr;
+            connection.outboundOffset += sent;
+            settleCompletions(connection, true);
+        }
+        connection.outbound.clear();
+        connection.outboundOffset = 0;
+        if(connection.pending.empty())
+            break;
+
+        //The next stream's turn; what the kernel does not take of it goes to outbound
+        OutboundFrame frame = std::move(connection.pending.front());
+        connection.pending.pop();
+        if(!sendOrKeep(connection, frame))
+            return false;
+    }
+    connection.outboundDrained.notify_all();
+    return true;
+}
+
+//Completions run on the loop, never under writeMutex and never inside the caller's sendMessage()
+void EpollNetworkCom::settleCompletions(EpollConnection &connection, bool sent) {
+    auto &completions = connection.completions;
+    while(!completions.empty() && (!sent || completions.front().first <= connection.outboundOffset)) {
+        connection.loop->post([done = std::move(completions.front().second), sent](){ done(sent); });
+        completions.pop_front();
+    }
+}
+
+bool EpollNetworkCom::sendDirect(EpollConnection &connection, const OutboundFrame &frame, size_t &written) {
+    while(written < frame.size()) {
+        iovec iov[2];
+        msghdr msg{};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = frame.iovecs(written, iov);
+        alignas(cmsghdr) uint8_t control[DESCRIPTOR_CONTROL_LEN];
+        if(written == 0 && frame.descriptor != nullptr)
+            attachDescriptor(msg, frame.descriptor->fd, control);
+        ssize_t sent = sendmsg(connection.socket, &msg, MSG_NOSIGNAL);
+        if(sent < 0) {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return true;
+            getLogger()->error("Error in sending to socket {}. errno: {}", connection.socket, errno);
+            return false;
+        }
+        written += sent;
+    }
+    return true;
+}
+
+//Sends as much of frame as the socket takes and copies the rest to outbound. Needs an empty outbound
+bool EpollNetworkCom::sendOrKeep(EpollConnection &connection, OutboundFrame &frame) {
+    size_t written = 0;
+    if(!sendDirect(connection, frame, written)) {
+        connection.loop->post([done = std::move(frame.completion)](){ if(done != nullptr) done(false); });
+        return false;
+    }
+    if(written == frame.size()) {
+        if(frame.completion != nullptr)
+            connection.loop->post([done = std::move(frame.completion)](){ done(true); });
+        return true;
+    }
+    //Only what the kernel did not take is copied, and a descriptor that did not go waits for the first byte
+    if(written == 0)
+        connection.outboundDescriptor = std::move(frame.descriptor);
+    iovec iov[2];
+    int count = frame.iovecs(written, iov);
+    for(int i=0; i<count; i++) {
+        auto base = static_cast<const uint8_t*>(iov[i].iov_base);
+        connection.outbound.insert(connection.outbound.end(), base, base + iov[i].iov_len);
+    }
+    if(frame.completion != nullptr)
+        connection.completions.emplace_back(connection.outbound.size(), std::move(frame.completion));
+    return true;
+}
+
+void EpollNetworkCom::writeMessage(int clientSocket, OutboundFrame &frame) {
+    auto connection = findConnection(clientSocket);
+    if(connection == nullptr) {
+        getLogger()->warn("Socket {} is not attached to any event loop.", clientSocket);
+        frame.complete(false);
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(connection->writeMutex);
+    if(connection->closed) {
+        lock.unlock();
+        frame.complete(false);
+        return;
+    }
+    //Behind a backlog the frame waits for its stream's turn, the loop drains it on the next EPOLLOUT
+    if(!connection->outbound.empty() || !connection->pending.empty()) {
+        frame.own();
+        connection->pending.push(std::move(frame));
+        return;
+    }
+    if(!sendOrKeep(*connection, frame))
+        connection->loop->post([this, connection](){ closeConnection(connection); });
+}
+
+bool EpollNetworkCom::writeFileChunk(int clientSocket, OutboundFrame &frame, int fileFd, off_t offset, size_t len) {
+    auto connection = findConnection(clientSocket);
+    if(connection == nullptr)
+        return false;
+
+    //A slow peer makes the sender wait here, not the whole file in our memory
+    std::unique_lock<std::mutex> lock(connection->writeMutex);
+    connection->outboundDrained.wait(lock, [&connection](){
+        return (connection->outbound.empty() && connection->pending.empty()) || connection->closed;
+    });
+    if(connection->closed)
+        return false;
+
+    size_t written = 0;
+    bool alive = sendDirect(*connection, frame, written);
+    while(alive && written == frame.size() && len > 0) {
+        ssize_t sent = sendfile(clientSocket, fileFd, &offset, len);
+        if(sent < 0 && errno == EINTR)
+            continue;
+        if(sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if(sent <= 0) {
+            getLogger()->error("sendfile() to socket {} failed. errno: {}", clientSocket, errno);
+            alive = false;
+            break;
+        }
+        len -= sent;
+    }
+
+    if(alive) {
+        //The socket is full: what is left of the chunk is read into outbound for the next EPOLLOUT
+        iovec iov[2];
+        int count = frame.iovecs(written, iov);
+        for(int i=0; i<count; i++) {
+            auto base = static_cast<const uint8_t*>(iov[i].iov_base);
+            connection->outbound.insert(connection->outbound.end(), base, base + iov[i].iov_len);
+        }
+        size_t queued = connection->outbound.size();
+        connection->outbound.resize(queued + len);
+        while(len > 0) {
+            ssize_t bytesRead = pread(fileFd, connection->outbound.data() + queued, len, offset);
+            if(bytesRead < 0 && errno == EINTR)
+                continue;
+            if(bytesRead <= 0) {
+                getLogger()->error("Cannot read file chunk for socket {}. errno: {}", clientSocket, errno);
+                alive = false;
+                break;
+            }
+            queued += bytesRead;
+            offset += bytesRead;
+            len -= bytesRead;
+        }
+    }
+
+    if(!alive)
+        connection->loop->post([this, connection](){ closeConnection(connection); });
+    return alive;
+}
+
+void EpollNetworkCom::closeConnection(const std::shared_ptr<EpollConnection> &connection) {
+    {
+        auto &table = shard(connection->socket);
+        std::lock_guard<std::mutex> lock(table.mutex);
+        auto it = table.connections.find(connection->socket);
+        if(it == table.connections.end() || it->second != connection)
+            return;
+        table.connections.erase(it);
+    }
+
+    connection->loop->unwatch(connection->socket);
+    connectionClosed(connection->socket);
+
+    StreamQueue dropped;
+    {
+        std::lock_guard<std::mutex> lock(connection->writeMutex);
+        connection->closed = true;
+        settleCompletions(*connection, false);
+        std::swap(dropped, connection->pending);
+        connection->outboundDrained.notify_all();
+        close(connection->socket);
+    }
+    dropped.fail();
+}
+
+void EpollNetworkCom::stopListening() {
+    stopFileTransfers();
+    stopImageTransfers();
+    timers.stop();
+    connector.stop();
+    stopSharedRings();
+    if(!isListeningLocally)
+        return;
+
+    getLogger()->info("Disconnecting from all peers and stopping event loops.");
+    for(auto &loop : loops)
+        loop->stop();
+
+    //The loops are gone, completions of frames that never left are called from here
+    std::vector<std::function<void(bool)>> dropped;
+    std::vector<StreamQueue> droppedFrames;
+    for(auto &table : shards) {
+        std::lock_guard<std::mutex> lock(table.mutex);
+        for(auto &[clientSocket, connection] : table.connections) {
+            std::lock_guard<std::mutex> writeLock(connection->writeMutex);
+            connection->closed = true;
+            for(auto &completion : connection->completions)
+                dropped.push_back(std::move(completion.second));
+            connection->completions.clear();
+            droppedFrames.push_back(std::move(connection->pending));
+            connection->pending = StreamQueue();
+            connection->outboundDrained.notify_all();
+            close(clientSocket);
+        }
+        table.connections.clear();
+    }
+    for(auto &done : dropped)
+        done(false);
+    for(auto &frames : droppedFrames)
+        frames.fail();
+    clearPeers();
+    for(int listeningSocket : listeningSockets)
+        close(listeningSocket);
+    listeningSockets.clear();
+    closeUnixListeningSocket();
+    isListeningLocally = false;
+    getLogger()->info("Networking stopped!");
+}
@@ -0,0 +1,77 @@
+#ifndef P2PCHAT_REACTOR_H
+#define P2PCHAT_REACTOR_H
+
+#include "networking.h"
+#include "eventloop.h"
+
+#include <array>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+
+struct EpollConnection {
+    int socket;
+    EventLoop *loop;
+    std::vector<uint8_t> inbound;   //bytes received but not yet parsed, touched only on the loop thread
+
+    std::mutex writeMutex;
+    std::condition_variable outboundDrained;  //file chunks wait for it instead of piling up in outbound
+    std::vector<uint8_t> outbound;  //bytes of a started frame the kernel did not accept yet
+    StreamQueue pending;            //frames waiting behind outbound, they leave stream by stream
+    size_t outboundOffset = 0;
+    std::shared_ptr<const PassedDescriptor> outboundDescriptor;  //of the frame in outbound, none of it left yet
+    std::deque<std::pair<size_t, std::function<void(bool)>>> completions;  //end of a frame in outbound -> its completion
+    bool closed = false;
+
+    EpollConnection(int socket, EventLoop *loop) : socket(socket), loop(loop) {}
+};
+
+#define CONNECTION_SHARDS 64  //of the socket -> connection table, each with a lock of its own
+
+/*
+ Edge-triggered epoll engine. Sockets are non-blocking and every connection is owned by
+ one of ioThreads event loops, so the number of threads no longer grows with the number of peers.
+ With reusePort each loop accepts on a listening socket of its own and keeps what it accepted.
+ */
+class EpollNetworkCom : public NetworkCom {
+private:
+    struct ConnectionShard {
+        std::mutex mutex;
+        std::unordered_map<int, std::shared_ptr<EpollConnection>> connections;
+    };
+
+    std::vector<std::unique_ptr<EventLoop>> loops;
+    std::vector<int> listeningSockets;  //one per loop with reusePort, localSocket is the first
+    std::atomic<size_t> nextLoop;
+    std::array<ConnectionShard, CONNECTION_SHARDS> shards;
+
+    ConnectionShard &shard(int clientSocket);
+    std::shared_ptr<EpollConnection> findConnection(int clientSocket);
+    void acceptConnections(int listeningSocket, EventLoop *owner);
+    void attachToLoop(int clientSocket, EventLoop *loop);
+    void handleEvents(const std::shared_ptr<EpollConnection> &connection, uint32_t events);
+    bool readAvailable(EpollConnection &connection);
+    bool processFrames(EpollConnection &connection);
+    bool flushOutbound(EpollConnection &connection);
+    bool sendDirect(EpollConnection &connection, const OutboundFrame &frame, size_t &written);
+    bool sendOrKeep(EpollConnection &connection, OutboundFrame &frame);
+    void settleCompletions(EpollConnection &connection, bool sent);
+    void closeConnection(const std::shared_ptr<EpollConnection> &connection);
+
+protected:
+    void startListening() override;
+    void attachConnection(int clientSocket) override;
+    void writeMessage(int clientSocket, OutboundFrame &frame) override;
+    bool writeFileChunk(int clientSocket, OutboundFrame &frame, int fileFd, off_t offset, size_t len) override;
+
+public:
+    EpollNetworkCom(int _localPort, UiCallbacks *_uiCallbacks, const NetConfig &_config);
+    ~EpollNetworkCom() override;
+
+    void start() override;
+    void stopListening() override;
+};
+
+#endif
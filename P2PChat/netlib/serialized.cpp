@@ -0,0 +1,101 @@
+#include "networking.h"
+#include "logging.h"
+
+PreparedMessage::PreparedMessage(const NetConfig &_config, std::unique_ptr<Message> _message) :
+        config(_config), message(std::move(_message)) {}
+
+size_t PreparedMessage::size() const {
+    if(message->header.type == MessageType::TEXT)
+        return static_cast<const TextMessage&>(*message).text.size();
+    return static_cast<const ImageMessage&>(*message).image->size();
+}
+
+const EncodedBody *PreparedMessage::body(int variant) const {
+    std::call_once(encoded[variant], [this, variant](){
+        valid[variant] = encodeBody(config, *message, variant, bodies[variant]);
+    });
+    return valid[variant] ? &bodies[variant] : nullptr;
+}
+
+//A copy of the message, except for the image, which is shared like sendMessage() does
+std::shared_ptr<const PreparedMessage> NetworkCom::prepare(const Message &message) {
+    std::unique_ptr<Message> copy;
+    if(message.header.type == MessageType::TEXT)
+        copy = std::make_unique<TextMessage>(dynamic_cast<const TextMessage&>(message).text);
+    else if(message.header.type == MessageType::IMAGE)
+        copy = std::make_unique<ImageMessage>(dynamic_cast<const ImageMessage&>(message).image);
+    else
+        return nullptr;
+    auto prepared = std::make_shared<PreparedMessage>(config, std::move(copy));
+    //What peers of our own version get, the other variants when a peer first needs them. Those get big images in chunks
+    if(config.imageChunkSize == 0 || prepared->size() <= config.imageChunkSize)
+        prepared->body(BODY_IMAGE_BYTES | (config.compression ? BODY_ZLIB : 0));
+    return prepared;
+}
+
+std::shared_ptr<const SerializedMessage> NetworkCom::serialize(const Message &message) {
+    auto prepared = prepare(message);
+    if(prepared == nullptr)
+        getLogger()->warn("Only TEXT and IMAGE messages can be serialized ahead.");
+    return prepared;
+}
+
+void NetworkCom::sendMessage(const std::string &peerName, const std::shared_ptr<const SerializedMessage> &message,
+                             SendCompletion completion) {
+    auto prepared = std::dynamic_pointer_cast<const PreparedMessage>(message);
+    int clientSocket = getClientSocket(peerName);
+    if(prepared == nullptr || clientSocket < 0) {
+        getLogger()->warn("Invalid peer with name: {}, or message not serialized by netlib", peerName);
+        if(completion != nullptr)
+            completion(false);
+        return;
+    }
+    sendPrepared(peerName, clientSocket, prepared, std::move(completion));
+}
+
+/*
+ Every peer gets a frame of its own (header, sequence number) around the body of its variant, which
+ the frames share with the PreparedMessage and keep alive. Images that go in chunks are the exception:
+ their chunks belong to a transfer of one peer and are encoded for it.
+ */
+void NetworkCom::sendPrepared(const std::string &peerName, int clientSocket,
+                              const std::shared_ptr<const PreparedMessage> &prepared, SendCompletion completion) {
+    if(prepared->type() == MessageType::IMAGE && config.imageChunkSize > 0 &&
+       prepared->size() > config.imageChunkSize && peerWireVersion(clientSocket) >= 6) {
+        sendImage(clientSocket, peerName, static_cast<const ImageMessage&>(prepared->original()), std::move(completion));
+        return;
+    }
+
+    getLogger()->info("Sending serialized message to peer: {}", peerName);
+    auto peer = peers.context(clientSocket);
+    std::lock_guard<std::recursive_mutex> lock(peer->sendMutex);
+    OutboundFrame frame;
+    frame.completion = std::move(completion);
+    const EncodedBody *body = prepared->body(bodyVariant(clientSocket));
+    if(body == nullptr || !frameBody(clientSocket, prepared->type(), *body, prepared, frame)) {
+        frame.complete(false);
+        return;
+    }
+    writeFragments(clientSocket, frame);
+}
+
+void NetworkCom::broadcast(const std::vector<std::string> &peerNames, const Message &message) {
+    broadcast(peerNames, message, nullptr);
+}
+
+//TEXT and IMAGE are serialized once for all of them, other messages go to each peer with sendMessage()
+void NetworkCom::broadcast(const std::vector<std::string> &peerNames, const Message &message,
+                           BroadcastCompletion completion) {
+    auto prepared = prepare(message);
+    getLogger()->info("Broadcasting a message to {} peers", peerNames.size());
+    for(auto &peerName : peerNames) {
+        SendCompletion done;
+        if(completion != nullptr)
+            done = [completion, peerName](bool sent){ completion(peerName, sent); };
+        int clientSocket = getClientSocket(peerName);
+        if(prepared == nullptr || clientSocket < 0)
+            sendMessage(peerName, message, std::move(done));
+        else
+            sendPrepared(peerName, clientSocket, prepared, std::move(done));
+    }
+}
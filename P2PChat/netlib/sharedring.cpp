@@ -0,0 +1,402 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <climits>
+#include <ctime>
+
+#include <algorithm>
+#include <bit>
+#include <future>
+#include <new>
+#include <random>
+
+#include "sharedring.h"
+#include "threading.h"
+#include "logging.h"
+
+//The indices of a ring and the futex of its writer, each written by one side only, on lines of their own
+struct RingSide {
+    alignas(64) std::atomic<uint64_t> head;      //bytes the owner of this side wrote into its ring
+    alignas(64) std::atomic<uint64_t> tail;      //bytes the other side read of them
+    alignas(64) std::atomic<uint32_t> doorbell;  //the owner sleeps on it, the other side bumps it
+    std::atomic<uint32_t> sleepers;
+};
+
+struct RingSegment {
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t capacity;
+    RingSide sides[2];
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<uint32_t>::is_always_lock_free,
+              "The rings are shared with another process");
+
+static size_t segmentHeaderLength() {
+    size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    return (sizeof(RingSegment) + page - 1) / page * page;
+}
+
+//Not FUTEX_PRIVATE: the word lives in memory shared with the peer's process
+static long futex(std::atomic<uint32_t> &word, int op, uint32_t value, const timespec *timeout) {
+    return syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), op, value, timeout, nullptr, 0);
+}
+
+SharedRing::~SharedRing() {
+    unlink();
+    if(segment != nullptr)
+        munmap(segment, mappedLength);
+}
+
+bool SharedRing::map(int fd, size_t length) {
+    void *memory = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(memory == MAP_FAILED) {
+        getLogger()->warn("Cannot map shared ring {}. errno: {}", segmentName, errno);
+        return false;
+    }
+    segment = static_cast<RingSegment*>(memory);
+    mappedLength = length;
+    rings[0] = static_cast<uint8_t*>(memory) + segmentHeaderLength();
+    rings[1] = rings[0] + capacity;
+    return true;
+}
+
+std::unique_ptr<SharedRing> SharedRing::create(size_t capacity) {
+    static std::atomic<uint32_t> created{0};
+    std::unique_ptr<SharedRing> ring(new SharedRing());
+    ring->capacity = std::bit_ceil(std::clamp<size_t>(capacity, SHARED_RING_MIN_SIZE, SHARED_RING_MAX_SIZE));
+    ring->side = 0;
+    //Not guessable, so no other local user gets to the name before us (O_EXCL makes sure)
+    ring->segmentName = "/p2pchat-" + std::to_string(getpid()) + "-" + std::to_string(created++) + "-" +
+                        std::to_string(std::random_device{}());
+    int fd = shm_open(ring->segmentName.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if(fd < 0) {
+        getLogger()->warn("Cannot create shared ring {}. errno: {}", ring->segmentName, errno);
+        ring->segmentName.clear();
+        return nullptr;
+    }
+    size_t length = segmentHeaderLength() + 2 * ring->capacity;
+    //Allocated now: a full /dev/shm would otherwise be a SIGBUS in the middle of a copy
+    int error = ftruncate(fd, static_cast<off_t>(length)) < 0 ? errno : posix_fallocate(fd, 0, static_cast<off_t>(length));
+    bool mapped = error == 0 && ring->map(fd, length);
+    close(fd);
+    if(error != 0)
+        getLogger()->warn("Cannot allocate {} bytes for shared ring {}. errno: {}", length, ring->segmentName, error);
+    if(!mapped)
+        return nullptr;
+
+    new(ring->segment) RingSegment{};
+    ring->segment->capacity = ring->capacity;
+    ring->segment->magic = SHARED_RING_MAGIC;
+    return ring;
+}
+
+std::unique_ptr<SharedRing> SharedRing::open(const std::string &name, size_t capacity) {
+    if(name.empty() || name.find('/', 1) != std::string::npos || !std::has_single_bit(capacity) ||
+       capacity < SHARED_RING_MIN_SIZE || capacity > SHARED_RING_MAX_SIZE) {
+        getLogger()->warn("Refusing shared ring {} of {} bytes", name, capacity);
+        return nullptr;
+    }
+    int fd = shm_open(name.c_str(), O_RDWR | O_CLOEXEC, 0);
+    if(fd < 0) {
+        getLogger()->warn("Cannot open shared ring {}. errno: {}", name, errno);
+        return nullptr;
+    }
+    std::unique_ptr<SharedRing> ring(new SharedRing());
+    ring->capacity = capacity;
+    ring->side = 1;
+    size_t length = segmentHeaderLength() + 2 * capacity;
+    struct stat segmentStat{};
+    bool mapped = fstat(fd, &segmentStat) == 0 && static_cast<size_t>(segmentStat.st_size) == length &&
+                  ring->map(fd, length);
+    close(fd);
+    if(!mapped || ring->segment->magic != SHARED_RING_MAGIC || ring->segment->capacity != capacity) {
+        getLogger()->warn("Shared ring {} is not what its peer announced", name);
+        return nullptr;
+    }
+    return ring;
+}
+
+void SharedRing::unlink() {
+    if(segmentName.empty() || side != 0)
+        return;
+    if(shm_unlink(segmentName.c_str()) < 0 && errno != ENOENT)
+        getLogger()->warn("Cannot unlink shared ring {}. errno: {}", segmentName, errno);
+    segmentName.clear();
+}
+
+size_t SharedRing::space() const {
+    auto &ours = segment->sides[side];
+    return capacity - (ours.head.load(std::memory_order_relaxed) - ours.tail.load(std::memory_order_acquire));
+}
+
+void SharedRing::put(size_t at, const void *data, size_t len) {
+    iovec iov[2];
+    int count = spans(at, len, iov);
+    auto bytes = static_cast<const uint8_t*>(data);
+    for(int i=0; i<count; i++) {
+        std::copy_n(bytes, iov[i].iov_len, static_cast<uint8_t*>(iov[i].iov_base));
+        bytes += iov[i].iov_len;
+    }
+}
+
+int SharedRing::spans(size_t at, size_t len, iovec *iov) {
+    size_t start = (segment->sides[side].head.load(std::memory_order_relaxed) + at) & (capacity - 1);
+    size_t first = std::min(len, capacity - start);
+    iov[0] = {rings[side] + start, first};
+    if(first == len)
+        return 1;
+    iov[1] = {rings[side], len - first};
+    return 2;
+}
+
+void SharedRing::commit(size_t len) {
+    auto &head = segment->sides[side].head;
+    head.store(head.load(std::memory_order_relaxed) + len, std::memory_order_release);
+    wakePeer();
+}
+
+size_t SharedRing::peek(const uint8_t *&data) const {
+    auto &theirs = segment->sides[1 - side];
+    uint64_t tail = theirs.tail.load(std::memory_order_relaxed);
+    size_t start = tail & (capacity - 1);
+    data = rings[1 - side] + start;
+    return std::min<size_t>(theirs.head.load(std::memory_order_acquire) - tail, capacity - start);
+}
+
+void SharedRing::release(size_t len) {
+    auto &tail = segment->sides[1 - side].tail;
+    tail.store(tail.load(std::memory_order_relaxed) + len, std::memory_order_release);
+    //The peer may wait for that room
+    wakePeer();
+}
+
+uint32_t SharedRing::doorbell() const {
+    return segment->sides[side].doorbell.load();
+}
+
+//A bump after seen was loaded makes the futex return at once, and a bump that did not see us
+//sleeping came before we counted ourselves in, so it changed the word before FUTEX_WAIT compares it
+void SharedRing::wait(uint32_t seen, int timeoutMs) {
+    auto &ours = segment->sides[side];
+    timespec timeout{timeoutMs / 1000, (timeoutMs % 1000) * 1000000L};
+    ours.sleepers.fetch_add(1);
+    futex(ours.doorbell, FUTEX_WAIT, seen, &timeout);
+    ours.sleepers.fetch_sub(1);
+}
+
+void SharedRing::wakePeer() {
+    auto &theirs = segment->sides[1 - side];
+    theirs.doorbell.fetch_add(1);
+    if(theirs.sleepers.load() > 0)
+        futex(theirs.doorbell, FUTEX_WAKE, INT_MAX, nullptr);
+}
+
+void SharedRing::wakeSelf() {
+    auto &ours = segment->sides[side];
+    ours.doorbell.fetch_add(1);
+    if(ours.sleepers.load() > 0)
+        futex(ours.doorbell, FUTEX_WAKE, INT_MAX, nullptr);
+}
+
+RingLink::RingLink(std::unique_ptr<SharedRing> ring, Consumer consume, std::function<void()> broken) :
+        ring(std::move(ring)), consume(std::move(consume)), broken(std::move(broken)) {}
+
+RingLink::~RingLink() {
+    stop(false);
+}
+
+void RingLink::start(const std::string &threadName, const std::vector<int> &cpus) {
+    thread = std::thread([this, threadName, cpus](){
+        setupThread(threadName, cpus);
+        this->run();
+    });
+}
+
+void RingLink::startReading() {
+    reading = true;
+    ring->wakeSelf();
+}
+
+//Bytes of the frame after offset that fit, already published
+size_t RingLink::copyFrame(const OutboundFrame &frame, size_t offset) {
+    size_t room = ring->space();
+    size_t copied = 0;
+    iovec iov[2];
+    int count = frame.iovecs(offset, iov);
+    for(int i=0; i<count && copied < room; i++) {
+        size_t len = std::min(iov[i].iov_len, room - copied);
+        ring->put(copied, iov[i].iov_base, len);
+        copied += len;
+    }
+    if(copied > 0)
+        ring->commit(copied);
+    return copied;
+}
+
+void RingLink::write(OutboundFrame &frame) {
+    std::unique_lock<std::mutex> lock(outMutex);
+    if(stopped) {
+        lock.unlock();
+        frame.complete(false);
+        return;
+    }
+    size_t offset = 0;
+    if(pending.empty()) {
+        offset = copyFrame(frame, 0);
+        if(offset == frame.size()) {
+            //Not here: the caller may still hold its send lock
+            if(frame.completion != nullptr) {
+                finished.push_back(std::move(frame.completion));
+                ring->wakeSelf();
+            }
+            return;
+        }
+        pendingOffset = offset;
+    }
+    frame.own();
+    pending.push_back(std::move(frame));
+    ring->wakeSelf();
+}
+
+bool RingLink::writeFileChunk(OutboundFrame &frame, int fileFd, off_t offset, size_t len) {
+    {
+        std::lock_guard<std::mutex> lock(outMutex);
+        if(stopped)
+            return false;
+        if(pending.empty() && ring->space() >= frame.size() + len) {
+            ring->put(0, frame.head, frame.headLength);
+            iovec iov[2];
+            int count = ring->spans(frame.headLength, len, iov);
+            for(int i=0; i<count; i++) {
+                auto target = static_cast<uint8_t*>(iov[i].iov_base);
+                for(size_t filled = 0; filled < iov[i].iov_len; ) {
+                    ssize_t bytesRead = pread(fileFd, target + filled, iov[i].iov_len - filled, offset);
+                    if(bytesRead < 0 && errno == EINTR)
+                        continue;
+                    if(bytesRead <= 0) {
+                        //Nothing was committed, the ring is as it was
+                        getLogger()->error("Cannot read file chunk for the shared ring. errno: {}", errno);
+                        return false;
+                    }
+                    filled += bytesRead;
+                    offset += bytesRead;
+                }
+            }
+            ring->commit(frame.headLength + len);
+            return true;
+        }
+    }
+
+    //No room, the chunk waits in memory and we wait for it like for a socket that is full
+    auto chunk = std::make_shared<std::vector<uint8_t>>(len);
+    for(size_t filled = 0; filled < len; ) {
+        ssize_t bytesRead = pread(fileFd, chunk->data() + filled, len - filled, offset + static_cast<off_t>(filled));
+        if(bytesRead < 0 && errno == EINTR)
+            continue;
+        if(bytesRead <= 0) {
+            getLogger()->error("Cannot read file chunk for the shared ring. errno: {}", errno);
+            return false;
+        }
+        filled += bytesRead;
+    }
+    std::promise<bool> written;
+    frame.payload = chunk->data();
+    frame.payloadLength = len;
+    frame.storage = std::move(chunk);
+    frame.completion = [&written](bool sent){ written.set_value(sent); };
+    auto result = written.get_future();
+    write(frame);
+    return result.get();
+}
+
+//Hands what the peer wrote to consume, keeping a frame that is not complete (or wraps around) for later
+bool RingLink::drain() {
+    const uint8_t *data;
+    size_t len = ring->peek(data);
+    if(len == 0)
+        return false;
+    bool valid = true;
+    if(inbound.empty()) {
+        size_t used = consume(data, len, valid);
+        if(valid)
+            inbound.assign(data + used, data + len);
+    } else {
+        inbound.insert(inbound.end(), data, data + len);
+        size_t used = consume(inbound.data(), inbound.size(), valid);
+        inbound.erase(inbound.begin(), inbound.begin() + static_cast<ptrdiff_t>(used));
+    }
+    ring->release(len);
+    if(!valid) {
+        reading = false;
+        inbound.clear();
+        broken();
+    }
+    return true;
+}
+
+bool RingLink::flush() {
+    std::vector<std::function<void(bool)>> done;
+    bool progress = false;
+    {
+        std::lock_guard<std::mutex> lock(outMutex);
+        while(!pending.empty()) {
+            auto &frame = pending.front();
+            size_t copied = copyFrame(frame, pendingOffset);
+            progress = progress || copied > 0;
+            pendingOffset += copied;
+            if(pendingOffset < frame.size())
+                break;
+            if(frame.completion != nullptr)
+                finished.push_back(std::move(frame.completion));
+            pending.pop_front();
+            pendingOffset = 0;
+        }
+        done.swap(finished);
+    }
+    for(auto &completion : done)
+        completion(true);
+    return progress || !done.empty();
+}
+
+void RingLink::run() {
+    while(running) {
+        uint32_t seen = ring->doorbell();
+        bool progress = reading && drain();
+        progress = flush() || progress;
+        if(!progress && running)
+            ring->wait(seen, SHARED_RING_WAIT_MS);
+    }
+    //What the peer wrote before it closed the connection still arrives before the disconnection
+    while(drainOnStop && reading && drain());
+}
+
+void RingLink::stop(bool drain) {
+    {
+        std::lock_guard<std::mutex> lock(outMutex);
+        if(stopped)
+            return;
+        stopped = true;
+        drainOnStop = drain;
+    }
+    running = false;
+    ring->wakeSelf();
+    if(thread.joinable() && thread.get_id() != std::this_thread::get_id())
+        thread.join();
+
+    std::deque<OutboundFrame> dropped;
+    std::vector<std::function<void(bool)>> done;
+    {
+        std::lock_guard<std::mutex> lock(outMutex);
+        dropped.swap(pending);
+        done.swap(finished);
+    }
+    for(auto &completion : done)
+        completion(true);
+    for(auto &frame : dropped)
+        frame.complete(false);
+}
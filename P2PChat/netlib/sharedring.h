@@ -0,0 +1,129 @@
+#ifndef P2PCHAT_SHAREDRING_H
+#define P2PCHAT_SHAREDRING_H
+
+#include "framing.h"
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define SHARED_RING_MAGIC    0x52503250  //"P2PR"
+#define SHARED_RING_MIN_SIZE (1024 * 1024)
+#define SHARED_RING_MAX_SIZE (256u * 1024 * 1024)
+#define SHARED_RING_WAIT_MS  100  //a sleeping side looks again by then, should a wakeup get lost
+
+struct RingSegment;
+
+/*
+ A POSIX shared memory segment with two single-producer single-consumer byte rings, one per
+ direction, for a peer on the same host. Side 0 created the segment and writes the first ring,
+ side 1 opened it and writes the second. head and tail only grow, so they tell full from empty.
+ Either side sleeps on a futex in the segment, the other one bumps it (and only calls into the
+ kernel when there is a sleeper) after it wrote or read.
+ */
+class SharedRing {
+private:
+    std::string segmentName;  //empty once unlinked
+    RingSegment *segment = nullptr;
+    size_t mappedLength = 0;
+    uint8_t *rings[2] = {nullptr, nullptr};
+    size_t capacity = 0;
+    int side = 0;
+
+    SharedRing() = default;
+    bool map(int fd, size_t length);
+
+public:
+    ~SharedRing();
+    SharedRing(const SharedRing&) = delete;
+    SharedRing& operator=(const SharedRing&) = delete;
+
+    //capacity is rounded up to a power of two between the SHARED_RING_*_SIZE limits. Null on failure
+    static std::unique_ptr<SharedRing> create(size_t capacity);
+    static std::unique_ptr<SharedRing> open(const std::string &name, size_t capacity);
+    const std::string &name() const { return segmentName; }
+    size_t size() const { return capacity; }
+    //Removes the name, both sides keep their mappings
+    void unlink();
+
+    //Writing our ring: space() bytes may be put at offsets from the current head, commit() publishes them
+    size_t space() const;
+    void put(size_t at, const void *data, size_t len);
+    //At most 2 iovecs over len bytes of free space starting at offset at, to read into directly
+    int spans(size_t at, size_t len, iovec *iov);
+    void commit(size_t len);
+
+    //Reading the peer's ring: the bytes up to its end or to the wrap-around
+    size_t peek(const uint8_t *&data) const;
+    void release(size_t len);
+
+    uint32_t doorbell() const;  //load it before looking for work, then wait() with it
+    void wait(uint32_t seen, int timeoutMs);
+    void wakePeer();
+    void wakeSelf();
+};
+
+/*
+ One side of a connection that moved to a SharedRing. Writers (serialized by the caller, see
+ NetworkCom::transmit) copy frames into our ring right away, a frame that does not fit waits
+ here and the link thread copies it once the peer made room. The link thread also reads the
+ peer's ring and hands what arrived to consume, just like a socket reader.
+ Completions run on the link thread.
+ */
+class RingLink {
+public:
+    //Bytes of whole frames it took, clears valid when the stream cannot be read on
+    using Consumer = std::function<size_t(const uint8_t *data, size_t len, bool &valid)>;
+
+private:
+    std::unique_ptr<SharedRing> ring;
+    Consumer consume;
+    std::function<void()> broken;  //the peer's ring holds garbage, close the connection
+    std::thread thread;
+    std::atomic<bool> running{true};
+    std::atomic<bool> reading{false};
+    std::atomic<bool> writing{false};
+    bool drainOnStop = false;
+    std::vector<uint8_t> inbound;  //the start of a frame that wrapped around, or is bigger than what arrived
+
+    std::mutex outMutex;  //of the producer side of our ring and everything below
+    std::deque<OutboundFrame> pending;
+    size_t pendingOffset = 0;  //bytes of the front frame already in the ring
+    std::vector<std::function<void(bool)>> finished;  //completions of frames that are in the ring
+    bool stopped = false;
+
+    size_t copyFrame(const OutboundFrame &frame, size_t offset);
+    bool drain();
+    bool flush();
+    void run();
+
+public:
+    RingLink(std::unique_ptr<SharedRing> ring, Consumer consume, std::function<void()> broken);
+    ~RingLink();
+    RingLink(const RingLink&) = delete;
+    RingLink& operator=(const RingLink&) = delete;
+
+    void start(const std::string &threadName, const std::vector<int> &cpus);
+    SharedRing &sharedRing() { return *ring; }
+    //Frames go to the ring from now on. They are written under the peer's transmit lock, so is this
+    void startWriting() { writing = true; }
+    bool isWriting() const { return writing; }
+    void startReading();
+
+    void write(OutboundFrame &frame);
+    //Like NetworkCom::writeFileChunk(), reads the file straight into the ring when it has room
+    bool writeFileChunk(OutboundFrame &frame, int fileFd, off_t offset, size_t len);
+    //Ends the thread after it read what the peer wrote, with drain, and fails the frames still waiting.
+    //Never from a completion or the consumer
+    void stop(bool drain);
+};
+
+#endif
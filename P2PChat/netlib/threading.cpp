@@ -0,0 +1,32 @@
+#include <pthread.h>
+#include <sched.h>
+
+#include "threading.h"
+#include "logging.h"
+
+#define THREAD_NAME_MAX_LEN 15
+
+void setupThread(const std::string &name, const std::vector<int> &cpus) {
+    std::string shortName = name.substr(0, THREAD_NAME_MAX_LEN);
+    int status = pthread_setname_np(pthread_self(), shortName.c_str());
+    if(status != 0)
+        getLogger()->warn("Cannot name thread {}. errno: {}", shortName, status);
+    if(cpus.empty())
+        return;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for(int cpu : cpus) {
+        if(cpu >= 0 && cpu < CPU_SETSIZE)
+            CPU_SET(cpu, &set);
+    }
+    status = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if(status != 0)
+        getLogger()->warn("Cannot pin thread {} to its {} CPUs. errno: {}", shortName, cpus.size(), status);
+}
+
+std::vector<int> nthCpu(const std::vector<int> &cpus, size_t n) {
+    if(cpus.empty())
+        return {};
+    return {cpus[n % cpus.size()]};
+}
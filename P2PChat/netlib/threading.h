@@ -0,0 +1,16 @@
+#ifndef P2PCHAT_THREADING_H
+#define P2PCHAT_THREADING_H
+
+#include <string>
+#include <vector>
+
+/*
+ Names the calling thread, which shows up in /proc/<pid>/task/<tid>/comm (cut to 15 characters),
+ and keeps it on the given CPUs. An empty list leaves it to the scheduler.
+ */
+void setupThread(const std::string &name, const std::vector<int> &cpus);
+
+//The n-th CPU of cpus, for groups whose threads get one core each, or all of them when cpus is empty
+std::vector<int> nthCpu(const std::vector<int> &cpus, size_t n);
+
+#endif
@@ -0,0 +1,130 @@
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <algorithm>
+
+#include "networking.h"
+#include "logging.h"
+
+/*
+ Every connection has one watchdog timer on the TimerWheel. When it fires it looks at the
+ timestamps the readers leave in the PeerLink, closes the connection if a deadline passed,
+ sends a PING when one is due and schedules itself for the next deadline. Readers only store
+ a timestamp per frame, they never touch the wheel. A connection is closed with shutdown(),
+ so the engine that owns it notices, cleans up and reports it like any other disconnection.
+ Write timeouts are left to the kernel with TCP_USER_TIMEOUT, which also covers a peer that
+ stopped reading: nothing of ours gets acknowledged then. AF_UNIX connections have no such thing.
+ */
+
+using Clock = std::chrono::steady_clock;
+
+void NetworkCom::watchConnection(int clientSocket, bool accepted) {
+    if(config.writeTimeout > 0 && !isUnixSocket(clientSocket)) {
+        unsigned int timeout = config.writeTimeout;
+        if(setsockopt(clientSocket, IPPROTO_TCP, TCP_USER_TIMEOUT, &timeout, sizeof(timeout)) < 0)
+            getLogger()->warn("Cannot set the write timeout of socket {}. errno: {}", clientSocket, errno);
+    }
+
+    //How often the watchdog looks when no deadline is closer, e.g. before a frame started to arrive
+    uint32_t period = 0;
+    for(uint32_t timeout : {config.authTimeout, config.readTimeout, config.keepaliveInterval, config.idleTimeout}) {
+        if(timeout > 0)
+            period = period == 0 ? timeout : std::min(period, timeout);
+    }
+    if(period == 0)
+        return;
+
+    auto peer = peers.context(clientSocket);
+    std::weak_ptr<PeerContext> watched = peer;
+    std::lock_guard<std::mutex> lock(peer->mutex);
+    auto &link = peer->link;
+    link.awaitingAuth = accepted;
+    link.connected = link.lastReceived = link.lastPing = Clock::now();
+    link.watchdog = timers.schedule(period, [this, clientSocket, watched](){ checkConnection(clientSocket, watched); });
+}
+
+void NetworkCom::checkConnection(int clientSocket, const std::weak_ptr<PeerContext> &watched) {
+    //The socket number may belong to a newer connection by now
+    auto peer = watched.lock();
+    if(peer == nullptr || peers.find(clientSocket) != peer)
+        return;
+
+    auto now = Clock::now();
+    auto deadline = [](Clock::time_point since, uint32_t timeout){ return since + std::chrono::milliseconds(timeout); };
+    uint32_t period = 0;
+    for(uint32_t timeout : {config.authTimeout, config.readTimeout, config.keepaliveInterval, config.idleTimeout}) {
+        if(timeout > 0)
+            period = period == 0 ? timeout : std::min(period, timeout);
+    }
+    auto next = deadline(now, period);
+    const char *expired = nullptr;
+    bool ping = false;
+    std::string peerName;
+    {
+        std::lock_guard<std::mutex> lock(peer->mutex);
+        auto &link = peer->link;
+        if(link.closed)
+            return;
+        peerName = peer->name;
+        if(link.awaitingAuth && !peer->name.empty())
+            link.awaitingAuth = false;
+        if(link.awaitingAuth && config.authTimeout > 0) {
+            if(now >= deadline(link.connected, config.authTimeout))
+                expired = "no AUTH";
+            next = std::min(next, deadline(link.connected, config.authTimeout));
+        }
+        if(link.frameStarted != Clock::time_point() && config.readTimeout > 0) {
+            if(now >= deadline(link.frameStarted, config.readTimeout))
+                expired = "a frame stalled";
+            next = std::min(next, deadline(link.frameStarted, config.readTimeout));
+        }
+        //Older peers do not send PINGs, an idle one is fine
+        bool keepalive = link.wireVersion >= 7;
+        if(keepalive && config.idleTimeout > 0) {
+            if(now >= deadline(link.lastReceived, config.idleTimeout))
+                expired = "idle";
+            next = std::min(next, deadline(link.lastReceived, config.idleTimeout));
+        }
+        if(keepalive && config.keepaliveInterval > 0) {
+            if(now >= deadline(link.lastPing, config.keepaliveInterval)) {
+                ping = true;
+                link.lastPing = now;
+            }
+            next = std::min(next, deadline(link.lastPing, config.keepaliveInterval));
+        }
+        if(expired == nullptr) {
+            auto delay = std::chrono::duration_cast<std::chrono::milliseconds>(next - now).count();
+            link.watchdog = timers.schedule(static_cast<uint32_t>(std::max<int64_t>(delay, 1)),
+                                            [this, clientSocket, watched](){ checkConnection(clientSocket, watched); });
+        }
+    }
+
+    if(expired != nullptr) {
+        getLogger()->warn("Closing the connection to {} (socket {}): {}", peerName, clientSocket, expired);
+        shutdown(clientSocket, SHUT_RDWR);
+        return;
+    }
+    if(ping)
+        sendPing(clientSocket);
+}
+
+//Readers call this when they hold part of a frame, receiveFrame() clears it
+void NetworkCom::frameStarting(int clientSocket) {
+    if(config.readTimeout == 0)
+        return;
+    auto peer = peers.find(clientSocket);
+    if(peer == nullptr)
+        return;
+    std::lock_guard<std::mutex> lock(peer->mutex);
+    if(peer->link.frameStarted == Clock::time_point())
+        peer->link.frameStarted = Clock::now();
+}
+
+void NetworkCom::sendPing(int clientSocket) {
+    auto peer = peers.context(clientSocket);
+    std::lock_guard<std::recursive_mutex> lock(peer->sendMutex);
+    OutboundFrame frame;
+    if(finishFrame(clientSocket, MessageType::PING, nullptr, 0, frame))
+        transmit(clientSocket, frame);
+}
@@ -0,0 +1,115 @@
+#include "timerwheel.h"
+#include "threading.h"
+
+#include <algorithm>
+
+#define TIMER_WHEEL_SLOTS   (uint64_t(1) << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK    (TIMER_WHEEL_SLOTS - 1)
+
+TimerWheel::TimerWheel(const std::vector<int> &cpus) : start(std::chrono::steady_clock::now()) {
+    thread = std::thread([this, cpus](){
+        setupThread("p2p-timers", cpus);
+        run();
+    });
+}
+
+TimerWheel::~TimerWheel() {
+    stop();
+}
+
+TimerHandle TimerWheel::schedule(uint32_t delayMs, std::function<void()> callback) {
+    auto timer = std::make_shared<TimerEntry>();
+    timer->callback = std::move(callback);
+    uint64_t ticks = std::max<uint64_t>((uint64_t(delayMs) + TIMER_TICK_MS - 1) / TIMER_TICK_MS, 1);
+    std::lock_guard<std::mutex> lock(mutex);
+    timer->expiry = currentTick + ticks;
+    if(running)
+        place(timer);
+    return timer;
+}
+
+void TimerWheel::cancel(const TimerHandle &timer) {
+    //The entry stays in its slot until the wheel gets there, then it is dropped
+    if(timer != nullptr)
+        timer->cancelled = true;
+}
+
+void TimerWheel::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if(!running)
+            return;
+        running = false;
+    }
+    stopping.notify_all();
+    if(thread.joinable())
+        thread.join();
+    std::lock_guard<std::mutex> lock(mutex);
+    for(auto &level : levels) {
+        for(auto &slot : level)
+            slot.clear();
+    }
+}
+
+//The lowest level whose span reaches the expiry, in the slot its bits of the expiry select
+void TimerWheel::place(TimerHandle timer) {
+    uint64_t delta = timer->expiry - currentTick;
+    int level = 0;
+    while(level < TIMER_WHEEL_LEVELS - 1 && delta >= (TIMER_WHEEL_SLOTS << (level * TIMER_WHEEL_BITS)))
+        level++;
+    //Beyond the last level: parked in its farthest slot, placed again when that comes around
+    uint64_t expiry = std::min(timer->expiry, currentTick + (TIMER_WHEEL_MASK << (level * TIMER_WHEEL_BITS)));
+    levels[level][(expiry >> (level * TIMER_WHEEL_BITS)) & TIMER_WHEEL_MASK].push_back(std::move(timer));
+}
+
+void TimerWheel::cascade(int level) {
+    Slot &slot = levels[level][(currentTick >> (level * TIMER_WHEEL_BITS)) & TIMER_WHEEL_MASK];
+    Slot timers;
+    timers.swap(slot);
+    for(auto &timer : timers) {
+        if(!timer->cancelled)
+            place(std::move(timer));
+    }
+}
+
+void TimerWheel::advance(std::vector<TimerHandle> &expired) {
+    currentTick++;
+    //A level is spread over the ones below whenever all of them wrapped around
+    for(int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+        if((currentTick & ((uint64_t(1) << (level * TIMER_WHEEL_BITS)) - 1)) != 0)
+            break;
+        cascade(level);
+    }
+
+    Slot &slot = levels[0][currentTick & TIMER_WHEEL_MASK];
+    for(auto &timer : slot) {
+        if(timer->cancelled)
+            continue;
+        if(timer->expiry <= currentTick)
+            expired.push_back(std::move(timer));
+        else
+            place(std::move(timer));  //parked beyond the last level
+    }
+    slot.clear();
+}
+
+void TimerWheel::run() {
+    std::vector<TimerHandle> expired;
+    std::unique_lock<std::mutex> lock(mutex);
+    while(running) {
+        auto nextTick = start + std::chrono::milliseconds((currentTick + 1) * TIMER_TICK_MS);
+        if(stopping.wait_until(lock, nextTick, [this](){ return !running; }))
+            break;
+        //Catches up tick by tick when callbacks took longer than a tick
+        while(running && std::chrono::steady_clock::now() >= start + std::chrono::milliseconds((currentTick + 1) * TIMER_TICK_MS))
+            advance(expired);
+
+        lock.unlock();
+        for(auto &timer : expired) {
+            if(!timer->cancelled)
+                timer->callback();
+        }
+        expired.clear();
+        lock.lock();
+    }
+}
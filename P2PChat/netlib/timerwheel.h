@@ -0,0 +1,63 @@
+#ifndef P2PCHAT_TIMERWHEEL_H
+#define P2PCHAT_TIMERWHEEL_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define TIMER_TICK_MS       100
+#define TIMER_WHEEL_BITS    6    //64 slots per level
+#define TIMER_WHEEL_LEVELS  4    //64^4 ticks, about 19 days at 100 ms
+
+struct TimerEntry {
+    uint64_t expiry;  //tick
+    std::function<void()> callback;
+    std::atomic<bool> cancelled{false};
+};
+using TimerHandle = std::shared_ptr<TimerEntry>;
+
+/*
+ Hierarchical timer wheel on its own thread. Level 0 has a slot per tick, every slot of the
+ next level covers all of the level below, and a slot is spread over the level below when
+ that one wraps around. Scheduling and cancelling are O(1) no matter how many timers there
+ are, which is what tens of thousands of connection deadlines need. Callbacks run on the
+ timer thread, outside the lock, so they may schedule again; they must not block.
+ */
+class TimerWheel {
+private:
+    using Slot = std::vector<TimerHandle>;
+
+    std::mutex mutex;
+    std::condition_variable stopping;
+    bool running = true;
+    std::chrono::steady_clock::time_point start;
+    uint64_t currentTick = 0;
+    std::array<std::array<Slot, size_t(1) << TIMER_WHEEL_BITS>, TIMER_WHEEL_LEVELS> levels;
+    std::thread thread;
+
+    void place(TimerHandle timer);
+    void cascade(int level);
+    void advance(std::vector<TimerHandle> &expired);
+    void run();
+
+public:
+    explicit TimerWheel(const std::vector<int> &cpus = {});  //the CPUs of the timer thread
+    ~TimerWheel();
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+    //Runs callback after at least delayMs (rounded up to a tick), until it is cancelled
+    TimerHandle schedule(uint32_t delayMs, std::function<void()> callback);
+    static void cancel(const TimerHandle &timer);
+    //Drops every timer without running it and ends the thread
+    void stop();
+};
+
+#endif
@@ -0,0 +1,266 @@
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+
+#include "networking.h"
+#include "messages.pb.h"
+#include "logging.h"
+
+/*
+ Peers on this host may also connect to NetConfig::unixSocketPath. Over such an AF_UNIX connection
+ both sides announce in the AUTH exchange whether they take descriptors, and a big IMAGE or FILE then
+ only sends a small frame: the content is a file descriptor passed with SCM_RIGHTS along with the
+ first byte of that frame. An image is copied once into a sealed memfd, a file is passed as it was
+ opened for sending. The reader queues the descriptors it gets per connection, and since each one
+ arrives no later than its frame, and frames are handled in order, the IMAGE or FILE handler simply
+ takes the oldest. The receiver copies an image once out of the memfd, and a file from file to file
+ in the kernel, instead of reading both through the socket into buffers and protobuf fields.
+ */
+
+#define DESCRIPTORS_PER_READ      4    //a read stops behind the bytes that carried descriptors, ours carry one
+#define RECEIVED_DESCRIPTORS_MAX  256  //waiting for their frames, more are closed right away
+#define ATTACHED_IMAGE_SEALS      (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE)
+
+bool isUnixSocket(int socket) {
+    int domain = 0;
+    socklen_t length = sizeof(domain);
+    return getsockopt(socket, SOL_SOCKET, SO_DOMAIN, &domain, &length) == 0 && domain == AF_UNIX;
+}
+
+int NetworkCom::openUnixListeningSocket(int socketFlags) {
+    const std::string &path = config.unixSocketPath;
+    if(path.empty())
+        return -1;
+    sockaddr_un addr{};
+    if(path.size() >= sizeof(addr.sun_path)) {
+        getLogger()->error("Unix socket path {} is too long.", path);
+        exit(EXIT_FAILURE);
+    }
+    int listeningSocket = socket(AF_UNIX, SOCK_STREAM | socketFlags, 0);
+    if(listeningSocket < 0) {
+        getLogger()->error("socket creation on {} failed. errno: {}", path, errno);
+        exit(EXIT_FAILURE);
+    }
+    addr.sun_family = AF_UNIX;
+    std::memcpy(addr.sun_path, path.c_str(), path.size());
+
+    //Left behind by an instance that did not stop cleanly
+    unlink(path.c_str());
+    if(bind(listeningSocket, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+        getLogger()->error("Failed to bind for socket on {}. errno: {}", path, errno);
+        exit(EXIT_FAILURE);
+    }
+    if(listen(listeningSocket, SOMAXCONN) < 0) {
+        getLogger()->error("Failed to listen on {}. errno: {}", path, errno);
+        exit(EXIT_FAILURE);
+    }
+    getLogger()->info("Waiting for connections on: {}", path);
+    unixSocket = listeningSocket;
+    return listeningSocket;
+}
+
+void NetworkCom::closeUnixListeningSocket() {
+    if(unixSocket < 0)
+        return;
+    shutdown(unixSocket, SHUT_RDWR);
+    close(unixSocket);
+    unixSocket = -1;
+    unlink(config.unixSocketPath.c_str());
+}
+
+void NetworkCom::setPeerDescriptors(int clientSocket, bool announced) {
+    //Only an AF_UNIX socket carries them, whatever the peer says
+    bool takes = announced && isUnixSocket(clientSocket);
+    auto peer = peers.context(clientSocket);
+    std::lock_guard<std::mutex> lock(peer->mutex);
+    peer->link.takesDescriptors = takes;
+}
+
+bool NetworkCom::passesDescriptor(int clientSocket, size_t size) {
+    if(config.passDescriptorMinSize == 0 || size < config.passDescriptorMinSize)
+        return false;
+    auto peer = peers.find(clientSocket);
+    if(peer == nullptr)
+        return false;
+    std::lock_guard<std::mutex> lock(peer->mutex);
+    return peer->link.takesDescriptors;
+}
+
+//recv() that keeps the descriptors coming with the bytes. A read stops short behind them, even with MSG_WAITALL
+ssize_t NetworkCom::receiveFromSocket(int clientSocket, uint8_t *buffer, size_t len, int flags) {
+    alignas(cmsghdr) uint8_t control[CMSG_SPACE(DESCRIPTORS_PER_READ * sizeof(int))];
+    iovec iov{buffer, len};
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t received = recvmsg(clientSocket, &msg, flags | MSG_CMSG_CLOEXEC);
+    if(received >= 0 && msg.msg_controllen > 0)
+        descriptorsReceived(clientSocket, msg);
+    return received;
+}
+
+//The bytes received before the connection ended or failed, or the result of the first read if none
+ssize_t NetworkCom::receiveFully(int clientSocket, uint8_t *buffer, size_t len) {
+    size_t total = 0;
+    while(total < len) {
+        ssize_t received = receiveFromSocket(clientSocket, buffer + total, len - total, MSG_WAITALL);
+        if(received < 0 && errno == EINTR)
+            continue;
+        if(received <= 0)
+            return total > 0 ? static_cast<ssize_t>(total) : received;
+        total += received;
+    }
+    return static_cast<ssize_t>(total);
+}
+
+void NetworkCom::descriptorsReceived(int clientSocket, msghdr &msg) {
+    if(msg.msg_flags & MSG_CTRUNC)
+        getLogger()->warn("Socket {} sent more descriptors at once than we take, the rest were closed.", clientSocket);
+    auto peer = peers.context(clientSocket);
+    for(cmsghdr *header = CMSG_FIRSTHDR(&msg); header != nullptr; header = CMSG_NXTHDR(&msg, header)) {
+        if(header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS)
+            continue;
+        size_t count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for(size_t i=0; i<count; i++) {
+            int fd;
+            std::memcpy(&fd, CMSG_DATA(header) + i * sizeof(int), sizeof(int));
+            auto descriptor = std::make_unique<PassedDescriptor>(fd);
+            std::lock_guard<std::mutex> lock(peer->mutex);
+            if(peer->link.receivedDescriptors.size() >= RECEIVED_DESCRIPTORS_MAX) {
+                getLogger()->warn("Socket {} passes descriptors without frames for them.", clientSocket);
+                continue;
+            }
+            peer->link.receivedDescriptors.push_back(std::move(descriptor));
+        }
+    }
+}
+
+//The descriptor of the frame being handled, the oldest one that arrived
+std::unique_ptr<PassedDescriptor> NetworkCom::takeDescriptor(int clientSocket) {
+    auto peer = peers.find(clientSocket);
+    if(peer == nullptr)
+        return nullptr;
+    std::lock_guard<std::mutex> lock(peer->mutex);
+    auto &received = peer->link.receivedDescriptors;
+    if(received.empty())
+        return nullptr;
+    auto descriptor = std::move(received.front());
+    received.pop_front();
+    return descriptor;
+}
+
+//A memfd with a copy of the image, sealed so the peer can map it without us changing it under its feet
+static std::shared_ptr<const PassedDescriptor> sealedImage(const std::vector<uint8_t> &image) {
+    int fd = memfd_create("p2p-image", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if(fd < 0) {
+        getLogger()->warn("Cannot create a memfd for an image. errno: {}", errno);
+        return nullptr;
+    }
+    auto descriptor = std::make_shared<const PassedDescriptor>(fd);
+    size_t written = 0;
+    while(written < image.size()) {
+        ssize_t count = write(fd, image.data() + written, image.size() - written);
+        if(count < 0 && errno == EINTR)
+            continue;
+        if(count <= 0) {
+            getLogger()->warn("Cannot write an image to its memfd. errno: {}", errno);
+            return nullptr;
+        }
+        written += count;
+    }
+    if(fcntl(fd, F_ADD_SEALS, ATTACHED_IMAGE_SEALS | F_SEAL_SEAL) < 0) {
+        getLogger()->warn("Cannot seal the memfd of an image. errno: {}", errno);
+        return nullptr;
+    }
+    return descriptor;
+}
+
+//False, with the completion untouched, when the image cannot go as a descriptor
+bool NetworkCom::sendAttachedImage(int clientSocket, const ImageMessage &message, SendCompletion &completion) {
+    auto descriptor = sealedImage(*message.image);
+    if(descriptor == nullptr)
+        return false;
+    uint8_t prefix[BODY_PREFIX_MAX_LEN];
+    size_t prefixLength = encodeVarintField(messages::ImageMessage::kAttachedFieldNumber, message.image->size(),
+                                            prefix);
+
+    auto peer = peers.context(clientSocket);
+    std::lock_guard<std::recursive_mutex> lock(peer->sendMutex);
+    OutboundFrame frame;
+    frame.descriptor = std::move(descriptor);
+    frame.completion = std::move(completion);
+    if(!finishFrame(clientSocket, MessageType::IMAGE, prefix, prefixLength, frame)) {
+        frame.complete(false);
+        return true;
+    }
+    getLogger()->info("Passing an image of {} bytes to socket {} in a memfd", message.image->size(), clientSocket);
+    sendFrame(clientSocket, frame);
+    return true;
+}
+
+std::shared_ptr<std::vector<uint8_t>> NetworkCom::attachedImage(int clientSocket, const std::string &peerName,
+                                                                uint64_t size) {
+    auto descriptor = takeDescriptor(clientSocket);
+    if(descriptor == nullptr) {
+        getLogger()->error("IMAGE from {} came without its memfd.", peerName);
+        return nullptr;
+    }
+    //Mapping it is only safe while the peer cannot shrink it
+    struct stat imageStat{};
+    int seals = fcntl(descriptor->fd, F_GET_SEALS);
+    if(size > MAX_FRAME_BODY_LEN || seals < 0 || (seals & ATTACHED_IMAGE_SEALS) != ATTACHED_IMAGE_SEALS ||
+       fstat(descriptor->fd, &imageStat) < 0 || static_cast<uint64_t>(imageStat.st_size) < size) {
+        getLogger()->error("Dropping an IMAGE from {} that is not in a sealed memfd of {} bytes.", peerName, size);
+        return nullptr;
+    }
+    if(size == 0)
+        return std::make_shared<std::vector<uint8_t>>();
+    void *mapped = mmap(nullptr, size, PROT_READ, MAP_SHARED, descriptor->fd, 0);
+    if(mapped == MAP_FAILED) {
+        getLogger()->error("Cannot map an IMAGE from {}. errno: {}", peerName, errno);
+        return nullptr;
+    }
+    auto data = static_cast<const uint8_t*>(mapped);
+    auto image = std::make_shared<std::vector<uint8_t>>(data, data + size);
+    munmap(mapped, size);
+    return image;
+}
+
+//Copies file.size bytes from the passed file into file.fd without them entering our memory
+bool NetworkCom::copyAttachedFile(const std::string &peerName, int source, IncomingFile &file) {
+    size_t step = std::max<size_t>(config.fileChunkSize, 1);  //between progress reports
+    bool copyRange = true;
+    while(file.received < file.size) {
+        size_t len = std::min<uint64_t>(step, file.size - file.received);
+        auto offset = static_cast<off_t>(file.received);
+        ssize_t copied;
+        if(copyRange) {
+            copied = copy_file_range(source, &offset, file.fd, nullptr, len, 0);
+            if(copied < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+                //Not between these two files, sendfile() copies in the kernel too
+                copyRange = false;
+                continue;
+            }
+        } else {
+            copied = sendfile(file.fd, source, &offset, len);
+        }
+        if(copied < 0 && errno == EINTR)
+            continue;
+        if(copied <= 0) {
+            if(copied < 0)
+                getLogger()->error("Cannot copy into {}. errno: {}", file.path, errno);
+            return false;
+        }
+        file.received += copied;
+        uiCallbacks->fileProgress(peerName, file.name, file.received, file.size, true);
+    }
+    return true;
+}
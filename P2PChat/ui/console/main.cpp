@@ -36,8 +36,12 @@ int main(){
     init_logging();
     getLogger()->info("Start of the program....");
     UiCallbacks *cl(new CallBacks());
-    netOps1 = createNetworking(1234, cl);
-    std::unique_ptr<NetOps> netOps2 = createNetworking(2348, cl);
+    NetConfig localConfig;
+    localConfig.sharedMemoryRing = 4 * 1024 * 1024;  //both instances run on this host
+    netOps1 = createNetworking(1234, cl, localConfig);
+    NetConfig reactorConfig = localConfig;
+    reactorConfig.engine = NetEngine::EPOLL;
+    std::unique_ptr<NetOps> netOps2 = createNetworking(2348, cl, reactorConfig);
     sleep(1);
     Peer p = {"two_three", "127.0.0.1", 2348};
     netOps1->connectPeer(p);
@@ -13,12 +13,14 @@ ChatWindow::ChatWindow(QWidget *parent) : QMainWindow(parent)
     connect(this, &ChatWindow::updateChatSignal, this, &ChatWindow::updateChatSlot);
     connect(this, &ChatWindow::imageRecvSignal, this, &ChatWindow::imageRecvSlot);
     connect(this, &ChatWindow::removePeerSignal, this, &ChatWindow::removePeerSlot);
+    connect(this, &ChatWindow::peerConnectedSignal, this, &ChatWindow::peerConnectedSlot);
     connect(ui->lstAllPeers, &QListWidget::currentItemChanged, this, &ChatWindow::onCurrentItemChanged);
     connect(ui->edtChat, &QLineEdit::returnPressed, this, &ChatWindow::on_btnSend_clicked);
 
     readPeersInfo();
     ui->btnSend->setEnabled(false);
     ui->btnImage->setEnabled(false);
+    ui->btnFile->setEnabled(false);
     ui->edtPort->setText("1337");
     ui->edtName->setText("EliteQt");
 }
@@ -35,6 +37,7 @@ void ChatWindow::showContextMenu(const QPoint &pos) {
     QPoint globalPos = ui->lstAllPeers->mapToGlobal(pos);
     QMenu connMenu;
     connMenu.addAction("Connect", this, SLOT(connectPeer()));
+    connMenu.addAction("Connect All", this, SLOT(connectAllPeers()));
     connMenu.exec(globalPos);
 }
 
@@ -42,20 +45,44 @@ void ChatWindow::connectPeer() {
     auto currentItem = ui->lstAllPeers->currentItem();
     const QString &name = currentItem->text();
     auto peer = peersInfo->find(name.toStdString());
+    connectPeers({peer->second});
+}
+
+void ChatWindow::connectAllPeers() {
+    std::vector<Peer> peers;
+    for(auto &peer : *peersInfo)
+        peers.push_back(peer.second);
+    connectPeers(peers);
+}
 
-    if(networking->connectPeer(peer->second)) {
-        AuthMessage auth(ui->edtName->text().toStdString());
-        try {
-            networking->sendMessage(peer->second.name, auth);
-        }catch (...){}
+//Returns right away, an unreachable peer must not freeze the window. netlib sends our AUTH itself
+void ChatWindow::connectPeers(const std::vector<Peer> &peers) {
+    AuthMessage auth(ui->edtName->text().toStdString());
+    networking->connectPeers(peers, auth, [this](const Peer &peer, bool connected){
+        emit peerConnectedSignal(QString(peer.name.c_str()), connected);
+    });
+}
 
-        currentItem->setForeground(QBrush(QColor(Qt::green)));
+void ChatWindow::peerConnectedSlot(QString peer, bool connected) {
+    if(!connected) {
+        emit updateChatSignal(peer, "------ Cannot connect ------");
+        return;
+    }
+
+    for(auto i=0; i<ui->lstAllPeers->count(); i++){
+        auto item = ui->lstAllPeers->item(i);
+        if(peer == item->text()){
+            item->setForeground(QBrush(QColor(Qt::green)));
+            break;
+        }
+    }
+    if(ui->lstAllPeers->currentItem() != nullptr && ui->lstAllPeers->currentItem()->text() == peer) {
         ui->btnSend->setEnabled(true);
         ui->btnImage->setEnabled(true);
-
-        emit updateChatSignal(QString(peer->second.name.c_str()),
-                              "------ Chat Started ------");
+        ui->btnFile->setEnabled(true);
     }
+
+    emit updateChatSignal(peer, "------ Chat Started ------");
 }
 
 ChatWindow::~ChatWindow() {
@@ -82,6 +109,17 @@ void ChatWindow::on_btnImage_clicked() {
 
 }
 
+void ChatWindow::on_btnFile_clicked() {
+    QString fileName = QFileDialog::getOpenFileName(this, tr("Send File"), "", tr("All files (*.*)"));
+    if (!fileName.isEmpty()) {
+        //netlib streams the file from disk, it is never loaded here
+        FileMessage fileMessage(fileName.toStdString());
+        auto peerName = ui->lstAllPeers->currentItem()->text();
+        networking->sendMessage(peerName.toStdString(), fileMessage);
+        emit updateChatSignal(peerName, "[SND]: file " + fileName);
+    }
+}
+
 void ChatWindow::on_btnSend_clicked() {
     auto msgText = ui->edtChat->text();
     auto peerName = ui->lstAllPeers->currentItem()->text();
@@ -133,9 +171,11 @@ void ChatWindow::bindSlot() {
 void ChatWindow::onCurrentItemChanged(QListWidgetItem *current, QListWidgetItem *previous) {
     ui->btnSend->setEnabled(false);
     ui->btnImage->setEnabled(false);
+    ui->btnFile->setEnabled(false);
     if(current->foreground() == QBrush(QColor(Qt::green))){
         ui->btnSend->setEnabled(true);
         ui->btnImage->setEnabled(true);
+        ui->btnFile->setEnabled(true);
     }
     auto peer = peersInfo->find(current->text().toStdString());
     if(peer!=peersInfo->end()){
@@ -185,6 +225,23 @@ void ChatWindow::newImageMessage(std::string peerName, std::unique_ptr<ImageMess
     emit imageRecvSignal(title, *imgMsg->image);
 }
 
+void ChatWindow::newFileMessage(std::string peerName, std::unique_ptr<FileMessage> fileMsg) {
+    emit updateChatSignal(QString(peerName.c_str()), "[RCV]: file saved to " + QString(fileMsg->path.c_str()));
+}
+
+void ChatWindow::fileProgress(std::string peerName, std::string fileName, uint64_t transferred,
+                              uint64_t total, bool incoming) {
+    getLogger()->info("{} {} {}: {}/{} bytes", incoming ? "Receiving" : "Sending", fileName,
+                      incoming ? "from" : "to", transferred, total);
+}
+
+void ChatWindow::peerBackpressured(std::string peerName) {
+    emit updateChatSignal(QString(peerName.c_str()), "------ Peer is slow, messages are queued ------");
+}
+
+void ChatWindow::peerWritable(std::string peerName) {
+    emit updateChatSignal(QString(peerName.c_str()), "------ Peer caught up ------");
+}
 
 void ChatWindow::updateCurrentPeerChat() {
     ui->lstChat->clear();
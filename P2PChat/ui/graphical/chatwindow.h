@@ -5,6 +5,7 @@
 #include <QMenu>
 #include <QMessageBox>
 #include <QListWidgetItem>
+#include <map>
 #include "PeersInfo.h"
 #include "dataio.h"
 #include "UiNetlibInterfaces.h"
@@ -26,24 +27,33 @@ public:
     void newTextMessage(std::string peerName, std::unique_ptr<TextMessage> txtMsg) override;
     void newImageMessage(std::string peerName, std::unique_ptr<ImageMessage> imgMsg) override;
     void peerDisconnected(const std::string peerName) override;
+    void newFileMessage(std::string peerName, std::unique_ptr<FileMessage> fileMsg) override;
+    void fileProgress(std::string peerName, std::string fileName, uint64_t transferred,
+                      uint64_t total, bool incoming) override;
+    void peerBackpressured(std::string peerName) override;
+    void peerWritable(std::string peerName) override;
 
 signals:
     void bindSignal();
     void updateChatSignal(QString peer, QString msg);
     void imageRecvSignal(QString title, const std::vector<uint8_t>&imageData);
     void removePeerSignal(QString peer);
+    void peerConnectedSignal(QString peer, bool connected);
 
 private slots:
     void bindSlot();
     void updateChatSlot(QString, QString);
     void imageRecvSlot(QString title, const std::vector<uint8_t>&imageData);
     void removePeerSlot(QString peer);
+    void peerConnectedSlot(QString peer, bool connected);
 
     void on_btnImage_clicked();
+    void on_btnFile_clicked();
     void on_btnSend_clicked();
     void on_btnListen_clicked();
     void showContextMenu(const QPoint&);
     void connectPeer();
+    void connectAllPeers();
     void onCurrentItemChanged(QListWidgetItem* current, QListWidgetItem* previous);
 
 private:
@@ -54,6 +64,7 @@ private:
 
     void readPeersInfo();
     void updateCurrentPeerChat();
+    void connectPeers(const std::vector<Peer> &peers);
 
 protected:
     void closeEvent(QCloseEvent *event) override;